@@ -5,8 +5,27 @@
 #ifndef APPLICATION_LIB_FAR_ALIGNMENT_H_
 #define APPLICATION_LIB_FAR_ALIGNMENT_H_
 
+#include <stdint.h>
+
 namespace archive {
 
+constexpr uint64_t kPageSize = 4096;
+
+// The range of alignments allowed for file data. The upper bound is the size
+// of a huge page, which lets large files be mapped with huge pages.
+constexpr uint64_t kMinDataAlignment = 8;
+constexpr uint64_t kMaxDataAlignment = 2 * 1024 * 1024;
+
+constexpr inline bool IsValidDataAlignment(uint64_t alignment) {
+  return alignment >= kMinDataAlignment && alignment <= kMaxDataAlignment &&
+         (alignment & (alignment - 1)) == 0;
+}
+
+// |alignment| must be a power of two.
+constexpr inline uint64_t AlignTo(uint64_t offset, uint64_t alignment) {
+  return (offset + alignment - 1) & ~(alignment - 1);
+}
+
 constexpr inline uint64_t AlignToPage(uint64_t offset) {
   return (offset + 4095u) & ~4095ull;
 }
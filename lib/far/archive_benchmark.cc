@@ -0,0 +1,318 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Benchmarks for the FAR library.
+//
+// Generates a synthetic set of files, packs them into an archive and measures
+// the performance of the common operations on it. Results are printed to
+// stdout as a single JSON object so that they can be collected and compared
+// across runs.
+//
+// Usage: far_benchmarks [--files=<count>] [--min-size=<bytes>]
+//                       [--max-size=<bytes>] [--depth=<count>]
+//                       [--iterations=<count>] [--jobs=<count>]
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "application/lib/far/archive_entry.h"
+#include "application/lib/far/archive_reader.h"
+#include "application/lib/far/archive_writer.h"
+#include "lib/ftl/command_line.h"
+#include "lib/ftl/files/directory.h"
+#include "lib/ftl/files/file.h"
+#include "lib/ftl/files/scoped_temp_dir.h"
+#include "lib/ftl/files/unique_fd.h"
+#include "lib/ftl/strings/string_number_conversions.h"
+
+namespace archive {
+namespace {
+
+struct Config {
+  uint64_t files = 1000;
+  uint64_t min_size = 64;
+  uint64_t max_size = 256 * 1024;
+  uint64_t depth = 3;
+  uint64_t iterations = 10;
+  uint64_t jobs = 1;
+};
+
+struct Result {
+  std::string name;
+  double seconds = 0;
+  uint64_t operations = 0;
+  uint64_t bytes = 0;
+};
+
+class Timer {
+ public:
+  Timer() : start_(std::chrono::steady_clock::now()) {}
+
+  double Elapsed() const {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start_;
+    return elapsed.count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+bool ReadOption(const ftl::CommandLine& command_line,
+                ftl::StringView name,
+                uint64_t* value) {
+  std::string string_value;
+  if (!command_line.GetOptionValue(name, &string_value))
+    return true;
+  if (!ftl::StringToNumberWithError(string_value, value)) {
+    fprintf(stderr, "error: Invalid --%.*s argument: '%s'.\n",
+            static_cast<int>(name.size()), name.data(), string_value.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool ParseConfig(const ftl::CommandLine& command_line, Config* config) {
+  return ReadOption(command_line, "files", &config->files) &&
+         ReadOption(command_line, "min-size", &config->min_size) &&
+         ReadOption(command_line, "max-size", &config->max_size) &&
+         ReadOption(command_line, "depth", &config->depth) &&
+         ReadOption(command_line, "iterations", &config->iterations) &&
+         ReadOption(command_line, "jobs", &config->jobs) &&
+         config->min_size <= config->max_size && config->iterations > 0;
+}
+
+// Returns a path |depth| directories deep. Files are spread over a few
+// directories at every level, like the contents of a typical package.
+std::string MakePath(uint64_t index, uint64_t depth, std::mt19937_64* random) {
+  std::string path;
+  for (uint64_t level = 0; level < depth; ++level)
+    path += "dir" + std::to_string((*random)() % 8) + "/";
+  return path + "file" + std::to_string(index);
+}
+
+// Sizes are distributed log-uniformly, so small files dominate the count and
+// large files dominate the bytes.
+uint64_t MakeSize(const Config& config, std::mt19937_64* random) {
+  std::uniform_real_distribution<double> distribution(
+      std::log(static_cast<double>(config.min_size + 1)),
+      std::log(static_cast<double>(config.max_size + 1)));
+  return static_cast<uint64_t>(std::exp(distribution(*random))) - 1;
+}
+
+bool GenerateFiles(const Config& config,
+                   const std::string& root,
+                   std::vector<std::string>* paths,
+                   uint64_t* total_bytes) {
+  std::mt19937_64 random(42);
+  std::string contents;
+  *total_bytes = 0;
+  for (uint64_t i = 0; i < config.files; ++i) {
+    std::string path = MakePath(i, config.depth, &random);
+    uint64_t size = MakeSize(config, &random);
+    contents.resize(size);
+    for (auto& c : contents)
+      c = static_cast<char>(random());
+    std::string src_path = root + "/" + path;
+    if (!files::CreateDirectory(src_path.substr(0, src_path.rfind('/'))) ||
+        !files::WriteFile(src_path, contents.data(), contents.size())) {
+      fprintf(stderr, "error: Failed to write '%s'.\n", src_path.c_str());
+      return false;
+    }
+    paths->push_back(path);
+    *total_bytes += size;
+  }
+  return true;
+}
+
+bool BenchmarkWrite(const Config& config,
+                    const std::string& root,
+                    const std::vector<std::string>& paths,
+                    const std::string& archive_path,
+                    uint64_t total_bytes,
+                    Result* result) {
+  result->name = "write";
+  for (uint64_t i = 0; i < config.iterations; ++i) {
+    ArchiveWriter writer;
+    writer.set_jobs(config.jobs);
+    for (const auto& path : paths)
+      writer.Add(ArchiveEntry(root + "/" + path, path));
+    ftl::UniqueFD fd(open(archive_path.c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                          S_IRUSR | S_IWUSR));
+    Timer timer;
+    if (!fd.is_valid() || !writer.Write(fd.get()))
+      return false;
+    result->seconds += timer.Elapsed();
+    result->operations += 1;
+    result->bytes += total_bytes;
+  }
+  return true;
+}
+
+bool BenchmarkOpen(const Config& config,
+                   const std::string& archive_path,
+                   bool map,
+                   Result* result) {
+  result->name = map ? "open_mapped" : "open";
+  for (uint64_t i = 0; i < config.iterations; ++i) {
+    Timer timer;
+    ArchiveReader reader(ftl::UniqueFD(open(archive_path.c_str(), O_RDONLY)));
+    if (!(map ? reader.MapAndRead() : reader.Read()))
+      return false;
+    result->seconds += timer.Elapsed();
+    result->operations += 1;
+  }
+  return true;
+}
+
+bool BenchmarkLookup(const Config& config,
+                     const ArchiveReader& reader,
+                     const std::vector<std::string>& paths,
+                     bool hit,
+                     Result* result) {
+  result->name = hit ? "lookup_hit" : "lookup_miss";
+  std::vector<std::string> queries;
+  for (const auto& path : paths)
+    queries.push_back(hit ? path : path + ".missing");
+  DirectoryTableEntry entry;
+  for (uint64_t i = 0; i < config.iterations; ++i) {
+    Timer timer;
+    for (const auto& query : queries) {
+      if (reader.GetDirectoryEntry(query, &entry) != hit)
+        return false;
+    }
+    result->seconds += timer.Elapsed();
+    result->operations += queries.size();
+  }
+  return true;
+}
+
+bool BenchmarkCopyFile(const Config& config,
+                       const ArchiveReader& reader,
+                       const std::vector<std::string>& paths,
+                       uint64_t total_bytes,
+                       Result* result) {
+  result->name = "copy_file";
+  ftl::UniqueFD null_fd(open("/dev/null", O_WRONLY));
+  if (!null_fd.is_valid())
+    return false;
+  for (uint64_t i = 0; i < config.iterations; ++i) {
+    Timer timer;
+    for (const auto& path : paths) {
+      if (!reader.CopyFile(path, null_fd.get()))
+        return false;
+    }
+    result->seconds += timer.Elapsed();
+    result->operations += paths.size();
+    result->bytes += total_bytes;
+  }
+  return true;
+}
+
+bool BenchmarkExtractFile(const Config& config,
+                          const ArchiveReader& reader,
+                          const std::vector<std::string>& paths,
+                          const std::string& output_path,
+                          uint64_t total_bytes,
+                          Result* result) {
+  result->name = "extract_file";
+  for (uint64_t i = 0; i < config.iterations; ++i) {
+    Timer timer;
+    for (const auto& path : paths) {
+      if (!reader.ExtractFile(path, output_path.c_str()))
+        return false;
+    }
+    result->seconds += timer.Elapsed();
+    result->operations += paths.size();
+    result->bytes += total_bytes;
+  }
+  return true;
+}
+
+void PrintResults(const Config& config, const std::vector<Result>& results) {
+  printf("{\n");
+  printf(
+      "  \"config\": {\"files\": %llu, \"min_size\": %llu, \"max_size\": %llu, "
+      "\"depth\": %llu, \"iterations\": %llu, \"jobs\": %llu},\n",
+      static_cast<unsigned long long>(config.files),
+      static_cast<unsigned long long>(config.min_size),
+      static_cast<unsigned long long>(config.max_size),
+      static_cast<unsigned long long>(config.depth),
+      static_cast<unsigned long long>(config.iterations),
+      static_cast<unsigned long long>(config.jobs));
+  printf("  \"results\": [\n");
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Result& result = results[i];
+    double ns_per_op =
+        result.operations ? result.seconds * 1e9 / result.operations : 0;
+    double mb_per_second =
+        result.seconds > 0 ? result.bytes / result.seconds / 1e6 : 0;
+    printf(
+        "    {\"name\": \"%s\", \"seconds\": %.6f, \"operations\": %llu, "
+        "\"bytes\": %llu, \"ns_per_op\": %.1f, \"mb_per_second\": %.1f}%s\n",
+        result.name.c_str(), result.seconds,
+        static_cast<unsigned long long>(result.operations),
+        static_cast<unsigned long long>(result.bytes), ns_per_op,
+        mb_per_second, i + 1 < results.size() ? "," : "");
+  }
+  printf("  ]\n}\n");
+}
+
+int RunBenchmarks(const Config& config) {
+  files::ScopedTempDir temp_dir;
+  std::string root = temp_dir.path() + "/src";
+  std::vector<std::string> paths;
+  uint64_t total_bytes = 0;
+  if (!GenerateFiles(config, root, &paths, &total_bytes))
+    return -1;
+
+  std::string archive_path = temp_dir.path() + "/archive.far";
+  std::string output_path = temp_dir.path() + "/output";
+  std::vector<Result> results(7);
+  if (!BenchmarkWrite(config, root, paths, archive_path, total_bytes,
+                      &results[0]) ||
+      !BenchmarkOpen(config, archive_path, false, &results[1]) ||
+      !BenchmarkOpen(config, archive_path, true, &results[2])) {
+    fprintf(stderr, "error: Benchmark failed.\n");
+    return -1;
+  }
+
+  ArchiveReader reader(ftl::UniqueFD(open(archive_path.c_str(), O_RDONLY)));
+  if (!reader.Read() ||
+      !BenchmarkLookup(config, reader, paths, true, &results[3]) ||
+      !BenchmarkLookup(config, reader, paths, false, &results[4]) ||
+      !BenchmarkCopyFile(config, reader, paths, total_bytes, &results[5]) ||
+      !BenchmarkExtractFile(config, reader, paths, output_path, total_bytes,
+                            &results[6])) {
+    fprintf(stderr, "error: Benchmark failed.\n");
+    return -1;
+  }
+
+  PrintResults(config, results);
+  return 0;
+}
+
+}  // namespace
+}  // namespace archive
+
+int main(int argc, char** argv) {
+  ftl::CommandLine command_line = ftl::CommandLineFromArgcArgv(argc, argv);
+  archive::Config config;
+  if (!archive::ParseConfig(command_line, &config)) {
+    fprintf(stderr,
+            "Usage: far_benchmarks [--files=<count>] [--min-size=<bytes>] "
+            "[--max-size=<bytes>] [--depth=<count>] [--iterations=<count>] "
+            "[--jobs=<count>]\n");
+    return -1;
+  }
+  return archive::RunBenchmarks(config);
+}
@@ -0,0 +1,152 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "application/lib/far/archive_cache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <tuple>
+#include <utility>
+
+namespace archive {
+namespace {
+
+constexpr uint64_t kSharedCacheCapacity = 64 * 1024 * 1024;
+
+}  // namespace
+
+bool ArchiveIdentity::operator<(const ArchiveIdentity& other) const {
+  return std::tie(device, inode, size, modification_time) <
+         std::tie(other.device, other.inode, other.size,
+                  other.modification_time);
+}
+
+bool GetFileIdentity(int fd, ArchiveIdentity* identity) {
+  struct stat info;
+  if (fstat(fd, &info) < 0)
+    return false;
+  identity->device = info.st_dev;
+  identity->inode = info.st_ino;
+  identity->size = info.st_size;
+#if defined(__APPLE__)
+  const struct timespec& modification_time = info.st_mtimespec;
+#else
+  const struct timespec& modification_time = info.st_mtim;
+#endif
+  identity->modification_time =
+      static_cast<int64_t>(modification_time.tv_sec) * 1000000000 +
+      modification_time.tv_nsec;
+  return true;
+}
+
+ArchiveCache::ArchiveCache(uint64_t capacity) : capacity_(capacity) {}
+
+ArchiveCache::~ArchiveCache() = default;
+
+ArchiveCache* ArchiveCache::GetShared() {
+  static ArchiveCache* cache = new ArchiveCache(kSharedCacheCapacity);
+  return cache;
+}
+
+std::shared_ptr<const ArchiveReader> ArchiveCache::Open(const char* path) {
+  ftl::UniqueFD fd(open(path, O_RDONLY));
+  if (!fd.is_valid()) {
+    fprintf(stderr, "error: Failed to open '%s'.\n", path);
+    return nullptr;
+  }
+  return Open(std::move(fd));
+}
+
+std::shared_ptr<const ArchiveReader> ArchiveCache::Open(ftl::UniqueFD fd) {
+  ArchiveIdentity identity;
+  if (!GetFileIdentity(fd.get(), &identity)) {
+    fprintf(stderr, "error: Failed to read identity of archive.\n");
+    return nullptr;
+  }
+  if (std::shared_ptr<const ArchiveReader> reader = Lookup(identity))
+    return reader;
+
+  // Read the archive without holding the lock, so that other archives can be
+  // opened meanwhile.
+  auto reader = std::make_shared<ArchiveReader>(std::move(fd));
+  if (!reader->Read())
+    return nullptr;
+  return Insert(identity, std::move(reader));
+}
+
+std::shared_ptr<const ArchiveReader> ArchiveCache::Lookup(
+    const ArchiveIdentity& identity) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(identity);
+  if (it == index_.end()) {
+    ++miss_count_;
+    return nullptr;
+  }
+  ++hit_count_;
+  entries_.splice(entries_.begin(), entries_, it->second);
+  std::shared_ptr<const ArchiveReader> reader = it->second->reader;
+  UpdateCharge(&*it->second);
+  Evict();
+  return reader;
+}
+
+std::shared_ptr<const ArchiveReader> ArchiveCache::Insert(
+    const ArchiveIdentity& identity,
+    std::shared_ptr<const ArchiveReader> reader) {
+  uint64_t charge = reader->GetMemoryUsage();
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(identity);
+  if (it != index_.end()) {
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->reader;
+  }
+  if (charge > capacity_)
+    return reader;  // Too large to cache.
+
+  Entry entry;
+  entry.identity = identity;
+  entry.reader = reader;
+  entry.charge = charge;
+  entries_.push_front(std::move(entry));
+  index_[identity] = entries_.begin();
+  size_ += charge;
+  for (auto& cached : entries_)
+    UpdateCharge(&cached);
+  Evict();
+  return reader;
+}
+
+uint64_t ArchiveCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return size_;
+}
+
+uint64_t ArchiveCache::hit_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return hit_count_;
+}
+
+uint64_t ArchiveCache::miss_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return miss_count_;
+}
+
+void ArchiveCache::UpdateCharge(Entry* entry) {
+  uint64_t charge = entry->reader->GetMemoryUsage();
+  size_ = size_ - entry->charge + charge;
+  entry->charge = charge;
+}
+
+void ArchiveCache::Evict() {
+  while (size_ > capacity_) {
+    const Entry& oldest = entries_.back();
+    size_ -= oldest.charge;
+    index_.erase(oldest.identity);
+    entries_.pop_back();
+  }
+}
+
+}  // namespace archive
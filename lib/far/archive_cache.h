@@ -0,0 +1,106 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef APPLICATION_LIB_FAR_ARCHIVE_CACHE_H_
+#define APPLICATION_LIB_FAR_ARCHIVE_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "application/lib/far/archive_reader.h"
+#include "lib/ftl/files/unique_fd.h"
+
+namespace archive {
+
+// Identifies the contents of an archive. Two files with the same identity are
+// assumed to hold the same archive.
+struct ArchiveIdentity {
+  uint64_t device = 0;
+  uint64_t inode = 0;
+  uint64_t size = 0;
+  int64_t modification_time = 0;  // In nanoseconds.
+
+  bool operator<(const ArchiveIdentity& other) const;
+};
+
+// Reads the identity of the file open as |fd|.
+bool GetFileIdentity(int fd, ArchiveIdentity* identity);
+
+// A thread-safe cache of readers that have read their archive, shared by
+// everything in a process that opens the same archives repeatedly.
+//
+// Readers are handed out as shared pointers to const readers, whose methods
+// are safe to call concurrently. Each reader is charged for the heap memory it
+// holds, which is updated whenever the cache is used because readers of
+// front-coded names grow as they expand paths. When the memory charged to the
+// cached readers exceeds the capacity of the cache, the least recently used
+// readers are dropped from the cache, but remain valid for as long as they are
+// in use.
+class ArchiveCache {
+ public:
+  explicit ArchiveCache(uint64_t capacity);
+  ~ArchiveCache();
+  ArchiveCache(const ArchiveCache& other) = delete;
+  ArchiveCache& operator=(const ArchiveCache& other) = delete;
+
+  // Returns the cache shared by the whole process, which has a capacity of
+  // 64 MiB.
+  static ArchiveCache* GetShared();
+
+  // Returns a reader for the archive at |path|, reading it if it is not
+  // cached or has changed since it was cached. Returns null if the archive
+  // cannot be read.
+  std::shared_ptr<const ArchiveReader> Open(const char* path);
+
+  // Returns a reader for the archive open as |fd|, which is closed if a
+  // reader for the same file is already cached.
+  std::shared_ptr<const ArchiveReader> Open(ftl::UniqueFD fd);
+
+  // Returns the reader cached for |identity|, or null if there is none. Used
+  // with |Insert| to cache readers of archives that are not files.
+  std::shared_ptr<const ArchiveReader> Lookup(const ArchiveIdentity& identity);
+
+  // Caches |reader|, which must have read its archive, for |identity|.
+  // Returns the reader cached for |identity|, which is a reader inserted
+  // concurrently by another thread if there is one.
+  std::shared_ptr<const ArchiveReader> Insert(
+      const ArchiveIdentity& identity,
+      std::shared_ptr<const ArchiveReader> reader);
+
+  // The memory charged to the cached readers, in bytes.
+  uint64_t size() const;
+
+  uint64_t hit_count() const;
+  uint64_t miss_count() const;
+
+ private:
+  struct Entry {
+    ArchiveIdentity identity;
+    std::shared_ptr<const ArchiveReader> reader;
+    uint64_t charge = 0;
+  };
+
+  // Updates the charge of |entry| to the current memory usage of its reader.
+  void UpdateCharge(Entry* entry);
+
+  // Drops the least recently used readers until the cache fits its capacity.
+  void Evict();
+
+  const uint64_t capacity_;
+  mutable std::mutex mutex_;
+  std::list<Entry> entries_;  // Most recently used first.
+  std::map<ArchiveIdentity, std::list<Entry>::iterator> index_;
+  uint64_t size_ = 0;
+  uint64_t hit_count_ = 0;
+  uint64_t miss_count_ = 0;
+};
+
+}  // namespace archive
+
+#endif  // APPLICATION_LIB_FAR_ARCHIVE_CACHE_H_
@@ -0,0 +1,156 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "application/lib/far/archive_cache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "application/lib/far/archive_writer.h"
+#include "gtest/gtest.h"
+#include "lib/ftl/files/scoped_temp_dir.h"
+#include "lib/ftl/files/unique_fd.h"
+
+namespace archive {
+namespace {
+
+class ArchiveCacheTest : public ::testing::Test {
+ protected:
+  // Writes an archive holding |paths| to a new file and returns its path.
+  std::string WriteArchive(const std::vector<std::string>& paths) {
+    std::string archive_path;
+    EXPECT_TRUE(temp_dir_.NewTempFile(&archive_path));
+    ArchiveWriter writer;
+    for (const auto& path : paths)
+      EXPECT_TRUE(writer.Add(ArchiveEntry::FromBuffer(path, path)));
+    ftl::UniqueFD fd(open(archive_path.c_str(), O_RDWR | O_TRUNC));
+    EXPECT_TRUE(writer.Write(fd.get()));
+    return archive_path;
+  }
+
+  files::ScopedTempDir temp_dir_;
+};
+
+TEST_F(ArchiveCacheTest, SharesReaders) {
+  ArchiveCache cache(1024 * 1024);
+  std::string path = WriteArchive({"a", "b"});
+  std::shared_ptr<const ArchiveReader> first = cache.Open(path.c_str());
+  ASSERT_NE(nullptr, first);
+  EXPECT_EQ(2u, first->file_count());
+  EXPECT_EQ(first, cache.Open(path.c_str()));
+  EXPECT_EQ(first, cache.Open(ftl::UniqueFD(open(path.c_str(), O_RDONLY))));
+  EXPECT_EQ(1u, cache.miss_count());
+  EXPECT_EQ(2u, cache.hit_count());
+  EXPECT_EQ(first->GetMemoryUsage(), cache.size());
+
+  EXPECT_EQ(nullptr, cache.Open((path + ".missing").c_str()));
+}
+
+TEST_F(ArchiveCacheTest, RereadsChangedArchives) {
+  ArchiveCache cache(1024 * 1024);
+  std::string path = WriteArchive({"a"});
+  std::shared_ptr<const ArchiveReader> first = cache.Open(path.c_str());
+  ASSERT_NE(nullptr, first);
+
+  std::string other_path = WriteArchive({"a", "b", "c"});
+  ASSERT_EQ(0, rename(other_path.c_str(), path.c_str()));
+  std::shared_ptr<const ArchiveReader> second = cache.Open(path.c_str());
+  ASSERT_NE(nullptr, second);
+  EXPECT_NE(first, second);
+  EXPECT_EQ(1u, first->file_count());
+  EXPECT_EQ(3u, second->file_count());
+}
+
+TEST_F(ArchiveCacheTest, EvictsLeastRecentlyUsed) {
+  std::vector<std::string> paths = {WriteArchive({"a"}), WriteArchive({"b"}),
+                                    WriteArchive({"c"})};
+  ArchiveReader reader(ftl::UniqueFD(open(paths[0].c_str(), O_RDONLY)));
+  ASSERT_TRUE(reader.Read());
+
+  // Room for two of the archives.
+  ArchiveCache cache(2 * reader.GetMemoryUsage() + 1);
+  std::shared_ptr<const ArchiveReader> a = cache.Open(paths[0].c_str());
+  std::shared_ptr<const ArchiveReader> b = cache.Open(paths[1].c_str());
+  EXPECT_EQ(a, cache.Open(paths[0].c_str()));
+  std::shared_ptr<const ArchiveReader> c = cache.Open(paths[2].c_str());
+  EXPECT_LE(cache.size(), 2 * reader.GetMemoryUsage() + 1);
+
+  // |b| was evicted, but remains usable.
+  EXPECT_EQ(a, cache.Open(paths[0].c_str()));
+  EXPECT_EQ(c, cache.Open(paths[2].c_str()));
+  EXPECT_NE(b, cache.Open(paths[1].c_str()));
+  DirectoryTableEntry entry;
+  EXPECT_TRUE(b->GetDirectoryEntry("b", &entry));
+}
+
+TEST_F(ArchiveCacheTest, ChargesOnlyMetadata) {
+  std::string archive_path;
+  ASSERT_TRUE(temp_dir_.NewTempFile(&archive_path));
+  ArchiveWriter writer;
+  writer.set_front_coded_names(true);
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_TRUE(writer.Add(ArchiveEntry::FromBuffer(
+        std::string(64 * 1024, 'x'), "data/file" + std::to_string(i))));
+  }
+  ftl::UniqueFD fd(open(archive_path.c_str(), O_RDWR | O_TRUNC));
+  ASSERT_TRUE(writer.Write(fd.get()));
+
+  // The archive is much larger than the cache, but its metadata is not.
+  ArchiveCache cache(1024 * 1024);
+  auto reader = std::make_shared<ArchiveReader>(std::move(fd));
+  ASSERT_TRUE(reader->MapAndRead());
+  ArchiveIdentity identity;
+  EXPECT_EQ(reader, cache.Insert(identity, reader));
+  EXPECT_EQ(reader, cache.Lookup(identity));
+  uint64_t size = cache.size();
+
+  // Expanding front-coded paths grows the charge of the reader.
+  reader->ListDirectory([&reader](const DirectoryTableEntry& entry) {
+    reader->GetPathView(entry);
+  });
+  EXPECT_EQ(reader, cache.Lookup(identity));
+  EXPECT_LT(size, cache.size());
+  EXPECT_EQ(reader->GetMemoryUsage(), cache.size());
+}
+
+TEST_F(ArchiveCacheTest, ChargesArchivesInMemory) {
+  std::string path = WriteArchive({"a", "b"});
+  ftl::UniqueFD fd(open(path.c_str(), O_RDONLY));
+  std::vector<uint64_t> data(lseek(fd.get(), 0, SEEK_END) / sizeof(uint64_t));
+  ASSERT_EQ(static_cast<ssize_t>(data.size() * sizeof(uint64_t)),
+            pread(fd.get(), data.data(), data.size() * sizeof(uint64_t), 0));
+
+  // Memory handed to a reader may never be released, so it is charged.
+  ArchiveReader reader(reinterpret_cast<const char*>(data.data()),
+                       data.size() * sizeof(uint64_t));
+  ASSERT_TRUE(reader.Read());
+  EXPECT_LT(data.size() * sizeof(uint64_t), reader.GetMemoryUsage());
+}
+
+TEST_F(ArchiveCacheTest, LookupAndInsert) {
+  ArchiveCache cache(1024 * 1024);
+  ArchiveIdentity identity;
+  identity.inode = 42;
+  EXPECT_EQ(nullptr, cache.Lookup(identity));
+
+  std::string path = WriteArchive({"a"});
+  auto reader = std::make_shared<ArchiveReader>(
+      ftl::UniqueFD(open(path.c_str(), O_RDONLY)));
+  ASSERT_TRUE(reader->Read());
+  EXPECT_EQ(reader, cache.Insert(identity, reader));
+  EXPECT_EQ(reader, cache.Lookup(identity));
+
+  // A reader inserted concurrently for the same identity loses.
+  auto other = std::make_shared<ArchiveReader>(
+      ftl::UniqueFD(open(path.c_str(), O_RDONLY)));
+  ASSERT_TRUE(other->Read());
+  EXPECT_EQ(reader, cache.Insert(identity, other));
+}
+
+}  // namespace
+}  // namespace archive
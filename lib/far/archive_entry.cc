@@ -16,17 +16,66 @@ ArchiveEntry::ArchiveEntry(std::string src_path, std::string dst_path)
 ArchiveEntry::~ArchiveEntry() = default;
 
 ArchiveEntry::ArchiveEntry(ArchiveEntry&& other)
-    : src_path(std::move(other.src_path)),
-      dst_path(std::move(other.dst_path)) {}
+    : source(other.source),
+      src_path(std::move(other.src_path)),
+      dst_path(std::move(other.dst_path)),
+      data(std::move(other.data)),
+      src_fd(other.src_fd),
+      src_offset(other.src_offset),
+      src_length(other.src_length),
+      src_archive(other.src_archive),
+      compress(other.compress),
+      alignment(other.alignment) {}
 
 ArchiveEntry& ArchiveEntry::operator=(ArchiveEntry&& other) {
   swap(other);
   return *this;
 }
 
+ArchiveEntry ArchiveEntry::FromBuffer(std::string data,
+                                      std::string dst_path) {
+  ArchiveEntry entry;
+  entry.source = Source::kBuffer;
+  entry.dst_path = std::move(dst_path);
+  entry.data = std::move(data);
+  return entry;
+}
+
+ArchiveEntry ArchiveEntry::FromFileDescriptor(int fd,
+                                              uint64_t offset,
+                                              uint64_t length,
+                                              std::string dst_path) {
+  ArchiveEntry entry;
+  entry.source = Source::kFileDescriptor;
+  entry.dst_path = std::move(dst_path);
+  entry.src_fd = fd;
+  entry.src_offset = offset;
+  entry.src_length = length;
+  return entry;
+}
+
+ArchiveEntry ArchiveEntry::FromArchive(const ArchiveReader* archive,
+                                       std::string archive_path,
+                                       std::string dst_path) {
+  ArchiveEntry entry;
+  entry.source = Source::kArchive;
+  entry.src_path = std::move(archive_path);
+  entry.dst_path = std::move(dst_path);
+  entry.src_archive = archive;
+  return entry;
+}
+
 void ArchiveEntry::swap(ArchiveEntry& other) {
+  std::swap(source, other.source);
   src_path.swap(other.src_path);
   dst_path.swap(other.dst_path);
+  data.swap(other.data);
+  std::swap(src_fd, other.src_fd);
+  std::swap(src_offset, other.src_offset);
+  std::swap(src_length, other.src_length);
+  std::swap(src_archive, other.src_archive);
+  std::swap(compress, other.compress);
+  std::swap(alignment, other.alignment);
 }
 
 }  // namespace archive
@@ -5,11 +5,24 @@
 #ifndef APPLICATION_LIB_FAR_ARCHIVE_ENTRY_H_
 #define APPLICATION_LIB_FAR_ARCHIVE_ENTRY_H_
 
+#include <stdint.h>
+
 #include <string>
 
 namespace archive {
+class ArchiveReader;
 
+// A file to add to an archive. The contents come from a file on disk by
+// default, or from one of the other sources created by the static methods
+// below.
 struct ArchiveEntry {
+  enum class Source {
+    kPath,
+    kBuffer,
+    kFileDescriptor,
+    kArchive,
+  };
+
   ArchiveEntry();
   ~ArchiveEntry();
 
@@ -20,10 +33,55 @@ struct ArchiveEntry {
   ArchiveEntry& operator=(const ArchiveEntry& other) = delete;
   ArchiveEntry& operator=(ArchiveEntry&& other);
 
+  // Creates an entry whose contents are |data|.
+  static ArchiveEntry FromBuffer(std::string data, std::string dst_path);
+
+  // Creates an entry whose contents are the |length| bytes at |offset| in
+  // |fd|. The file descriptor is borrowed and must stay open until the
+  // archive is written. It is only accessed with positional I/O, so one file
+  // descriptor can back several entries.
+  static ArchiveEntry FromFileDescriptor(int fd,
+                                         uint64_t offset,
+                                         uint64_t length,
+                                         std::string dst_path);
+
+  // Creates an entry whose contents are those of the file at |archive_path|
+  // in |archive|, which must outlive the call to |ArchiveWriter::Write|.
+  // Uncompressed files are copied from |archive| without passing through
+  // this process when possible.
+  static ArchiveEntry FromArchive(const ArchiveReader* archive,
+                                  std::string archive_path,
+                                  std::string dst_path);
+
   void swap(ArchiveEntry& other);
 
+  Source source = Source::kPath;
+
+  // The path of the source file for |Source::kPath|, or the path within
+  // |src_archive| for |Source::kArchive|.
   std::string src_path;
   std::string dst_path;
+
+  // The contents for |Source::kBuffer|.
+  std::string data;
+
+  // The range of |src_fd| for |Source::kFileDescriptor|.
+  int src_fd = -1;
+  uint64_t src_offset = 0;
+  uint64_t src_length = 0;
+
+  // The archive for |Source::kArchive|.
+  const ArchiveReader* src_archive = nullptr;
+
+  // Whether to store the contents compressed. Compressed files cannot be
+  // mapped directly from the archive, so executables and other files that are
+  // mapped should not be compressed.
+  bool compress = false;
+
+  // The alignment of the contents within the archive, which must be a power
+  // of two between 8 bytes and 2 MiB. Zero means the default of the writer.
+  // Files that are mapped from the archive need at least page alignment.
+  uint64_t alignment = 0;
 };
 
 // Comparies archive entries by dst_path;
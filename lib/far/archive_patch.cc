@@ -0,0 +1,401 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "application/lib/far/archive_patch.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "application/lib/far/archive_reader.h"
+#include "application/lib/far/content_hash.h"
+#include "application/lib/far/file_operations.h"
+
+namespace archive {
+namespace {
+
+// Deltas find matches by hashing every block of this many bytes in the old
+// data and looking up a rolling hash of every window of the new data.
+constexpr uint64_t kBlockSize = 32;
+constexpr uint64_t kRollingBase = 0x100000001b3;
+
+// Shorter runs of zeros are cheaper to insert than to describe with an op.
+constexpr uint64_t kMinZeroRun = 2 * sizeof(PatchOp);
+
+uint64_t HashBlock(const char* data) {
+  uint64_t hash = 0;
+  for (uint64_t i = 0; i < kBlockSize; ++i)
+    hash = hash * kRollingBase + static_cast<uint8_t>(data[i]);
+  return hash;
+}
+
+// The weight of the first byte of a block in its hash.
+uint64_t GetLeadingWeight() {
+  uint64_t weight = 1;
+  for (uint64_t i = 1; i < kBlockSize; ++i)
+    weight *= kRollingBase;
+  return weight;
+}
+
+bool IsZero(const char* data, uint64_t length) {
+  for (uint64_t i = 0; i < length; ++i) {
+    if (data[i] != 0)
+      return false;
+  }
+  return true;
+}
+
+bool ReadWholeFile(int fd, std::string* data) {
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size < 0)
+    return false;
+  data->resize(info.st_size);
+  return ReadFileAt(fd, 0, &(*data)[0], data->size());
+}
+
+// Accumulates the ops and literal data of a patch, merging adjacent ops.
+class PatchBuilder {
+ public:
+  void Copy(uint64_t offset, uint64_t length) {
+    if (length == 0)
+      return;
+    if (!ops_.empty() && ops_.back().type == kPatchCopy &&
+        ops_.back().offset + ops_.back().length == offset) {
+      ops_.back().length += length;
+      return;
+    }
+    AddOp(kPatchCopy, offset, length);
+  }
+
+  // Inserts |data|, replacing long runs of zeros with zero ops.
+  void Insert(const char* data, uint64_t length) {
+    uint64_t literal = 0;
+    uint64_t pos = 0;
+    while (pos < length) {
+      if (data[pos] != 0) {
+        ++pos;
+        continue;
+      }
+      uint64_t end = pos;
+      while (end < length && data[end] == 0)
+        ++end;
+      if (end - pos >= kMinZeroRun) {
+        AddLiteral(data + literal, pos - literal);
+        Zero(end - pos);
+        literal = end;
+      }
+      pos = end;
+    }
+    AddLiteral(data + literal, length - literal);
+  }
+
+  void Zero(uint64_t length) {
+    if (length == 0)
+      return;
+    if (!ops_.empty() && ops_.back().type == kPatchZero) {
+      ops_.back().length += length;
+      return;
+    }
+    AddOp(kPatchZero, 0, length);
+  }
+
+  bool Write(int fd, PatchHeader header, PatchStats* stats) const {
+    header.op_count = ops_.size();
+    header.literal_length = literals_.size();
+    if (!WriteObject(fd, header) || !WriteVector(fd, ops_) ||
+        !WriteVector(fd, literals_)) {
+      fprintf(stderr, "error: Failed to write patch.\n");
+      return false;
+    }
+    if (stats) {
+      *stats = PatchStats();
+      for (const auto& op : ops_) {
+        if (op.type == kPatchCopy)
+          stats->copy_length += op.length;
+        else if (op.type == kPatchInsert)
+          stats->insert_length += op.length;
+        else
+          stats->zero_length += op.length;
+      }
+      stats->patch_length = sizeof(PatchHeader) +
+                            ops_.size() * sizeof(PatchOp) + literals_.size();
+    }
+    return true;
+  }
+
+ private:
+  void AddLiteral(const char* data, uint64_t length) {
+    if (length == 0)
+      return;
+    if (!ops_.empty() && ops_.back().type == kPatchInsert) {
+      ops_.back().length += length;
+    } else {
+      AddOp(kPatchInsert, literals_.size(), length);
+    }
+    literals_.insert(literals_.end(), data, data + length);
+  }
+
+  void AddOp(uint64_t type, uint64_t offset, uint64_t length) {
+    PatchOp op;
+    op.type = type;
+    op.offset = offset;
+    op.length = length;
+    ops_.push_back(op);
+  }
+
+  std::vector<PatchOp> ops_;
+  std::vector<char> literals_;
+};
+
+// Encodes new data as copies of a range of the old archive and insertions.
+class DeltaSource {
+ public:
+  // |data| is the |length| bytes starting at |base| in the old archive.
+  DeltaSource(const char* data, uint64_t base, uint64_t length)
+      : data_(data), base_(base), length_(length) {
+    // Blocks of zeros are left out so that padding becomes zero ops.
+    for (uint64_t pos = 0; pos + kBlockSize <= length; pos += kBlockSize) {
+      if (!IsZero(data + pos, kBlockSize))
+        blocks_.emplace(HashBlock(data + pos), pos);
+    }
+  }
+
+  void Encode(const char* data, uint64_t length, PatchBuilder* builder) const {
+    static const uint64_t leading_weight = GetLeadingWeight();
+    uint64_t literal = 0;
+    uint64_t pos = 0;
+    uint64_t hash = length >= kBlockSize ? HashBlock(data) : 0;
+    while (!blocks_.empty() && pos + kBlockSize <= length) {
+      auto it = blocks_.find(hash);
+      if (it != blocks_.end() &&
+          memcmp(data_ + it->second, data + pos, kBlockSize) == 0) {
+        // Grow the match in both directions before emitting it.
+        uint64_t old_pos = it->second;
+        uint64_t before = 0;
+        while (pos - before > literal && old_pos - before > 0 &&
+               data_[old_pos - before - 1] == data[pos - before - 1])
+          ++before;
+        uint64_t after = kBlockSize;
+        while (pos + after < length && old_pos + after < length_ &&
+               data_[old_pos + after] == data[pos + after])
+          ++after;
+        builder->Insert(data + literal, pos - before - literal);
+        builder->Copy(base_ + old_pos - before, before + after);
+        pos += after;
+        literal = pos;
+        if (pos + kBlockSize <= length)
+          hash = HashBlock(data + pos);
+        continue;
+      }
+      if (pos + kBlockSize < length) {
+        hash = (hash - static_cast<uint8_t>(data[pos]) * leading_weight) *
+                   kRollingBase +
+               static_cast<uint8_t>(data[pos + kBlockSize]);
+      }
+      ++pos;
+    }
+    builder->Insert(data + literal, length - literal);
+  }
+
+ private:
+  const char* const data_;
+  const uint64_t base_;
+  const uint64_t length_;
+
+  // The offset of the first block of |data_| with each hash.
+  std::unordered_map<uint64_t, uint64_t> blocks_;
+};
+
+bool IsInArchive(const DirectoryTableEntry& entry, uint64_t archive_length) {
+  return entry.data_length <= archive_length &&
+         entry.data_offset <= archive_length - entry.data_length;
+}
+
+}  // namespace
+
+bool DiffArchives(int old_fd, int new_fd, int patch_fd, PatchStats* stats) {
+  std::string old_data;
+  std::string new_data;
+  if (!ReadWholeFile(old_fd, &old_data) || !ReadWholeFile(new_fd, &new_data)) {
+    fprintf(stderr, "error: Failed to read archives.\n");
+    return false;
+  }
+  ArchiveReader old_reader(old_data.data(), old_data.size());
+  ArchiveReader new_reader(new_data.data(), new_data.size());
+  if (!old_reader.Read() || !new_reader.Read())
+    return false;
+
+  // The index and directory of the old archive precede the data of its
+  // files, and are where the new index and directory are looked for.
+  bool valid = true;
+  uint64_t old_metadata_length = old_data.size();
+  std::map<ContentHash, DirectoryTableEntry> old_by_hash;
+  old_reader.ListDirectory([&](const DirectoryTableEntry& entry) {
+    valid = valid && IsInArchive(entry, old_data.size());
+    old_metadata_length = std::min(old_metadata_length, entry.data_offset);
+    ContentHash hash;
+    if (old_reader.has_content_hashes() &&
+        old_reader.GetContentHash(old_reader.GetPathView(entry), &hash))
+      old_by_hash.emplace(hash, entry);
+  });
+
+  // Walk the new archive from front to back, which is the order in which the
+  // patch writes it. Deduplicated files share a data range, which is encoded
+  // once.
+  std::vector<DirectoryTableEntry> new_entries;
+  new_entries.reserve(new_reader.file_count());
+  new_reader.ListDirectory([&](const DirectoryTableEntry& entry) {
+    valid = valid && IsInArchive(entry, new_data.size());
+    new_entries.push_back(entry);
+  });
+  if (!valid) {
+    fprintf(stderr, "error: File data exceeds archive length.\n");
+    return false;
+  }
+  std::sort(new_entries.begin(), new_entries.end(),
+            [](const DirectoryTableEntry& lhs, const DirectoryTableEntry& rhs) {
+              return lhs.data_offset < rhs.data_offset;
+            });
+
+  DeltaSource metadata(old_data.data(), 0, old_metadata_length);
+  PatchBuilder builder;
+  uint64_t pos = 0;
+  for (const auto& entry : new_entries) {
+    if (entry.data_offset < pos)
+      continue;
+    metadata.Encode(new_data.data() + pos, entry.data_offset - pos, &builder);
+    pos = entry.data_offset + entry.data_length;
+
+    const char* data = new_data.data() + entry.data_offset;
+    auto matches = [&](const DirectoryTableEntry& old_entry) {
+      return old_entry.data_length == entry.data_length &&
+             memcmp(old_data.data() + old_entry.data_offset, data,
+                    entry.data_length) == 0;
+    };
+    std::string path = new_reader.GetPathView(entry).ToString();
+    DirectoryTableEntry old_entry;
+    bool has_old_entry = old_reader.GetDirectoryEntry(path, &old_entry);
+    if (has_old_entry && matches(old_entry)) {
+      builder.Copy(old_entry.data_offset, old_entry.data_length);
+      continue;
+    }
+    ContentHash hash;
+    if (new_reader.has_content_hashes() &&
+        new_reader.GetContentHash(path, &hash)) {
+      auto it = old_by_hash.find(hash);
+      if (it != old_by_hash.end() && matches(it->second)) {
+        builder.Copy(it->second.data_offset, it->second.data_length);
+        continue;
+      }
+    }
+    if (has_old_entry) {
+      DeltaSource source(old_data.data() + old_entry.data_offset,
+                         old_entry.data_offset, old_entry.data_length);
+      source.Encode(data, entry.data_length, &builder);
+    } else {
+      builder.Insert(data, entry.data_length);
+    }
+  }
+  metadata.Encode(new_data.data() + pos, new_data.size() - pos, &builder);
+
+  PatchHeader header;
+  header.old_length = old_data.size();
+  header.new_length = new_data.size();
+  ContentHash hash;
+  HashBuffer(old_data.data(), old_data.size(), &hash);
+  memcpy(header.old_hash, hash.data(), kHashLength);
+  HashBuffer(new_data.data(), new_data.size(), &hash);
+  memcpy(header.new_hash, hash.data(), kHashLength);
+  return builder.Write(patch_fd, header, stats);
+}
+
+bool ApplyPatch(int old_fd, int patch_fd, int new_fd) {
+  PatchHeader header;
+  struct stat info;
+  if (!ReadObject(patch_fd, &header) || header.magic != kPatchMagic ||
+      header.version != kPatchVersion || fstat(patch_fd, &info) != 0 ||
+      static_cast<uint64_t>(info.st_size) < sizeof(PatchHeader)) {
+    fprintf(stderr, "error: Invalid patch.\n");
+    return false;
+  }
+  uint64_t remaining = info.st_size - sizeof(PatchHeader);
+  if (header.op_count > remaining / sizeof(PatchOp) ||
+      header.literal_length != remaining - header.op_count * sizeof(PatchOp)) {
+    fprintf(stderr, "error: Invalid patch length.\n");
+    return false;
+  }
+
+  ContentHash hash;
+  if (fstat(old_fd, &info) != 0 ||
+      static_cast<uint64_t>(info.st_size) != header.old_length ||
+      !HashFileRange(old_fd, 0, header.old_length, &hash) ||
+      memcmp(hash.data(), header.old_hash, kHashLength) != 0) {
+    fprintf(stderr, "error: Patch does not apply to this archive.\n");
+    return false;
+  }
+
+  std::vector<PatchOp> ops(header.op_count);
+  std::vector<char> literals(header.literal_length);
+  if (!ReadVector(patch_fd, &ops) || !ReadVector(patch_fd, &literals)) {
+    fprintf(stderr, "error: Failed to read patch.\n");
+    return false;
+  }
+
+  // Zero ops leave holes in the new archive, which read as zeros.
+  if (ftruncate(new_fd, 0) != 0 ||
+      ftruncate(new_fd, header.new_length) != 0) {
+    fprintf(stderr, "error: Failed to resize archive.\n");
+    return false;
+  }
+  uint64_t pos = 0;
+  for (const auto& op : ops) {
+    bool valid = op.length <= header.new_length - pos;
+    bool written = true;
+    switch (op.type) {
+      case kPatchCopy:
+        valid = valid && op.length <= header.old_length &&
+                op.offset <= header.old_length - op.length;
+        written = !valid || CopyFileRangeToFileAt(old_fd, op.offset, new_fd,
+                                                  pos, op.length);
+        break;
+      case kPatchInsert:
+        valid = valid && op.length <= literals.size() &&
+                op.offset <= literals.size() - op.length;
+        written = !valid || WriteFileAt(new_fd, pos,
+                                        literals.data() + op.offset, op.length);
+        break;
+      case kPatchZero:
+        break;
+      default:
+        valid = false;
+        break;
+    }
+    if (!valid) {
+      fprintf(stderr, "error: Invalid patch op.\n");
+      return false;
+    }
+    if (!written) {
+      fprintf(stderr, "error: Failed to write archive.\n");
+      return false;
+    }
+    pos += op.length;
+  }
+
+  if (pos != header.new_length ||
+      !HashFileRange(new_fd, 0, header.new_length, &hash) ||
+      memcmp(hash.data(), header.new_hash, kHashLength) != 0) {
+    fprintf(stderr, "error: Patched archive does not match the patch.\n");
+    return false;
+  }
+  return true;
+}
+
+}  // namespace archive
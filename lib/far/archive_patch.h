@@ -0,0 +1,75 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef APPLICATION_LIB_FAR_ARCHIVE_PATCH_H_
+#define APPLICATION_LIB_FAR_ARCHIVE_PATCH_H_
+
+#include <stdint.h>
+
+#include "application/lib/far/format.h"
+
+namespace archive {
+
+// A patch rebuilds a new archive, byte for byte, from an old one. It consists
+// of a PatchHeader, |op_count| PatchOps and |literal_length| bytes of literal
+// data. Applying the ops in order writes the new archive from front to back.
+constexpr uint64_t kPatchMagic = 0x4843544150524146;  // "FARPATCH"
+constexpr uint32_t kPatchVersion = 1;
+
+// Copies |length| bytes starting at |offset| in the old archive.
+constexpr uint64_t kPatchCopy = 1;
+// Copies |length| bytes starting at |offset| in the literal data.
+constexpr uint64_t kPatchInsert = 2;
+// Writes |length| zero bytes, such as the padding between aligned files.
+constexpr uint64_t kPatchZero = 3;
+
+struct PatchHeader {
+  uint64_t magic = kPatchMagic;
+  uint32_t version = kPatchVersion;
+  uint32_t reserved = 0;
+  uint64_t old_length = 0;
+  uint64_t new_length = 0;
+  uint64_t op_count = 0;
+  uint64_t literal_length = 0;
+  // SHA-256 digests of the whole old and new archives.
+  uint8_t old_hash[kHashLength] = {};
+  uint8_t new_hash[kHashLength] = {};
+};
+
+struct PatchOp {
+  uint64_t type = 0;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+};
+
+struct PatchStats {
+  uint64_t copy_length = 0;
+  uint64_t insert_length = 0;
+  uint64_t zero_length = 0;
+  uint64_t patch_length = 0;
+};
+
+// Writes a patch from the archive in |old_fd| to the archive in |new_fd| to
+// |patch_fd|.
+//
+// The data of each file in the new archive is copied from the old archive
+// when the old archive stores a file with the same path or content hash and
+// the same bytes. The data of other files, and the index and directory, are
+// encoded as a binary delta against the file with the same path, or the
+// directory, of the old archive.
+bool DiffArchives(int old_fd,
+                  int new_fd,
+                  int patch_fd,
+                  PatchStats* stats = nullptr);
+
+// Applies the patch in |patch_fd| to the archive in |old_fd|, writing the new
+// archive to |new_fd|, which must be open for reading and writing.
+//
+// Returns false if the patch is malformed, was made from a different old
+// archive, or does not reproduce the new archive it was made from.
+bool ApplyPatch(int old_fd, int patch_fd, int new_fd);
+
+}  // namespace archive
+
+#endif  // APPLICATION_LIB_FAR_ARCHIVE_PATCH_H_
@@ -0,0 +1,112 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "application/lib/far/archive_patch.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "application/lib/far/archive_writer.h"
+#include "application/lib/far/file_operations.h"
+#include "gtest/gtest.h"
+#include "lib/ftl/files/scoped_temp_dir.h"
+#include "lib/ftl/files/unique_fd.h"
+
+namespace archive {
+namespace {
+
+class ArchivePatchTest : public ::testing::Test {
+ protected:
+  // Writes an archive mapping each path to its contents to a new file.
+  ftl::UniqueFD WriteArchive(
+      const std::vector<std::pair<std::string, std::string>>& files) {
+    ArchiveWriter writer;
+    for (const auto& file : files)
+      EXPECT_TRUE(
+          writer.Add(ArchiveEntry::FromBuffer(file.second, file.first)));
+    ftl::UniqueFD fd = NewFile();
+    EXPECT_TRUE(writer.Write(fd.get()));
+    return fd;
+  }
+
+  ftl::UniqueFD NewFile() {
+    std::string path;
+    EXPECT_TRUE(temp_dir_.NewTempFile(&path));
+    return ftl::UniqueFD(open(path.c_str(), O_RDWR | O_TRUNC));
+  }
+
+  std::string ReadContents(int fd) {
+    std::string contents(lseek(fd, 0, SEEK_END), '\0');
+    EXPECT_TRUE(ReadFileAt(fd, 0, &contents[0], contents.size()));
+    return contents;
+  }
+
+  std::string MakeData(size_t length, uint32_t seed) {
+    std::string data(length, '\0');
+    for (auto& c : data) {
+      seed = seed * 1103515245 + 12345;
+      c = static_cast<char>(seed >> 16);
+    }
+    return data;
+  }
+
+  files::ScopedTempDir temp_dir_;
+};
+
+TEST_F(ArchivePatchTest, RebuildsNewArchive) {
+  std::string library = MakeData(200000, 1);
+  std::string app = MakeData(50000, 2);
+  std::string new_app = app;
+  new_app.replace(1000, 10, "0123456789");
+  new_app.insert(30000, "inserted");
+
+  ftl::UniqueFD old_fd = WriteArchive({{"bin/app", app},
+                                       {"lib/libfoo.so", library},
+                                       {"meta/removed", "gone"},
+                                       {"meta/sandbox", "{}"}});
+  ftl::UniqueFD new_fd = WriteArchive({{"bin/app", new_app},
+                                       {"data/added", "new file"},
+                                       {"lib/libbar.so", library},
+                                       {"meta/sandbox", "{ }"}});
+
+  ftl::UniqueFD patch_fd = NewFile();
+  PatchStats stats;
+  ASSERT_TRUE(DiffArchives(old_fd.get(), new_fd.get(), patch_fd.get(),
+                           &stats));
+  std::string new_archive = ReadContents(new_fd.get());
+  EXPECT_EQ(new_archive.size(), stats.copy_length + stats.insert_length +
+                                    stats.zero_length);
+  EXPECT_EQ(ReadContents(patch_fd.get()).size(), stats.patch_length);
+  // The renamed library and most of the app are copied.
+  EXPECT_LT(stats.patch_length, new_archive.size() / 10);
+
+  ftl::UniqueFD patched_fd = NewFile();
+  lseek(patch_fd.get(), 0, SEEK_SET);
+  ASSERT_TRUE(ApplyPatch(old_fd.get(), patch_fd.get(), patched_fd.get()));
+  EXPECT_EQ(new_archive, ReadContents(patched_fd.get()));
+}
+
+TEST_F(ArchivePatchTest, RejectsOtherArchives) {
+  ftl::UniqueFD old_fd = WriteArchive({{"a", "1"}});
+  ftl::UniqueFD new_fd = WriteArchive({{"a", "2"}});
+  ftl::UniqueFD patch_fd = NewFile();
+  ASSERT_TRUE(DiffArchives(old_fd.get(), new_fd.get(), patch_fd.get()));
+
+  ftl::UniqueFD other_fd = WriteArchive({{"a", "3"}});
+  ftl::UniqueFD patched_fd = NewFile();
+  lseek(patch_fd.get(), 0, SEEK_SET);
+  EXPECT_FALSE(
+      ApplyPatch(other_fd.get(), patch_fd.get(), patched_fd.get()));
+
+  // A patch cannot be applied to its own output.
+  lseek(patch_fd.get(), 0, SEEK_SET);
+  EXPECT_FALSE(ApplyPatch(new_fd.get(), patch_fd.get(), patched_fd.get()));
+}
+
+}  // namespace
+}  // namespace archive
@@ -5,13 +5,23 @@
 #include "application/lib/far/archive_reader.h"
 
 #include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <limits>
+#include <unordered_set>
 #include <utility>
 
+#include "application/lib/far/alignment.h"
 #include "application/lib/far/file_operations.h"
 #include "application/lib/far/format.h"
+#include "application/lib/far/parallel.h"
+#include "application/lib/far/path_filter.h"
+#include "application/lib/far/path_hash.h"
+#include "lib/ftl/files/directory.h"
 
 namespace archive {
 namespace {
@@ -24,42 +34,236 @@ struct PathComparator {
   }
 };
 
+// Returns whether |path| is a relative path that stays within the directory it
+// is resolved against.
+bool IsSafeRelativePath(ftl::StringView path) {
+  if (path.empty())
+    return false;
+  size_t begin = 0;
+  while (begin <= path.size()) {
+    size_t end = path.find('/', begin);
+    if (end == ftl::StringView::npos)
+      end = path.size();
+    ftl::StringView component = path.substr(begin, end - begin);
+    if (component.empty() || component == "." || component == "..")
+      return false;
+    begin = end + 1;
+  }
+  return true;
+}
+
+// The length of the range of a file descriptor that holds an archive when
+// the whole file does.
+constexpr uint64_t kWholeFile = std::numeric_limits<uint64_t>::max();
+
+// Smaller directory tables are searched directly.
+constexpr uint64_t kMinPrefixIndexFileCount = 256;
+
+// The number of decompressed blocks kept for random reads of compressed files.
+constexpr size_t kBlockCacheCapacity = 32;
+
 }  // namespace
 
-ArchiveReader::ArchiveReader(ftl::UniqueFD fd) : fd_(std::move(fd)) {}
+ArchiveReader::ArchiveReader(ftl::UniqueFD fd)
+    : fd_(std::move(fd)), source_length_(kWholeFile) {}
+
+ArchiveReader::ArchiveReader(ftl::UniqueFD fd, uint64_t offset, uint64_t length)
+    : fd_(std::move(fd)), source_offset_(offset), source_length_(length) {}
 
-ArchiveReader::~ArchiveReader() = default;
+ArchiveReader::ArchiveReader(const char* data, size_t length)
+    : source_length_(0), mapping_(data), mapping_size_(length) {}
+
+ArchiveReader::~ArchiveReader() {
+  if (mapped_region_)
+    munmap(mapped_region_, mapped_region_size_);
+}
 
 bool ArchiveReader::Read() {
   return ReadIndex() && ReadDirectory();
 }
 
+bool ArchiveReader::MapAndRead() {
+  if (!mapping_) {
+    uint64_t length = source_length_;
+    if (length == kWholeFile) {
+      struct stat info;
+      if (fstat(fd_.get(), &info) < 0) {
+        fprintf(stderr, "error: Failed to read length of archive.\n");
+        return false;
+      }
+      length = info.st_size < 0 ? 0 : static_cast<uint64_t>(info.st_size);
+    }
+    // Mappings start on a page boundary, which an archive nested in another
+    // archive need not.
+    uint64_t padding = source_offset_ % kPageSize;
+    if (length == 0 ||
+        length > std::numeric_limits<size_t>::max() - padding) {
+      fprintf(stderr, "error: Invalid archive length.\n");
+      return false;
+    }
+    size_t size = static_cast<size_t>(length + padding);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd_.get(),
+                         source_offset_ - padding);
+    if (mapping == MAP_FAILED) {
+      fprintf(stderr, "error: Failed to map archive.\n");
+      return false;
+    }
+    mapped_region_ = mapping;
+    mapped_region_size_ = size;
+    mapping_ = static_cast<const char*>(mapping) + padding;
+    mapping_size_ = static_cast<size_t>(length);
+  }
+  return ReadIndex() && ReadDirectory();
+}
+
 bool ArchiveReader::ExtractFile(ftl::StringView archive_path,
                                 const char* output_path) const {
-  DirectoryTableEntry entry;
-  if (!GetDirectoryEntry(archive_path, &entry))
+  const DirectoryTableEntry* entry = FindEntry(archive_path);
+  if (!entry)
     return false;
-  if (lseek(fd_.get(), entry.data_offset, SEEK_SET) < 0) {
-    fprintf(stderr, "error: Failed to seek to offset of file.\n");
+  return ExtractEntry(*entry, output_path);
+}
+
+bool ArchiveReader::CopyFile(ftl::StringView archive_path, int dst_fd) const {
+  const DirectoryTableEntry* entry = FindEntry(archive_path);
+  if (!entry)
     return false;
+  return CopyEntry(*entry, dst_fd);
+}
+
+bool ArchiveReader::CopyEntry(const DirectoryTableEntry& entry,
+                              int dst_fd) const {
+  if (const CompressedEntry* compressed = GetCompressedEntry(entry)) {
+    if (!WriteDecompressed(entry, *compressed, dst_fd)) {
+      fprintf(stderr, "error: Failed write contents.\n");
+      return false;
+    }
+    return true;
   }
-  if (!CopyFileToPath(fd_.get(), output_path, entry.data_length)) {
-    fprintf(stderr, "error: Failed write contents to '%s'.\n", output_path);
+  // See ExtractEntry.
+  if (!fd_.is_valid() && mapping_) {
+    const char* data = nullptr;
+    if (!GetMappedRange(entry.data_offset, entry.data_length, &data)) {
+      fprintf(stderr, "error: File data exceeds archive length.\n");
+      return false;
+    }
+    if (!ftl::WriteFileDescriptor(dst_fd, data, entry.data_length)) {
+      fprintf(stderr, "error: Failed write contents.\n");
+      return false;
+    }
+    return true;
+  }
+  uint64_t source_offset = 0;
+  if (!GetSourceOffset(entry.data_offset, entry.data_length, &source_offset) ||
+      !CopyFileRangeToFile(fd_.get(), source_offset, dst_fd,
+                           entry.data_length)) {
+    fprintf(stderr, "error: Failed write contents.\n");
     return false;
   }
   return true;
 }
 
-bool ArchiveReader::CopyFile(ftl::StringView archive_path, int dst_fd) const {
-  DirectoryTableEntry entry;
-  if (!GetDirectoryEntry(archive_path, &entry))
-    return false;
-  if (lseek(fd_.get(), entry.data_offset, SEEK_SET) < 0) {
-    fprintf(stderr, "error: Failed to seek to offset of file.\n");
+bool ArchiveReader::CopyStoredData(ftl::StringView archive_path,
+                                   int dst_fd,
+                                   uint64_t dst_offset) const {
+  const DirectoryTableEntry* entry = FindEntry(archive_path);
+  if (!entry)
     return false;
+  // See ExtractEntry.
+  if (!fd_.is_valid() && mapping_) {
+    const char* data = nullptr;
+    if (!GetMappedRange(entry->data_offset, entry->data_length, &data))
+      return false;
+    return WriteFileAt(dst_fd, dst_offset, data, entry->data_length);
   }
-  if (!CopyFileToFile(fd_.get(), dst_fd, entry.data_length)) {
-    fprintf(stderr, "error: Failed write contents.\n");
+  uint64_t source_offset = 0;
+  return GetSourceOffset(entry->data_offset, entry->data_length,
+                         &source_offset) &&
+         CopyFileRangeToFileAt(fd_.get(), source_offset, dst_fd, dst_offset,
+                               entry->data_length);
+}
+
+bool ArchiveReader::ExtractAll(const std::string& output_dir,
+                               const ExtractOptions& options) const {
+  std::string buffer;
+  for (uint64_t i = 0; i < file_count_; ++i) {
+    ftl::StringView path = GetPath(directory_table_[i], &buffer);
+    if (!IsSafeRelativePath(path)) {
+      fprintf(stderr, "error: Refusing to extract unsafe path '%.*s'.\n",
+              static_cast<int>(path.size()), path.data());
+      return false;
+    }
+  }
+
+  // The directory table is sorted by path, so files in the same directory are
+  // mostly adjacent, but subdirectories can interleave with them.
+  std::unordered_set<std::string> created_dirs;
+  for (uint64_t i = 0; i < file_count_; ++i) {
+    ftl::StringView path = GetPath(directory_table_[i], &buffer);
+    size_t slash = path.rfind('/');
+    if (slash == ftl::StringView::npos)
+      continue;
+    std::string dir = path.substr(0, slash).ToString();
+    if (created_dirs.count(dir))
+      continue;
+    std::string dir_path = output_dir + "/" + dir;
+    if (!files::CreateDirectory(dir_path)) {
+      fprintf(stderr, "error: Failed to create directory '%s'.\n",
+              dir_path.c_str());
+      return false;
+    }
+    created_dirs.insert(std::move(dir));
+  }
+
+  std::vector<const DirectoryTableEntry*> entries(file_count_);
+  for (uint64_t i = 0; i < file_count_; ++i)
+    entries[i] = &directory_table_[i];
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const DirectoryTableEntry* lhs,
+                      const DirectoryTableEntry* rhs) {
+                     return lhs->data_offset < rhs->data_offset;
+                   });
+
+  return ParallelFor(entries.size(), options.jobs, [&](size_t i) {
+    const DirectoryTableEntry& entry = *entries[i];
+    std::string path_buffer;
+    std::string output_path =
+        output_dir + "/" + GetPath(entry, &path_buffer).ToString();
+    return ExtractEntry(entry, output_path.c_str());
+  });
+}
+
+bool ArchiveReader::ExtractEntry(const DirectoryTableEntry& entry,
+                                 const char* output_path) const {
+  if (const CompressedEntry* compressed = GetCompressedEntry(entry)) {
+    ftl::UniqueFD dst_fd = CreateOutputFile(output_path);
+    if (!dst_fd.is_valid() ||
+        !WriteDecompressed(entry, *compressed, dst_fd.get())) {
+      fprintf(stderr, "error: Failed write contents to '%s'.\n", output_path);
+      return false;
+    }
+    return true;
+  }
+  // Prefer copying from the file descriptor, which lets the kernel move the
+  // data without it passing through userspace, and only write from the
+  // mapping once the file descriptor has been taken.
+  if (!fd_.is_valid() && mapping_) {
+    const char* data = nullptr;
+    if (!GetMappedRange(entry.data_offset, entry.data_length, &data)) {
+      fprintf(stderr, "error: File data exceeds archive length.\n");
+      return false;
+    }
+    if (!CopyBufferToPath(data, output_path, entry.data_length)) {
+      fprintf(stderr, "error: Failed write contents to '%s'.\n", output_path);
+      return false;
+    }
+    return true;
+  }
+  uint64_t source_offset = 0;
+  if (!GetSourceOffset(entry.data_offset, entry.data_length, &source_offset) ||
+      !CopyFileRangeToPath(fd_.get(), source_offset, output_path,
+                           entry.data_length)) {
+    fprintf(stderr, "error: Failed write contents to '%s'.\n", output_path);
     return false;
   }
   return true;
@@ -67,35 +271,240 @@ bool ArchiveReader::CopyFile(ftl::StringView archive_path, int dst_fd) const {
 
 bool ArchiveReader::GetDirectoryEntry(ftl::StringView archive_path,
                                       DirectoryTableEntry* entry) const {
+  const DirectoryTableEntry* result = FindEntry(archive_path);
+  if (!result)
+    return false;
+  *entry = *result;
+  return true;
+}
+
+size_t ArchiveReader::GetDirectoryEntries(
+    const std::vector<ftl::StringView>& paths,
+    std::vector<const DirectoryTableEntry*>* entries) const {
+  entries->assign(paths.size(), nullptr);
+  size_t found = 0;
+  if (index_slots_ || !front_coded_names_.empty()) {
+    for (size_t i = 0; i < paths.size(); ++i) {
+      (*entries)[i] = FindEntry(paths[i]);
+      if ((*entries)[i])
+        ++found;
+    }
+    return found;
+  }
+
+  // Only paths that pass the path filter need to be searched for.
+  std::vector<size_t> order;
+  order.reserve(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (MayContainPath(HashPath(paths[i])))
+      order.push_back(i);
+  }
+  std::sort(order.begin(), order.end(), [&paths](size_t lhs, size_t rhs) {
+    return paths[lhs] < paths[rhs];
+  });
+
   PathComparator comparator;
   comparator.reader = this;
 
-  auto it = std::lower_bound(directory_table_.begin(), directory_table_.end(),
-                             archive_path, comparator);
-  if (it == directory_table_.end() || GetPathView(*it) != archive_path)
+  // Each query starts where the previous one ended and gallops forward to
+  // bound the range to search, so nearby queries cost only a few comparisons.
+  const DirectoryTableEntry* cursor = directory_table_;
+  const DirectoryTableEntry* table_end = directory_table_ + file_count_;
+  for (size_t i : order) {
+    ftl::StringView path = paths[i];
+    uint64_t step = 1;
+    const DirectoryTableEntry* bound = cursor;
+    while (bound < table_end && GetPathView(*bound) < path) {
+      cursor = bound + 1;
+      if (step > static_cast<uint64_t>(table_end - bound))
+        bound = table_end;
+      else
+        bound += step;
+      step *= 2;
+    }
+    cursor = std::lower_bound(cursor, bound, path, comparator);
+    if (cursor != table_end && GetPathView(*cursor) == path) {
+      (*entries)[i] = cursor;
+      ++found;
+    }
+  }
+  return found;
+}
+
+bool ArchiveReader::GetFileLength(ftl::StringView archive_path,
+                                  uint64_t* length) const {
+  const DirectoryTableEntry* entry = FindEntry(archive_path);
+  if (!entry)
     return false;
-  *entry = *it;
+  const CompressedEntry* compressed = GetCompressedEntry(*entry);
+  *length = compressed ? compressed->uncompressed_length : entry->data_length;
   return true;
 }
 
+bool ArchiveReader::ReadFileRange(ftl::StringView archive_path,
+                                  uint64_t offset,
+                                  uint64_t length,
+                                  char* buffer) const {
+  const DirectoryTableEntry* entry = FindEntry(archive_path);
+  if (!entry)
+    return false;
+
+  const CompressedEntry* compressed = GetCompressedEntry(*entry);
+  if (!compressed) {
+    if (offset > entry->data_length || length > entry->data_length - offset)
+      return false;
+    return ReadAt(entry->data_offset + offset, buffer, length);
+  }
+
+  if (offset > compressed->uncompressed_length ||
+      length > compressed->uncompressed_length - offset)
+    return false;
+  while (length > 0) {
+    uint64_t block = offset / compression_block_size_;
+    uint64_t block_offset = offset % compression_block_size_;
+    std::shared_ptr<const std::string> data =
+        GetCachedBlock(*entry, *compressed, block);
+    if (!data || block_offset >= data->size())
+      return false;
+    uint64_t count = std::min<uint64_t>(length, data->size() - block_offset);
+    memcpy(buffer, data->data() + block_offset, count);
+    buffer += count;
+    offset += count;
+    length -= count;
+  }
+  return true;
+}
+
+bool ArchiveReader::IsCompressed(ftl::StringView archive_path) const {
+  const DirectoryTableEntry* entry = FindEntry(archive_path);
+  return entry && GetCompressedEntry(*entry);
+}
+
+bool ArchiveReader::GetFileView(ftl::StringView archive_path,
+                                ftl::StringView* contents) const {
+  if (!mapping_)
+    return false;
+  const DirectoryTableEntry* entry = FindEntry(archive_path);
+  if (!entry || GetCompressedEntry(*entry))
+    return false;
+  const char* data = nullptr;
+  if (!GetMappedRange(entry->data_offset, entry->data_length, &data))
+    return false;
+  *contents = ftl::StringView(data, entry->data_length);
+  return true;
+}
+
+bool ArchiveReader::GetContentHash(ftl::StringView archive_path,
+                                   ContentHash* hash) const {
+  if (!content_hashes_)
+    return false;
+  const DirectoryTableEntry* entry = FindEntry(archive_path);
+  if (!entry)
+    return false;
+  *hash = content_hashes_[entry - directory_table_];
+  return true;
+}
+
+bool ArchiveReader::VerifyFile(ftl::StringView archive_path) const {
+  if (!content_hashes_) {
+    fprintf(stderr, "error: Archive does not contain content hashes.\n");
+    return false;
+  }
+  const DirectoryTableEntry* entry = FindEntry(archive_path);
+  if (!entry)
+    return false;
+  return VerifyEntry(*entry);
+}
+
+bool ArchiveReader::VerifyAll(size_t jobs) const {
+  if (!content_hashes_) {
+    fprintf(stderr, "error: Archive does not contain content hashes.\n");
+    return false;
+  }
+  std::atomic<bool> verified(true);
+  ParallelFor(file_count_, jobs, [this, &verified](size_t i) {
+    if (!VerifyEntry(directory_table_[i]))
+      verified = false;
+    return true;  // Keep going so that every mismatch is reported.
+  });
+  return verified;
+}
+
+std::unique_ptr<ArchiveReader> ArchiveReader::OpenArchive(
+    ftl::StringView archive_path) const {
+  const DirectoryTableEntry* entry = FindEntry(archive_path);
+  if (!entry || GetCompressedEntry(*entry))
+    return nullptr;
+  if (!fd_.is_valid()) {
+    const char* data = nullptr;
+    if (!mapping_ ||
+        !GetMappedRange(entry->data_offset, entry->data_length, &data))
+      return nullptr;
+    return std::make_unique<ArchiveReader>(
+        data, static_cast<size_t>(entry->data_length));
+  }
+  uint64_t source_offset = 0;
+  if (!GetSourceOffset(entry->data_offset, entry->data_length,
+                       &source_offset))
+    return nullptr;
+  ftl::UniqueFD fd(dup(fd_.get()));
+  if (!fd.is_valid())
+    return nullptr;
+  return std::make_unique<ArchiveReader>(std::move(fd), source_offset,
+                                         entry->data_length);
+}
+
+uint64_t ArchiveReader::GetMemoryUsage() const {
+  uint64_t usage = sizeof(*this) +
+                   index_.capacity() * sizeof(IndexEntry) +
+                   directory_storage_.capacity() * sizeof(DirectoryTableEntry) +
+                   path_storage_.capacity() +
+                   names_storage_.capacity() * sizeof(uint64_t) +
+                   index_storage_.capacity() * sizeof(DirectoryIndexSlot) +
+                   filter_storage_.capacity() * sizeof(uint64_t) +
+                   hash_storage_.capacity() * sizeof(ContentHash) +
+                   compression_storage_.capacity() * sizeof(uint64_t);
+  if (prefix_index_built_.load(std::memory_order_acquire))
+    usage += prefix_index_.memory_usage();
+  if (mapping_ && !mapped_region_)
+    usage += mapping_size_;
+  std::lock_guard<std::mutex> lock(expanded_paths_mutex_);
+  return usage + expanded_paths_size_;
+}
+
 ftl::UniqueFD ArchiveReader::TakeFileDescriptor() {
   return std::move(fd_);
 }
 
 ftl::StringView ArchiveReader::GetPathView(
     const DirectoryTableEntry& entry) const {
-  return ftl::StringView(path_data_.data() + entry.name_offset,
-                         entry.name_length);
+  if (front_coded_names_.empty()) {
+    return ftl::StringView(path_data_ + entry.name_offset,
+                           entry.name_length);
+  }
+  std::lock_guard<std::mutex> lock(expanded_paths_mutex_);
+  auto it = expanded_paths_.find(entry.name_offset);
+  if (it == expanded_paths_.end()) {
+    std::string buffer;
+    ftl::StringView path = front_coded_names_.Get(entry.name_offset, &buffer);
+    it = expanded_paths_.emplace(entry.name_offset, path.ToString()).first;
+    expanded_paths_size_ += sizeof(*it) + it->second.capacity();
+  }
+  return it->second;
 }
 
-bool ArchiveReader::ReadIndex() {
-  if (lseek(fd_.get(), 0, SEEK_SET) < 0) {
-    fprintf(stderr, "error: Failed to seek to beginning of archive.\n");
-    return false;
+ftl::StringView ArchiveReader::GetPath(const DirectoryTableEntry& entry,
+                                       std::string* buffer) const {
+  if (front_coded_names_.empty()) {
+    return ftl::StringView(path_data_ + entry.name_offset,
+                           entry.name_length);
   }
+  return front_coded_names_.Get(entry.name_offset, buffer);
+}
 
+bool ArchiveReader::ReadIndex() {
   IndexChunk index_chunk;
-  if (!ReadObject(fd_.get(), &index_chunk)) {
+  if (!ReadAt(0, &index_chunk, sizeof(index_chunk))) {
     fprintf(stderr,
             "error: Failed read index chunk. Is this file an archive?\n");
     return false;
@@ -115,7 +524,7 @@ bool ArchiveReader::ReadIndex() {
   }
 
   index_.resize(index_chunk.length / sizeof(IndexEntry));
-  if (!ReadVector(fd_.get(), &index_)) {
+  if (!ReadAt(sizeof(IndexChunk), index_.data(), index_chunk.length)) {
     fprintf(stderr, "error: Failed to read contents of index chunk.\n");
     return false;
   }
@@ -160,33 +569,425 @@ bool ArchiveReader::ReadDirectory() {
     return false;
   }
   uint64_t file_count = dir_entry->length / sizeof(DirectoryTableEntry);
-  directory_table_.resize(file_count);
 
-  if (lseek(fd_.get(), dir_entry->offset, SEEK_SET) < 0) {
-    fprintf(stderr, "error: Failed to seek to directory chunk.\n");
+  // Front-coded names are read by |FinishDirectory|.
+  const IndexEntry* dirnames_entry = GetIndexEntry(kDirnamesType);
+  if (!dirnames_entry && !GetIndexEntry(kDirFrontCodedNamesType)) {
+    fprintf(stderr, "error: Cannot find directory names chunk.\n");
     return false;
   }
-  if (!ReadVector(fd_.get(), &directory_table_)) {
+
+  if (mapping_) {
+    if (reinterpret_cast<uintptr_t>(mapping_) % kMinDataAlignment != 0) {
+      fprintf(stderr, "error: Archive in memory is not 8 byte aligned.\n");
+      return false;
+    }
+    const char* directory_data = nullptr;
+    if (!GetMappedRange(dir_entry->offset, dir_entry->length,
+                        &directory_data)) {
+      fprintf(stderr, "error: Directory chunk exceeds archive length.\n");
+      return false;
+    }
+    const char* path_data = nullptr;
+    if (dirnames_entry &&
+        !GetMappedRange(dirnames_entry->offset, dirnames_entry->length,
+                        &path_data)) {
+      fprintf(stderr,
+              "error: Directory names chunk exceeds archive length.\n");
+      return false;
+    }
+    // Chunks are 8 byte aligned within the archive, and the archive is 8 byte
+    // aligned in memory, which satisfies the alignment of DirectoryTableEntry.
+    // A whole mapped file starts on a page boundary, but an archive nested in
+    // a file range or handed to the reader in memory may only be 8 byte
+    // aligned.
+    directory_table_ =
+        reinterpret_cast<const DirectoryTableEntry*>(directory_data);
+    file_count_ = file_count;
+    path_data_ = path_data;
+    return FinishDirectory();
+  }
+
+  directory_storage_.resize(file_count);
+  if (!ReadAt(dir_entry->offset, directory_storage_.data(),
+              dir_entry->length)) {
     fprintf(stderr, "error: Failed to read directory table.\n");
     return false;
   }
 
-  const IndexEntry* dirnames_entry = GetIndexEntry(kDirnamesType);
-  if (!dirnames_entry) {
-    fprintf(stderr, "error: Cannot find directory names chunk.\n");
+  if (dirnames_entry) {
+    path_storage_.resize(dirnames_entry->length);
+    if (!ReadAt(dirnames_entry->offset, path_storage_.data(),
+                dirnames_entry->length)) {
+      fprintf(stderr, "error: Failed to read directory names.\n");
+      return false;
+    }
+  }
+
+  directory_table_ = directory_storage_.data();
+  file_count_ = file_count;
+  path_data_ = dirnames_entry ? path_storage_.data() : nullptr;
+  return FinishDirectory();
+}
+
+bool ArchiveReader::FinishDirectory() {
+  prefix_index_built_.store(false, std::memory_order_relaxed);
+  return ValidateDirectory() && ReadFrontCodedNames() &&
+         ReadDirectoryIndex() && ReadPathFilter() && ReadDirectoryHashes() &&
+         ReadCompression();
+}
+
+bool ArchiveReader::ValidateDirectory() const {
+  // Front-coded names do not use the name ranges of the directory table.
+  const IndexEntry* dirnames_entry =
+      path_data_ ? GetIndexEntry(kDirnamesType) : nullptr;
+  for (uint64_t i = 0; i < file_count_; ++i) {
+    const DirectoryTableEntry& entry = directory_table_[i];
+    if (dirnames_entry &&
+        (entry.name_offset > dirnames_entry->length ||
+         entry.name_length > dirnames_entry->length - entry.name_offset)) {
+      fprintf(stderr, "error: Invalid name range for file %" PRIu64 ".\n", i);
+      return false;
+    }
+    // Writers align file data to at least 8 bytes, and to the page size unless
+    // asked to pack small files.
+    if (entry.data_offset % kMinDataAlignment != 0 ||
+        entry.data_length >
+            std::numeric_limits<uint64_t>::max() - entry.data_offset) {
+      fprintf(stderr, "error: Invalid data range for file %" PRIu64 ".\n", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ArchiveReader::ReadFrontCodedNames() {
+  const IndexEntry* names_entry = GetIndexEntry(kDirFrontCodedNamesType);
+  if (path_data_ || !names_entry)
+    return true;  // The archive stores its paths in a directory names chunk.
+
+  FrontCodedNamesChunk names;
+  if (names_entry->length < sizeof(FrontCodedNamesChunk) ||
+      !ReadAt(names_entry->offset, &names, sizeof(names))) {
+    fprintf(stderr, "error: Failed to read front-coded names chunk.\n");
+    return false;
+  }
+  if (names.version != kFrontCodedNamesVersion) {
+    fprintf(stderr, "error: Unsupported front-coded names version %u.\n",
+            names.version);
     return false;
   }
-  path_data_.resize(dirnames_entry->length);
 
-  if (lseek(fd_.get(), dirnames_entry->offset, SEEK_SET) < 0) {
-    fprintf(stderr, "error: Failed to seek to directory names chunk.\n");
+  uint64_t body_length = names_entry->length - sizeof(FrontCodedNamesChunk);
+  if (names.restart_interval == 0 || names.name_count != file_count_ ||
+      names.data_length > body_length) {
+    fprintf(stderr, "error: Invalid front-coded names chunk.\n");
     return false;
   }
-  if (!ReadVector(fd_.get(), &path_data_)) {
-    fprintf(stderr, "error: Failed to read directory names.\n");
+  uint64_t restart_count = (names.name_count + names.restart_interval - 1) /
+                           names.restart_interval;
+  uint64_t restarts_length = restart_count * sizeof(uint64_t);
+  if (body_length !=
+      restarts_length + AlignTo8ByteBoundary(names.data_length)) {
+    fprintf(stderr, "error: Invalid front-coded names chunk.\n");
     return false;
   }
 
+  uint64_t body_offset = names_entry->offset + sizeof(FrontCodedNamesChunk);
+  const char* body = nullptr;
+  if (mapping_) {
+    if (!GetMappedRange(body_offset, body_length, &body)) {
+      fprintf(stderr,
+              "error: Front-coded names chunk exceeds archive length.\n");
+      return false;
+    }
+  } else {
+    names_storage_.resize(body_length / sizeof(uint64_t));
+    if (!ReadAt(body_offset, names_storage_.data(), body_length)) {
+      fprintf(stderr, "error: Failed to read front-coded names.\n");
+      return false;
+    }
+    body = reinterpret_cast<const char*>(names_storage_.data());
+  }
+
+  if (!front_coded_names_.Init(names,
+                               reinterpret_cast<const uint64_t*>(body),
+                               body + restarts_length, directory_table_,
+                               file_count_)) {
+    fprintf(stderr, "error: Invalid front-coded names chunk.\n");
+    return false;
+  }
+  return true;
+}
+
+bool ArchiveReader::ReadDirectoryIndex() {
+  index_slots_ = nullptr;
+  index_slot_count_ = 0;
+
+  const IndexEntry* dirindex_entry = GetIndexEntry(kDirIndexType);
+  if (!dirindex_entry)
+    return true;  // The directory index is optional.
+
+  DirectoryIndexChunk dirindex;
+  if (dirindex_entry->length < sizeof(DirectoryIndexChunk) ||
+      !ReadAt(dirindex_entry->offset, &dirindex, sizeof(dirindex))) {
+    fprintf(stderr, "error: Failed to read directory index chunk.\n");
+    return false;
+  }
+  if (dirindex.hash_function != kPathHashFunction)
+    return true;  // Fall back to binary search for unknown hash functions.
+
+  uint64_t slot_count = dirindex.slot_count;
+  if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0 ||
+      dirindex_entry->length !=
+          sizeof(DirectoryIndexChunk) +
+              slot_count * sizeof(DirectoryIndexSlot)) {
+    fprintf(stderr, "error: Invalid directory index chunk.\n");
+    return false;
+  }
+
+  uint64_t slots_offset = dirindex_entry->offset + sizeof(DirectoryIndexChunk);
+  uint64_t slots_length = slot_count * sizeof(DirectoryIndexSlot);
+  if (mapping_) {
+    const char* slots_data = nullptr;
+    if (!GetMappedRange(slots_offset, slots_length, &slots_data)) {
+      fprintf(stderr, "error: Directory index chunk exceeds archive length.\n");
+      return false;
+    }
+    index_slots_ = reinterpret_cast<const DirectoryIndexSlot*>(slots_data);
+  } else {
+    index_storage_.resize(slot_count);
+    if (!ReadAt(slots_offset, index_storage_.data(), slots_length)) {
+      fprintf(stderr, "error: Failed to read directory index.\n");
+      return false;
+    }
+    index_slots_ = index_storage_.data();
+  }
+  index_slot_count_ = slot_count;
+  return true;
+}
+
+bool ArchiveReader::ReadPathFilter() {
+  filter_words_ = nullptr;
+  filter_block_count_ = 0;
+
+  const IndexEntry* filter_entry = GetIndexEntry(kDirFilterType);
+  if (filter_entry) {
+    PathFilterChunk filter;
+    if (filter_entry->length < sizeof(PathFilterChunk) ||
+        !ReadAt(filter_entry->offset, &filter, sizeof(filter))) {
+      fprintf(stderr, "error: Failed to read path filter chunk.\n");
+      return false;
+    }
+    uint64_t words_length = filter_entry->length - sizeof(PathFilterChunk);
+    if (filter.hash_function == kPathHashFunction &&
+        filter.probe_count == kFilterProbeCount) {
+      uint64_t block_length = kFilterBlockWords * sizeof(uint64_t);
+      if (filter.block_count == 0 ||
+          words_length / block_length != filter.block_count ||
+          words_length % block_length != 0) {
+        fprintf(stderr, "error: Invalid path filter chunk.\n");
+        return false;
+      }
+
+      uint64_t words_offset = filter_entry->offset + sizeof(PathFilterChunk);
+      if (mapping_) {
+        const char* words_data = nullptr;
+        if (!GetMappedRange(words_offset, words_length, &words_data)) {
+          fprintf(stderr, "error: Path filter chunk exceeds archive length.\n");
+          return false;
+        }
+        filter_words_ = reinterpret_cast<const uint64_t*>(words_data);
+      } else {
+        filter_storage_.resize(words_length / sizeof(uint64_t));
+        if (!ReadAt(words_offset, filter_storage_.data(), words_length)) {
+          fprintf(stderr, "error: Failed to read path filter.\n");
+          return false;
+        }
+        filter_words_ = filter_storage_.data();
+      }
+      filter_block_count_ = filter.block_count;
+      return true;
+    }
+    // Filters built with an unknown hash function or probe count are ignored.
+  }
+
+  // The directory index already rejects absent paths in about one probe, but
+  // binary searches of older archives benefit from a filter built here.
+  if (index_slots_ || file_count_ == 0)
+    return true;
+  filter_block_count_ = GetFilterBlockCount(file_count_);
+  filter_storage_.assign(filter_block_count_ * kFilterBlockWords, 0);
+  ListPaths([this](ftl::StringView path) {
+    AddToFilter(HashPath(path), filter_storage_.data(), filter_block_count_);
+  });
+  filter_words_ = filter_storage_.data();
+  return true;
+}
+
+bool ArchiveReader::ReadDirectoryHashes() {
+  content_hashes_ = nullptr;
+
+  const IndexEntry* dirhash_entry = GetIndexEntry(kDirHashType);
+  if (!dirhash_entry)
+    return true;  // Content hashes are optional.
+
+  DirectoryHashChunk dirhash;
+  if (dirhash_entry->length < sizeof(DirectoryHashChunk) ||
+      !ReadAt(dirhash_entry->offset, &dirhash, sizeof(dirhash))) {
+    fprintf(stderr, "error: Failed to read directory hash chunk.\n");
+    return false;
+  }
+  if (dirhash.algorithm != kHashAlgorithm)
+    return true;  // Ignore hashes computed with an unknown algorithm.
+
+  if (dirhash.hash_length != kHashLength ||
+      dirhash_entry->length !=
+          sizeof(DirectoryHashChunk) + file_count_ * sizeof(ContentHash)) {
+    fprintf(stderr, "error: Invalid directory hash chunk.\n");
+    return false;
+  }
+
+  uint64_t hashes_offset = dirhash_entry->offset + sizeof(DirectoryHashChunk);
+  uint64_t hashes_length = file_count_ * sizeof(ContentHash);
+  if (mapping_) {
+    const char* hashes_data = nullptr;
+    if (!GetMappedRange(hashes_offset, hashes_length, &hashes_data)) {
+      fprintf(stderr, "error: Directory hash chunk exceeds archive length.\n");
+      return false;
+    }
+    content_hashes_ = reinterpret_cast<const ContentHash*>(hashes_data);
+  } else {
+    hash_storage_.resize(file_count_);
+    if (!ReadAt(hashes_offset, hash_storage_.data(), hashes_length)) {
+      fprintf(stderr, "error: Failed to read directory hashes.\n");
+      return false;
+    }
+    content_hashes_ = hash_storage_.data();
+  }
+  return true;
+}
+
+bool ArchiveReader::ReadCompression() {
+  compressed_entries_ = nullptr;
+  compressed_entry_count_ = 0;
+  block_offsets_ = nullptr;
+
+  const IndexEntry* compression_entry = GetIndexEntry(kDirCompressionType);
+  if (!compression_entry)
+    return true;  // Compression is optional.
+
+  CompressionChunk compression;
+  if (compression_entry->length < sizeof(CompressionChunk) ||
+      !ReadAt(compression_entry->offset, &compression, sizeof(compression))) {
+    fprintf(stderr, "error: Failed to read compression chunk.\n");
+    return false;
+  }
+  if (compression.algorithm != kCompressionZlib) {
+    fprintf(stderr, "error: Unsupported compression algorithm %u.\n",
+            compression.algorithm);
+    return false;
+  }
+
+  uint64_t body_length = compression_entry->length - sizeof(CompressionChunk);
+  uint64_t entry_count = compression.entry_count;
+  if (compression.block_size == 0 || entry_count > file_count_ ||
+      body_length % sizeof(uint64_t) != 0 ||
+      entry_count * sizeof(CompressedEntry) > body_length) {
+    fprintf(stderr, "error: Invalid compression chunk.\n");
+    return false;
+  }
+
+  uint64_t body_offset = compression_entry->offset + sizeof(CompressionChunk);
+  const char* body = nullptr;
+  if (mapping_) {
+    if (!GetMappedRange(body_offset, body_length, &body)) {
+      fprintf(stderr, "error: Compression chunk exceeds archive length.\n");
+      return false;
+    }
+  } else {
+    compression_storage_.resize(body_length / sizeof(uint64_t));
+    if (!ReadAt(body_offset, compression_storage_.data(), body_length)) {
+      fprintf(stderr, "error: Failed to read compression chunk.\n");
+      return false;
+    }
+    body = reinterpret_cast<const char*>(compression_storage_.data());
+  }
+
+  const CompressedEntry* entries =
+      reinterpret_cast<const CompressedEntry*>(body);
+  const uint64_t* block_offsets = reinterpret_cast<const uint64_t*>(
+      body + entry_count * sizeof(CompressedEntry));
+  uint64_t block_offset_count =
+      (body_length - entry_count * sizeof(CompressedEntry)) / sizeof(uint64_t);
+
+  for (uint64_t i = 0; i < entry_count; ++i) {
+    const CompressedEntry& entry = entries[i];
+    uint64_t expected_blocks =
+        (entry.uncompressed_length + compression.block_size - 1) /
+        compression.block_size;
+    if ((i > 0 && entry.entry <= entries[i - 1].entry) ||
+        entry.entry >= file_count_ || entry.block_count == 0 ||
+        entry.block_count != std::max<uint64_t>(expected_blocks, 1) ||
+        entry.first_block_offset > block_offset_count ||
+        entry.block_count >= block_offset_count - entry.first_block_offset) {
+      fprintf(stderr, "error: Invalid compressed entry.\n");
+      return false;
+    }
+    const uint64_t* offsets = block_offsets + entry.first_block_offset;
+    for (uint64_t block = 0; block < entry.block_count; ++block) {
+      if (offsets[block] > offsets[block + 1]) {
+        fprintf(stderr, "error: Invalid compressed block offsets.\n");
+        return false;
+      }
+    }
+    if (offsets[entry.block_count] !=
+        directory_table_[entry.entry].data_length) {
+      fprintf(stderr, "error: Invalid compressed data length.\n");
+      return false;
+    }
+  }
+
+  compression_block_size_ = compression.block_size;
+  compressed_entries_ = entries;
+  compressed_entry_count_ = entry_count;
+  block_offsets_ = block_offsets;
+  if (!block_cache_)
+    block_cache_ = std::make_unique<BlockCache>(kBlockCacheCapacity);
+  return true;
+}
+
+bool ArchiveReader::ReadAt(uint64_t offset,
+                           void* buffer,
+                           uint64_t length) const {
+  if (mapping_) {
+    const char* data = nullptr;
+    if (!GetMappedRange(offset, length, &data))
+      return false;
+    memcpy(buffer, data, length);
+    return true;
+  }
+  uint64_t source_offset = 0;
+  return GetSourceOffset(offset, length, &source_offset) &&
+         ReadFileAt(fd_.get(), source_offset, buffer, length);
+}
+
+bool ArchiveReader::GetSourceOffset(uint64_t offset,
+                                    uint64_t length,
+                                    uint64_t* source_offset) const {
+  if (offset > source_length_ || length > source_length_ - offset ||
+      offset > std::numeric_limits<uint64_t>::max() - source_offset_)
+    return false;
+  *source_offset = source_offset_ + offset;
+  return true;
+}
+
+bool ArchiveReader::GetMappedRange(uint64_t offset,
+                                   uint64_t length,
+                                   const char** data) const {
+  if (offset > mapping_size_ || length > mapping_size_ - offset)
+    return false;
+  *data = mapping_ + offset;
   return true;
 }
 
@@ -198,4 +999,205 @@ const IndexEntry* ArchiveReader::GetIndexEntry(uint64_t type) const {
   return nullptr;
 }
 
+bool ArchiveReader::VerifyEntry(const DirectoryTableEntry& entry) const {
+  ContentHash actual;
+  bool hashed = false;
+  if (mapping_) {
+    const char* data = nullptr;
+    hashed = GetMappedRange(entry.data_offset, entry.data_length, &data);
+    if (hashed)
+      HashBuffer(data, entry.data_length, &actual);
+  } else {
+    uint64_t source_offset = 0;
+    hashed = GetSourceOffset(entry.data_offset, entry.data_length,
+                             &source_offset) &&
+             HashFileRange(fd_.get(), source_offset, entry.data_length,
+                           &actual);
+  }
+  std::string buffer;
+  ftl::StringView path = GetPath(entry, &buffer);
+  if (!hashed) {
+    fprintf(stderr, "error: Failed to read contents of '%.*s'.\n",
+            static_cast<int>(path.size()), path.data());
+    return false;
+  }
+  if (actual != content_hashes_[&entry - directory_table_]) {
+    fprintf(stderr, "error: Contents of '%.*s' do not match its hash.\n",
+            static_cast<int>(path.size()), path.data());
+    return false;
+  }
+  return true;
+}
+
+const CompressedEntry* ArchiveReader::GetCompressedEntry(
+    const DirectoryTableEntry& entry) const {
+  if (!compressed_entry_count_)
+    return nullptr;
+  // |entry| always refers into |directory_table_|.
+  uint64_t index = &entry - directory_table_;
+  const CompressedEntry* end = compressed_entries_ + compressed_entry_count_;
+  const CompressedEntry* it = std::lower_bound(
+      compressed_entries_, end, index,
+      [](const CompressedEntry& lhs, uint64_t rhs) { return lhs.entry < rhs; });
+  if (it == end || it->entry != index)
+    return nullptr;
+  return it;
+}
+
+bool ArchiveReader::ReadBlock(const DirectoryTableEntry& entry,
+                              const CompressedEntry& compressed,
+                              uint64_t block,
+                              std::string* output) const {
+  const uint64_t* offsets = block_offsets_ + compressed.first_block_offset;
+  uint64_t begin = offsets[block];
+  uint64_t length = offsets[block + 1] - begin;
+  uint64_t block_start = block * compression_block_size_;
+  output->resize(std::min<uint64_t>(compression_block_size_,
+                                    compressed.uncompressed_length -
+                                        block_start));
+
+  const char* data = nullptr;
+  std::string buffer;
+  if (mapping_) {
+    if (!GetMappedRange(entry.data_offset + begin, length, &data))
+      return false;
+  } else {
+    buffer.resize(length);
+    if (!ReadAt(entry.data_offset + begin, &buffer[0], length))
+      return false;
+    data = buffer.data();
+  }
+  return DecompressBlock(data, length, output);
+}
+
+std::shared_ptr<const std::string> ArchiveReader::GetCachedBlock(
+    const DirectoryTableEntry& entry,
+    const CompressedEntry& compressed,
+    uint64_t block) const {
+  // Deduplicated files share their compressed blocks, so blocks are keyed by
+  // their location in the archive.
+  uint64_t key = entry.data_offset +
+                 block_offsets_[compressed.first_block_offset + block];
+  std::shared_ptr<const std::string> cached = block_cache_->Get(key);
+  if (cached)
+    return cached;
+  auto data = std::make_shared<std::string>();
+  if (!ReadBlock(entry, compressed, block, data.get()))
+    return nullptr;
+  block_cache_->Put(key, data);
+  return data;
+}
+
+bool ArchiveReader::WriteDecompressed(const DirectoryTableEntry& entry,
+                                      const CompressedEntry& compressed,
+                                      int dst_fd) const {
+  // Streams the blocks without going through the block cache, which would
+  // otherwise be flushed by every large file.
+  std::string data;
+  for (uint64_t block = 0; block < compressed.block_count; ++block) {
+    if (!ReadBlock(entry, compressed, block, &data) ||
+        !ftl::WriteFileDescriptor(dst_fd, data.data(), data.size()))
+      return false;
+  }
+  return true;
+}
+
+void ArchiveReader::FindPrefixRange(ftl::StringView prefix,
+                                    uint64_t first,
+                                    uint64_t* begin,
+                                    uint64_t* end) const {
+  *begin = std::max(first, LowerBound(prefix));
+
+  // Paths that start with |prefix| sort before the smallest string that is
+  // greater than every such path, which increments the last byte of |prefix|
+  // that can be incremented.
+  std::string successor = prefix.ToString();
+  while (!successor.empty() && static_cast<uint8_t>(successor.back()) == 0xff)
+    successor.pop_back();
+  if (successor.empty()) {
+    *end = file_count_;
+  } else {
+    ++successor.back();
+    *end = std::max(*begin, LowerBound(successor));
+  }
+}
+
+uint64_t ArchiveReader::LowerBound(ftl::StringView path) const {
+  if (!front_coded_names_.empty()) {
+    std::string buffer;
+    return front_coded_names_.LowerBound(path, &buffer);
+  }
+
+  uint64_t begin = 0;
+  uint64_t end = file_count_;
+  const PathPrefixIndex* prefix_index = GetPrefixIndex();
+  if (prefix_index && !prefix_index->empty()) {
+    prefix_index->FindCandidates(path, &begin, &end);
+    if (begin == end)
+      return begin;
+  }
+
+  PathComparator comparator;
+  comparator.reader = this;
+  return std::lower_bound(directory_table_ + begin, directory_table_ + end,
+                          path, comparator) -
+         directory_table_;
+}
+
+const PathPrefixIndex* ArchiveReader::GetPrefixIndex() const {
+  // Front-coded names are searched by their restart blocks instead.
+  if (!front_coded_names_.empty() || file_count_ < kMinPrefixIndexFileCount ||
+      file_count_ > std::numeric_limits<uint32_t>::max())
+    return nullptr;
+  if (!prefix_index_built_.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(prefix_index_mutex_);
+    if (!prefix_index_built_.load(std::memory_order_relaxed)) {
+      prefix_index_.Build(file_count_, [this](uint64_t i) {
+        return GetPathView(directory_table_[i]);
+      });
+      prefix_index_built_.store(true, std::memory_order_release);
+    }
+  }
+  return &prefix_index_;
+}
+
+bool ArchiveReader::MayContainPath(uint64_t hash) const {
+  return !filter_words_ ||
+         FilterMayContain(hash, filter_words_, filter_block_count_);
+}
+
+const DirectoryTableEntry* ArchiveReader::FindEntry(
+    ftl::StringView archive_path) const {
+  uint64_t hash = HashPath(archive_path);
+  if (!MayContainPath(hash))
+    return nullptr;
+
+  std::string buffer;
+
+  if (index_slots_) {
+    uint32_t hash_tag = static_cast<uint32_t>(hash >> 32);
+    uint64_t mask = index_slot_count_ - 1;
+    uint64_t slot = hash & mask;
+    for (uint64_t probes = 0; probes < index_slot_count_; ++probes) {
+      const DirectoryIndexSlot& candidate = index_slots_[slot];
+      if (candidate.entry == 0)
+        return nullptr;
+      if (candidate.hash_tag == hash_tag && candidate.entry <= file_count_) {
+        const DirectoryTableEntry* entry =
+            &directory_table_[candidate.entry - 1];
+        if (GetPath(*entry, &buffer) == archive_path)
+          return entry;
+      }
+      slot = (slot + 1) & mask;
+    }
+    return nullptr;
+  }
+
+  uint64_t index = LowerBound(archive_path);
+  if (index == file_count_ ||
+      GetPath(directory_table_[index], &buffer) != archive_path)
+    return nullptr;
+  return &directory_table_[index];
+}
+
 }  // namespace archive
@@ -5,55 +5,400 @@
 #ifndef APPLICATION_LIB_FAR_ARCHIVE_READER_H_
 #define APPLICATION_LIB_FAR_ARCHIVE_READER_H_
 
+#include <stddef.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "application/lib/far/compression.h"
+#include "application/lib/far/content_hash.h"
 #include "application/lib/far/format.h"
+#include "application/lib/far/front_coded_names.h"
+#include "application/lib/far/path_prefix_index.h"
 #include "lib/ftl/files/unique_fd.h"
 #include "lib/ftl/strings/string_view.h"
 
 namespace archive {
 
+struct ExtractOptions {
+  // The number of threads used to extract files. Zero means one thread per
+  // core.
+  size_t jobs = 0;
+};
+
+// Reads archives in the FAR format.
+//
+// An archive is read from a whole file, from a range of a file such as an
+// archive nested in another archive, or from memory.
+//
+// Files stored compressed are decompressed transparently by |ExtractFile|,
+// |CopyFile|, |ExtractAll| and |ReadFileRange|.
+//
+// Once |Read| or |MapAndRead| has returned true, the const methods of this
+// class are safe to call concurrently from multiple threads. File data is read
+// with positional I/O and never uses or modifies the file position of the
+// underlying file descriptor, which means a single reader can serve a pool of
+// worker threads.
 class ArchiveReader {
  public:
   explicit ArchiveReader(ftl::UniqueFD fd);
+
+  // Reads the archive stored in the |length| bytes starting at |offset| in
+  // |fd|. Nothing outside that range is read.
+  ArchiveReader(ftl::UniqueFD fd, uint64_t offset, uint64_t length);
+
+  // Reads the archive stored in the |length| bytes at |data|, which must be 8
+  // byte aligned and outlive the reader. Both |Read| and |MapAndRead| access
+  // it in place.
+  ArchiveReader(const char* data, size_t length);
+
   ~ArchiveReader();
   ArchiveReader(const ArchiveReader& other) = delete;
 
+  // Reads the index and copies the directory of the archive into memory.
   bool Read();
 
-  uint64_t file_count() const { return directory_table_.size(); }
+  // Maps the archive into memory and reads the index and directory in place.
+  //
+  // Unlike |Read|, the directory table and path names are not copied. Instead,
+  // directory lookups and |GetPathView| point directly into the mapping, and
+  // |GetFileView| can be used to access file contents without copying.
+  //
+  // Returns false if the archive cannot be mapped or is not a valid archive.
+  bool MapAndRead();
+
+  uint64_t file_count() const { return file_count_; }
 
+  // Calls |callback| with every path in the archive, in order. The paths of
+  // archives with front-coded names are decoded one after the other and are
+  // only valid for the duration of the call.
   template <typename Callback>
   void ListPaths(Callback callback) const {
-    for (const auto& entry : directory_table_)
-      callback(GetPathView(entry));
+    if (!front_coded_names_.empty()) {
+      front_coded_names_.ForEach(callback);
+      return;
+    }
+    for (uint64_t i = 0; i < file_count_; ++i)
+      callback(GetPathView(directory_table_[i]));
   }
 
   template <typename Callback>
   void ListDirectory(Callback callback) const {
-    for (const auto& entry : directory_table_)
-      callback(entry);
+    for (uint64_t i = 0; i < file_count_; ++i)
+      callback(directory_table_[i]);
+  }
+
+  // Calls |callback| with the directory table entry of every file whose path
+  // starts with |prefix|, in path order. Only the matching range of the sorted
+  // directory table is visited.
+  template <typename Callback>
+  void ListPrefix(ftl::StringView prefix, Callback callback) const {
+    uint64_t begin = 0;
+    uint64_t end = 0;
+    FindPrefixRange(prefix, 0, &begin, &end);
+    for (uint64_t i = begin; i < end; ++i)
+      callback(directory_table_[i]);
+  }
+
+  // Calls |callback| with the name of every immediate child of the directory
+  // |dir| and whether that child is itself a directory, in path order. An
+  // empty |dir| lists the root of the archive.
+  //
+  // Runs in time proportional to the number of children times the logarithm
+  // of the number of files, rather than to the number of files below |dir|.
+  template <typename Callback>
+  void ListChildren(ftl::StringView dir, Callback callback) const {
+    std::string prefix = dir.ToString();
+    if (!prefix.empty() && prefix.back() != '/')
+      prefix.push_back('/');
+    uint64_t begin = 0;
+    uint64_t end = 0;
+    FindPrefixRange(prefix, 0, &begin, &end);
+    std::string buffer;
+    while (begin < end) {
+      ftl::StringView rest =
+          GetPath(directory_table_[begin], &buffer).substr(prefix.size());
+      size_t slash = rest.find('/');
+      if (slash == ftl::StringView::npos) {
+        callback(rest, false);
+        ++begin;
+        continue;
+      }
+      ftl::StringView child = rest.substr(0, slash);
+      callback(child, true);
+      // Skip over the contents of |child|, which are contiguous.
+      uint64_t child_end = 0;
+      FindPrefixRange(prefix + child.ToString() + "/", begin, &begin,
+                      &child_end);
+      begin = child_end;
+    }
   }
 
   bool ExtractFile(ftl::StringView archive_path, const char* output_path) const;
   bool CopyFile(ftl::StringView archive_path, int dst_fd) const;
+
+  // Copies the data of the file at |archive_path| exactly as it is stored in
+  // the archive, without decompressing it, to |dst_offset| in |dst_fd|.
+  //
+  // Used to carry unchanged files over into a new archive. The data is copied
+  // inside the kernel, or shared when both archives live on a file system
+  // that supports reflinks.
+  bool CopyStoredData(ftl::StringView archive_path,
+                      int dst_fd,
+                      uint64_t dst_offset) const;
+
+  // Extracts every file in the archive into |output_dir|, creating
+  // subdirectories as needed.
+  //
+  // Each directory is created once, and files are extracted in parallel in
+  // the order of their data in the archive so that the archive is read
+  // sequentially. Fails without extracting anything if a path in the archive
+  // would escape |output_dir|.
+  bool ExtractAll(const std::string& output_dir,
+                  const ExtractOptions& options) const;
   bool GetDirectoryEntry(ftl::StringView archive_path,
                          DirectoryTableEntry* entry) const;
 
+  // Looks up every path in |paths|, setting the corresponding element of
+  // |entries| to the entry of that path in the directory table or to null if
+  // the archive has no such file. Returns the number of paths found.
+  //
+  // Uses the directory index when the archive has one. Otherwise, the paths
+  // are sorted and resolved in a single galloping pass over the sorted
+  // directory table, which approaches linear time for large batches. Paths
+  // of archives with front-coded names are looked up one at a time.
+  size_t GetDirectoryEntries(
+      const std::vector<ftl::StringView>& paths,
+      std::vector<const DirectoryTableEntry*>* entries) const;
+
+  // Returns the length of the uncompressed contents of the file at
+  // |archive_path|.
+  bool GetFileLength(ftl::StringView archive_path, uint64_t* length) const;
+
+  // Reads |length| bytes starting at |offset| within the uncompressed contents
+  // of the file at |archive_path| into |buffer|.
+  //
+  // Random reads from compressed files are served from a bounded cache of
+  // recently decompressed blocks.
+  bool ReadFileRange(ftl::StringView archive_path,
+                     uint64_t offset,
+                     uint64_t length,
+                     char* buffer) const;
+
+  // Returns whether any file in the archive is stored compressed.
+  bool has_compressed_files() const { return compressed_entry_count_ != 0; }
+
+  // Returns whether the file at |archive_path| is stored compressed.
+  bool IsCompressed(ftl::StringView archive_path) const;
+
+  // Returns a view of the contents of the file at |archive_path| that borrows
+  // from the mapping created by |MapAndRead|. The view is valid for the
+  // lifetime of this reader.
+  //
+  // Returns false if the archive is not mapped, the file does not exist, or
+  // the file is stored compressed.
+  bool GetFileView(ftl::StringView archive_path,
+                   ftl::StringView* contents) const;
+
+  // Returns whether the archive stores a content hash for every file.
+  bool has_content_hashes() const { return content_hashes_ != nullptr; }
+
+  // Copies the stored content hash of the file at |archive_path| to |hash|.
+  //
+  // Returns false if the file does not exist or the archive does not store
+  // content hashes.
+  bool GetContentHash(ftl::StringView archive_path, ContentHash* hash) const;
+
+  // Checks that the contents of the file at |archive_path| match its stored
+  // content hash.
+  //
+  // Returns false if they do not match or the archive does not store content
+  // hashes.
+  bool VerifyFile(ftl::StringView archive_path) const;
+
+  // Checks the contents of every file in the archive against their stored
+  // content hashes using up to |jobs| threads, or one thread per core if
+  // |jobs| is zero. Every file that does not match is reported.
+  bool VerifyAll(size_t jobs) const;
+
+  // Returns a reader for the archive stored uncompressed at |archive_path| in
+  // this archive, without copying it, or null if there is no such file or it
+  // is compressed. Neither |Read| nor |MapAndRead| has been called on the
+  // returned reader.
+  //
+  // The nested reader reads from a duplicate of the file descriptor of this
+  // reader. If this reader has no file descriptor, the nested reader reads
+  // from the memory of this reader and must not outlive it.
+  std::unique_ptr<ArchiveReader> OpenArchive(
+      ftl::StringView archive_path) const;
+
   ftl::UniqueFD TakeFileDescriptor();
 
+  // Returns an estimate of the memory held by this reader, in bytes. The
+  // estimate grows as paths are expanded from front-coded names.
+  //
+  // Archives read from memory are included, since the reader cannot tell
+  // whether that memory is ever released, as it is not for anonymous VMOs.
+  // Archives mapped by |MapAndRead| are not, since their pages are backed by
+  // the file.
+  uint64_t GetMemoryUsage() const;
+
+  // Returns whether the archive stores front-coded names, whose paths
+  // |GetPath| decodes rather than returning a view of the archive.
+  bool has_front_coded_names() const { return !front_coded_names_.empty(); }
+
+  // Returns the path of |entry|, which is valid for the lifetime of this
+  // reader.
+  //
+  // Paths of archives with front-coded names are expanded on first use and
+  // kept until the reader is destroyed. Prefer |GetPath| or |ListPaths| when
+  // visiting many paths of such archives.
   ftl::StringView GetPathView(const DirectoryTableEntry& entry) const;
 
+  // Returns the path of |entry|, decoding it into |buffer| if the archive has
+  // front-coded names. The path is valid until |buffer| is next modified.
+  ftl::StringView GetPath(const DirectoryTableEntry& entry,
+                          std::string* buffer) const;
+
  private:
   bool ReadIndex();
   bool ReadDirectory();
 
+  // Validates the directory and reads the optional chunks that describe it.
+  bool FinishDirectory();
+
+  // Checks that the name of every file lies within the directory names chunk,
+  // and that its data is 8 byte aligned and does not overflow.
+  bool ValidateDirectory() const;
+  bool ReadFrontCodedNames();
+  bool ReadDirectoryIndex();
+
+  // Reads the path filter chunk, or builds the filter in memory if the archive
+  // has neither a path filter nor a directory index.
+  bool ReadPathFilter();
+  bool ReadDirectoryHashes();
+  bool ReadCompression();
+  bool ReadAt(uint64_t offset, void* buffer, uint64_t length) const;
+
+  // Translates a range of the archive into a range of |fd_|. Returns false if
+  // the range is not within the part of |fd_| that holds the archive.
+  bool GetSourceOffset(uint64_t offset,
+                       uint64_t length,
+                       uint64_t* source_offset) const;
+  bool GetMappedRange(uint64_t offset,
+                      uint64_t length,
+                      const char** data) const;
+
   const IndexEntry* GetIndexEntry(uint64_t type) const;
 
+  // Sets [|begin|, |end|) to the range of directory table indices, starting
+  // the search at |first|, whose paths start with |prefix|.
+  void FindPrefixRange(ftl::StringView prefix,
+                       uint64_t first,
+                       uint64_t* begin,
+                       uint64_t* end) const;
+
+  // Returns the index of the first entry in the directory table whose path is
+  // not less than |path|.
+  uint64_t LowerBound(ftl::StringView path) const;
+
+  // Returns the prefix index of a large directory table, building it on first
+  // use, or null if binary searches are not worth narrowing.
+  const PathPrefixIndex* GetPrefixIndex() const;
+
+  // Returns whether the path with the given hash might be in the archive.
+  bool MayContainPath(uint64_t hash) const;
+
+  // Returns the directory table entry for |archive_path|, using the directory
+  // index if the archive has one and binary search otherwise. Most absent
+  // paths are rejected by the path filter first.
+  const DirectoryTableEntry* FindEntry(ftl::StringView archive_path) const;
+
+  bool ExtractEntry(const DirectoryTableEntry& entry,
+                    const char* output_path) const;
+  bool CopyEntry(const DirectoryTableEntry& entry, int dst_fd) const;
+
+  // Returns the compression record of |entry|, or null if |entry| is stored
+  // uncompressed.
+  const CompressedEntry* GetCompressedEntry(
+      const DirectoryTableEntry& entry) const;
+  bool ReadBlock(const DirectoryTableEntry& entry,
+                 const CompressedEntry& compressed,
+                 uint64_t block,
+                 std::string* output) const;
+  std::shared_ptr<const std::string> GetCachedBlock(
+      const DirectoryTableEntry& entry,
+      const CompressedEntry& compressed,
+      uint64_t block) const;
+  bool WriteDecompressed(const DirectoryTableEntry& entry,
+                         const CompressedEntry& compressed,
+                         int dst_fd) const;
+  bool VerifyEntry(const DirectoryTableEntry& entry) const;
+
   ftl::UniqueFD fd_;
+
+  // The range of |fd_| that holds the archive.
+  uint64_t source_offset_ = 0;
+  uint64_t source_length_;
   std::vector<IndexEntry> index_;
-  std::vector<DirectoryTableEntry> directory_table_;
-  std::vector<char> path_data_;
+
+  // Points either into |directory_storage_| and |path_storage_| or into
+  // |mapping_|, depending on whether the archive was read or mapped.
+  const DirectoryTableEntry* directory_table_ = nullptr;
+  uint64_t file_count_ = 0;
+  const char* path_data_ = nullptr;
+
+  // Set instead of |path_data_| if the archive has front-coded names. Paths
+  // returned by |GetPathView| are expanded into |expanded_paths_|, keyed by
+  // directory table index.
+  FrontCodedNames front_coded_names_;
+  mutable std::mutex expanded_paths_mutex_;
+  mutable std::unordered_map<uint64_t, std::string> expanded_paths_;
+  mutable uint64_t expanded_paths_size_ = 0;
+
+  // Optional hash table from the directory index chunk.
+  const DirectoryIndexSlot* index_slots_ = nullptr;
+  uint64_t index_slot_count_ = 0;
+
+  // Bloom filter from the path filter chunk or built by |ReadPathFilter|.
+  const uint64_t* filter_words_ = nullptr;
+  uint64_t filter_block_count_ = 0;
+
+  // Narrows binary searches of large directory tables. Built by the first
+  // search that needs it, since exact lookups usually go through
+  // |index_slots_| instead.
+  mutable std::mutex prefix_index_mutex_;
+  mutable std::atomic<bool> prefix_index_built_{false};
+  mutable PathPrefixIndex prefix_index_;
+
+  // Optional content hashes from the directory hash chunk.
+  const ContentHash* content_hashes_ = nullptr;
+
+  // Optional description of compressed files from the compression chunk.
+  uint32_t compression_block_size_ = 0;
+  const CompressedEntry* compressed_entries_ = nullptr;
+  uint64_t compressed_entry_count_ = 0;
+  const uint64_t* block_offsets_ = nullptr;
+  std::unique_ptr<BlockCache> block_cache_;
+
+  std::vector<DirectoryTableEntry> directory_storage_;
+  std::vector<char> path_storage_;
+  std::vector<uint64_t> names_storage_;
+  std::vector<DirectoryIndexSlot> index_storage_;
+  std::vector<uint64_t> filter_storage_;
+  std::vector<ContentHash> hash_storage_;
+  std::vector<uint64_t> compression_storage_;
+
+  // The archive in memory, which is part of |mapped_region_| if the reader
+  // mapped it.
+  const char* mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+  void* mapped_region_ = nullptr;
+  size_t mapped_region_size_ = 0;
 };
 
 }  // namespace archive
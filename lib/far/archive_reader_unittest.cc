@@ -0,0 +1,910 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "application/lib/far/archive_reader.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "application/lib/far/alignment.h"
+#include "application/lib/far/archive_writer.h"
+#include "application/lib/far/compression.h"
+#include "application/lib/far/file_operations.h"
+#include "application/lib/far/path_filter.h"
+#include "application/lib/far/path_hash.h"
+#include "gtest/gtest.h"
+#include "lib/ftl/files/file.h"
+#include "lib/ftl/files/scoped_temp_dir.h"
+#include "lib/ftl/files/unique_fd.h"
+
+namespace archive {
+namespace {
+
+class ArchiveReaderTest : public ::testing::Test {
+ protected:
+  void AddFile(ArchiveWriter* writer,
+               const std::string& dst_path,
+               const std::string& contents,
+               bool compress = false) {
+    std::string src_path;
+    ASSERT_TRUE(temp_dir_.NewTempFile(&src_path));
+    ASSERT_TRUE(
+        files::WriteFile(src_path, contents.data(), contents.size()));
+    ArchiveEntry entry(src_path, dst_path);
+    entry.compress = compress;
+    ASSERT_TRUE(writer->Add(std::move(entry)));
+  }
+
+  ftl::UniqueFD WriteArchive(ArchiveWriter* writer) {
+    std::string archive_path;
+    EXPECT_TRUE(temp_dir_.NewTempFile(&archive_path));
+    ftl::UniqueFD fd(open(archive_path.c_str(), O_RDWR));
+    EXPECT_TRUE(writer->Write(fd.get()));
+    return fd;
+  }
+
+  std::string ReadContents(int fd) {
+    std::string contents(lseek(fd, 0, SEEK_END), '\0');
+    EXPECT_TRUE(ReadFileAt(fd, 0, &contents[0], contents.size()));
+    return contents;
+  }
+
+  // Renames the chunk of the given type in |archive| to |unknown_type| so
+  // that readers ignore it.
+  bool RenameChunk(std::string* archive, uint64_t type, uint64_t unknown_type) {
+    size_t type_offset =
+        archive->find(std::string(reinterpret_cast<const char*>(&type), 8));
+    if (type_offset == std::string::npos)
+      return false;
+    memcpy(&(*archive)[type_offset], &unknown_type, 8);
+    return true;
+  }
+
+  // Returns the length of the chunk of the given type in |archive|, or zero
+  // if it has none.
+  uint64_t GetChunkLength(const std::string& archive, uint64_t type) {
+    size_t type_offset =
+        archive.find(std::string(reinterpret_cast<const char*>(&type), 8));
+    if (type_offset == std::string::npos)
+      return 0;
+    IndexEntry entry;
+    memcpy(&entry, &archive[type_offset], sizeof(entry));
+    return entry.length;
+  }
+
+  // Renames the directory index chunk of |archive| so that lookups fall back
+  // to searching the directory table.
+  bool RemoveDirectoryIndex(std::string* archive) {
+    return RenameChunk(archive, kDirIndexType,
+                       0x5858585858524944);  // DIRXXXXX
+  }
+
+  ftl::UniqueFD WriteTestArchive() {
+    ArchiveWriter writer;
+    AddFile(&writer, "meta/sandbox", "{}");
+    AddFile(&writer, "bin/app", std::string(5000, 'x'));
+    AddFile(&writer, "data/empty", "");
+    return WriteArchive(&writer);
+  }
+
+  files::ScopedTempDir temp_dir_;
+};
+
+TEST_F(ArchiveReaderTest, Read) {
+  ArchiveReader reader(WriteTestArchive());
+  ASSERT_TRUE(reader.Read());
+  EXPECT_EQ(3u, reader.file_count());
+
+  std::vector<std::string> paths;
+  reader.ListPaths(
+      [&paths](ftl::StringView path) { paths.push_back(path.ToString()); });
+  ASSERT_EQ(3u, paths.size());
+  EXPECT_EQ("bin/app", paths[0]);
+  EXPECT_EQ("data/empty", paths[1]);
+  EXPECT_EQ("meta/sandbox", paths[2]);
+
+  DirectoryTableEntry entry;
+  ASSERT_TRUE(reader.GetDirectoryEntry("bin/app", &entry));
+  EXPECT_EQ(5000u, entry.data_length);
+  EXPECT_EQ(0u, entry.data_offset % 4096);
+  EXPECT_FALSE(reader.GetDirectoryEntry("bin/ap", &entry));
+  EXPECT_FALSE(reader.GetDirectoryEntry("zzz", &entry));
+
+  ftl::StringView contents;
+  EXPECT_FALSE(reader.GetFileView("meta/sandbox", &contents));
+}
+
+TEST_F(ArchiveReaderTest, MapAndRead) {
+  ArchiveReader reader(WriteTestArchive());
+  ASSERT_TRUE(reader.MapAndRead());
+  EXPECT_EQ(3u, reader.file_count());
+
+  DirectoryTableEntry entry;
+  ASSERT_TRUE(reader.GetDirectoryEntry("meta/sandbox", &entry));
+  EXPECT_EQ("meta/sandbox", reader.GetPathView(entry));
+
+  ftl::StringView contents;
+  ASSERT_TRUE(reader.GetFileView("meta/sandbox", &contents));
+  EXPECT_EQ("{}", contents);
+  ASSERT_TRUE(reader.GetFileView("bin/app", &contents));
+  EXPECT_EQ(std::string(5000, 'x'), contents.ToString());
+  ASSERT_TRUE(reader.GetFileView("data/empty", &contents));
+  EXPECT_TRUE(contents.empty());
+  EXPECT_FALSE(reader.GetFileView("missing", &contents));
+}
+
+TEST_F(ArchiveReaderTest, ConcurrentExtract) {
+  constexpr size_t kFileCount = 16;
+  ArchiveWriter writer;
+  for (size_t i = 0; i < kFileCount; ++i) {
+    AddFile(&writer, "file" + std::to_string(i),
+            std::string(10000 + i, 'a' + i));
+  }
+  ArchiveReader reader(WriteArchive(&writer));
+  ASSERT_TRUE(reader.Read());
+
+  std::vector<std::string> outputs(kFileCount);
+  for (auto& output : outputs)
+    ASSERT_TRUE(temp_dir_.NewTempFile(&output));
+
+  std::vector<int> results(kFileCount);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kFileCount; ++i) {
+    threads.emplace_back([&reader, &outputs, &results, i] {
+      results[i] = reader.ExtractFile("file" + std::to_string(i),
+                                      outputs[i].c_str());
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  for (size_t i = 0; i < kFileCount; ++i) {
+    EXPECT_TRUE(results[i]);
+    std::string contents;
+    ASSERT_TRUE(files::ReadFileToString(outputs[i], &contents));
+    EXPECT_EQ(std::string(10000 + i, 'a' + i), contents);
+  }
+}
+
+TEST_F(ArchiveReaderTest, ParallelWrite) {
+  std::string archives[2];
+  size_t jobs[2] = {1, 4};
+  for (size_t i = 0; i < 2; ++i) {
+    ArchiveWriter writer;
+    writer.set_jobs(jobs[i]);
+    for (size_t j = 0; j < 20; ++j)
+      AddFile(&writer, "file" + std::to_string(j), std::string(j * 1000, 'z'));
+    ftl::UniqueFD fd = WriteArchive(&writer);
+    archives[i] = ReadContents(fd.get());
+  }
+  EXPECT_EQ(archives[0], archives[1]);
+}
+
+TEST_F(ArchiveReaderTest, DeduplicatedWrite) {
+  ArchiveWriter writer;
+  writer.set_deduplicate(true);
+  AddFile(&writer, "a/LICENSE", std::string(5000, 'l'));
+  AddFile(&writer, "b/LICENSE", std::string(5000, 'l'));
+  AddFile(&writer, "c/LICENSE", std::string(5000, 'm'));
+  ftl::UniqueFD fd = WriteArchive(&writer);
+  std::string contents = ReadContents(fd.get());
+  ArchiveReader reader(std::move(fd));
+  ASSERT_TRUE(reader.MapAndRead());
+
+  DirectoryTableEntry a, b, c;
+  ASSERT_TRUE(reader.GetDirectoryEntry("a/LICENSE", &a));
+  ASSERT_TRUE(reader.GetDirectoryEntry("b/LICENSE", &b));
+  ASSERT_TRUE(reader.GetDirectoryEntry("c/LICENSE", &c));
+  EXPECT_EQ(a.data_offset, b.data_offset);
+  EXPECT_NE(a.data_offset, c.data_offset);
+  EXPECT_EQ(AlignToPage(c.data_offset + c.data_length), contents.size());
+
+  ftl::StringView view;
+  ASSERT_TRUE(reader.GetFileView("b/LICENSE", &view));
+  EXPECT_EQ(std::string(5000, 'l'), view.ToString());
+  EXPECT_TRUE(reader.VerifyAll(0));
+}
+
+TEST_F(ArchiveReaderTest, DirectoryIndex) {
+  constexpr size_t kFileCount = 200;
+  ArchiveWriter writer;
+  for (size_t i = 0; i < kFileCount; ++i)
+    AddFile(&writer, "dir" + std::to_string(i % 7) + "/" + std::to_string(i),
+            std::to_string(i));
+  ArchiveReader reader(WriteArchive(&writer));
+  ASSERT_TRUE(reader.MapAndRead());
+
+  for (size_t i = 0; i < kFileCount; ++i) {
+    std::string path = "dir" + std::to_string(i % 7) + "/" + std::to_string(i);
+    ftl::StringView contents;
+    ASSERT_TRUE(reader.GetFileView(path, &contents)) << path;
+    EXPECT_EQ(std::to_string(i), contents);
+    DirectoryTableEntry entry;
+    EXPECT_FALSE(reader.GetDirectoryEntry(path + "x", &entry));
+  }
+}
+
+// Archives written before the directory index existed only have the
+// directory and directory names chunks.
+TEST_F(ArchiveReaderTest, WithoutDirectoryIndex) {
+  const std::string names = "aaabb";
+  std::vector<DirectoryTableEntry> directory(2);
+  uint64_t data_offset = 4096;
+  directory[0].name_length = 3;
+  directory[0].data_offset = data_offset;
+  directory[0].data_length = 1;
+  directory[1].name_offset = 3;
+  directory[1].name_length = 2;
+  directory[1].data_offset = data_offset + 8;
+  directory[1].data_length = 2;
+
+  IndexChunk index_chunk;
+  index_chunk.length = 2 * sizeof(IndexEntry);
+  IndexEntry dir_entry;
+  dir_entry.type = kDirType;
+  dir_entry.offset = sizeof(IndexChunk) + index_chunk.length;
+  dir_entry.length = directory.size() * sizeof(DirectoryTableEntry);
+  IndexEntry dirnames_entry;
+  dirnames_entry.type = kDirnamesType;
+  dirnames_entry.offset = dir_entry.offset + dir_entry.length;
+  dirnames_entry.length = 8;
+
+  std::string archive(data_offset + 16, '\0');
+  memcpy(&archive[0], &index_chunk, sizeof(index_chunk));
+  memcpy(&archive[sizeof(IndexChunk)], &dir_entry, sizeof(dir_entry));
+  memcpy(&archive[sizeof(IndexChunk) + sizeof(IndexEntry)], &dirnames_entry,
+         sizeof(dirnames_entry));
+  memcpy(&archive[dir_entry.offset], directory.data(), dir_entry.length);
+  memcpy(&archive[dirnames_entry.offset], names.data(), names.size());
+  archive[data_offset] = '1';
+  archive[data_offset + 8] = '2';
+  archive[data_offset + 9] = '2';
+
+  std::string path;
+  ASSERT_TRUE(temp_dir_.NewTempFile(&path));
+  ASSERT_TRUE(files::WriteFile(path, archive.data(), archive.size()));
+
+  ArchiveReader reader(ftl::UniqueFD(open(path.c_str(), O_RDONLY)));
+  ASSERT_TRUE(reader.MapAndRead());
+  ftl::StringView contents;
+  ASSERT_TRUE(reader.GetFileView("aaa", &contents));
+  EXPECT_EQ("1", contents);
+  ASSERT_TRUE(reader.GetFileView("bb", &contents));
+  EXPECT_EQ("22", contents);
+  EXPECT_FALSE(reader.GetFileView("a", &contents));
+  EXPECT_FALSE(reader.GetFileView("c", &contents));
+}
+
+TEST_F(ArchiveReaderTest, ContentHashes) {
+  ftl::UniqueFD fd = WriteTestArchive();
+  int raw_fd = fd.get();
+  ArchiveReader reader(std::move(fd));
+  ASSERT_TRUE(reader.Read());
+  ASSERT_TRUE(reader.has_content_hashes());
+
+  ContentHash expected;
+  HashBuffer("{}", 2, &expected);
+  ContentHash actual;
+  ASSERT_TRUE(reader.GetContentHash("meta/sandbox", &actual));
+  EXPECT_EQ(expected, actual);
+  EXPECT_FALSE(reader.GetContentHash("missing", &actual));
+
+  EXPECT_TRUE(reader.VerifyFile("bin/app"));
+  EXPECT_TRUE(reader.VerifyAll(0));
+  EXPECT_TRUE(reader.VerifyAll(1));
+
+  DirectoryTableEntry entry;
+  ASSERT_TRUE(reader.GetDirectoryEntry("meta/sandbox", &entry));
+  ASSERT_EQ(1, pwrite(raw_fd, "x", 1, entry.data_offset));
+  EXPECT_FALSE(reader.VerifyFile("meta/sandbox"));
+  EXPECT_TRUE(reader.VerifyFile("bin/app"));
+  EXPECT_FALSE(reader.VerifyAll(0));
+}
+
+TEST_F(ArchiveReaderTest, ExtractAll) {
+  ArchiveWriter writer;
+  AddFile(&writer, "a/b/c", "abc");
+  AddFile(&writer, "a/b0", "ab0");
+  AddFile(&writer, "a/d", "ad");
+  AddFile(&writer, "e", "e");
+  ArchiveReader reader(WriteArchive(&writer));
+  ASSERT_TRUE(reader.Read());
+
+  ExtractOptions options;
+  options.jobs = 2;
+  std::string output_dir = temp_dir_.path() + "/out";
+  ASSERT_TRUE(reader.ExtractAll(output_dir, options));
+  for (const char* path : {"a/b/c", "a/b0", "a/d", "e"}) {
+    std::string contents;
+    ASSERT_TRUE(files::ReadFileToString(output_dir + "/" + path, &contents));
+    std::string expected(path);
+    expected.erase(std::remove(expected.begin(), expected.end(), '/'),
+                   expected.end());
+    EXPECT_EQ(expected, contents);
+  }
+}
+
+TEST_F(ArchiveReaderTest, ExtractAllRejectsUnsafePaths) {
+  for (const char* path : {"../escape", "a/../../escape", "/abs", "a//b"}) {
+    ArchiveWriter writer;
+    AddFile(&writer, path, "x");
+    ArchiveReader reader(WriteArchive(&writer));
+    ASSERT_TRUE(reader.Read());
+    EXPECT_FALSE(reader.ExtractAll(temp_dir_.path() + "/out", ExtractOptions()))
+        << path;
+  }
+}
+
+TEST_F(ArchiveReaderTest, CompressedFiles) {
+  std::string text;
+  for (size_t i = 0; text.size() < 3 * kCompressionBlockSize; ++i)
+    text += "line " + std::to_string(i) + "\n";
+  std::string noise(10000, '\0');
+  uint32_t state = 1;
+  for (char& c : noise) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    c = static_cast<char>(state);
+  }
+
+  ArchiveWriter writer;
+  AddFile(&writer, "bin/app", std::string(5000, 'x'));
+  AddFile(&writer, "data/noise", noise, true);
+  AddFile(&writer, "data/text", text, true);
+  ArchiveReader reader(WriteArchive(&writer));
+  ASSERT_TRUE(reader.MapAndRead());
+  ASSERT_TRUE(reader.VerifyAll(1));
+
+  // Incompressible files and files not marked for compression are stored raw.
+  EXPECT_TRUE(reader.has_compressed_files());
+  EXPECT_TRUE(reader.IsCompressed("data/text"));
+  EXPECT_FALSE(reader.IsCompressed("data/noise"));
+  EXPECT_FALSE(reader.IsCompressed("bin/app"));
+  ftl::StringView view;
+  EXPECT_TRUE(reader.GetFileView("bin/app", &view));
+  EXPECT_FALSE(reader.GetFileView("data/text", &view));
+
+  DirectoryTableEntry entry;
+  ASSERT_TRUE(reader.GetDirectoryEntry("data/text", &entry));
+  EXPECT_LT(entry.data_length, text.size());
+  uint64_t length = 0;
+  ASSERT_TRUE(reader.GetFileLength("data/text", &length));
+  EXPECT_EQ(text.size(), length);
+
+  std::string output;
+  ASSERT_TRUE(temp_dir_.NewTempFile(&output));
+  ASSERT_TRUE(reader.ExtractFile("data/text", output.c_str()));
+  std::string contents;
+  ASSERT_TRUE(files::ReadFileToString(output, &contents));
+  EXPECT_EQ(text, contents);
+
+  // Read a range that spans a block boundary.
+  uint64_t offset = kCompressionBlockSize - 100;
+  std::string range(200, '\0');
+  ASSERT_TRUE(
+      reader.ReadFileRange("data/text", offset, range.size(), &range[0]));
+  EXPECT_EQ(text.substr(offset, range.size()), range);
+  EXPECT_FALSE(reader.ReadFileRange("data/text", text.size() - 10, 20,
+                                    &range[0]));
+}
+
+TEST_F(ArchiveReaderTest, IndexIsSortedByType) {
+  for (bool front_coded_names : {false, true}) {
+    ArchiveWriter writer;
+    writer.set_front_coded_names(front_coded_names);
+    AddFile(&writer, "bin/app", std::string(5000, 'x'));
+    AddFile(&writer, "data/text", std::string(5000, 't'), true);
+    std::string archive = ReadContents(WriteArchive(&writer).get());
+
+    IndexChunk index;
+    ASSERT_LE(sizeof(index), archive.size());
+    memcpy(&index, archive.data(), sizeof(index));
+    ASSERT_EQ(6 * sizeof(IndexEntry), index.length);
+    std::vector<IndexEntry> entries(6);
+    memcpy(entries.data(), &archive[sizeof(index)], index.length);
+    uint64_t next_offset = sizeof(index) + index.length;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (i > 0) {
+        EXPECT_LT(entries[i - 1].type, entries[i].type);
+      }
+      EXPECT_EQ(next_offset, entries[i].offset);
+      next_offset += entries[i].length;
+    }
+  }
+}
+
+TEST_F(ArchiveReaderTest, UpdateFromBaseArchive) {
+  ArchiveReader base(WriteTestArchive());
+  ASSERT_TRUE(base.Read());
+
+  ArchiveWriter writer;
+  writer.set_base_archive(&base);
+  AddFile(&writer, "meta/sandbox", "{\"dev\": []}");
+  AddFile(&writer, "bin/app", std::string(5000, 'x'));
+  AddFile(&writer, "data/empty", "");
+  AddFile(&writer, "data/new", "new");
+  ArchiveReader reader(WriteArchive(&writer));
+  EXPECT_EQ(2u, writer.reused_count());
+
+  ASSERT_TRUE(reader.MapAndRead());
+  ASSERT_TRUE(reader.VerifyAll(1));
+  ftl::StringView contents;
+  ASSERT_TRUE(reader.GetFileView("bin/app", &contents));
+  EXPECT_EQ(std::string(5000, 'x'), contents.ToString());
+  ASSERT_TRUE(reader.GetFileView("meta/sandbox", &contents));
+  EXPECT_EQ("{\"dev\": []}", contents);
+  ASSERT_TRUE(reader.GetFileView("data/new", &contents));
+  EXPECT_EQ("new", contents);
+}
+
+TEST_F(ArchiveReaderTest, SequentialWrite) {
+  ArchiveWriter writer;
+  AddFile(&writer, "meta/sandbox", "{}");
+  AddFile(&writer, "bin/app", std::string(5000, 'x'));
+  AddFile(&writer, "data/empty", "");
+  AddFile(&writer, "data/text", std::string(100000, 't'), true);
+  std::string expected = ReadContents(WriteArchive(&writer).get());
+
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  ftl::UniqueFD read_end(fds[0]);
+  ftl::UniqueFD write_end(fds[1]);
+  std::string streamed;
+  std::thread reader([&read_end, &streamed] {
+    char buffer[4096];
+    ssize_t actual;
+    while ((actual = read(read_end.get(), buffer, sizeof(buffer))) > 0)
+      streamed.append(buffer, actual);
+  });
+  EXPECT_TRUE(writer.Write(write_end.get()));
+  write_end.reset();
+  reader.join();
+  EXPECT_EQ(expected, streamed);
+}
+
+TEST_F(ArchiveReaderTest, EntrySources) {
+  ArchiveWriter source_writer;
+  AddFile(&source_writer, "bin/app", std::string(5000, 'x'));
+  AddFile(&source_writer, "data/text", std::string(100000, 't'), true);
+  ArchiveReader source(WriteArchive(&source_writer));
+  ASSERT_TRUE(source.Read());
+
+  std::string src_path;
+  ASSERT_TRUE(temp_dir_.NewTempFile(&src_path));
+  ASSERT_TRUE(files::WriteFile(src_path, "0123456789", 10));
+  ftl::UniqueFD src_fd(open(src_path.c_str(), O_RDONLY));
+
+  ArchiveWriter writer;
+  ASSERT_TRUE(writer.Add(ArchiveEntry::FromBuffer("{}", "meta/sandbox")));
+  ASSERT_TRUE(writer.Add(
+      ArchiveEntry::FromFileDescriptor(src_fd.get(), 2, 5, "data/range")));
+  ASSERT_TRUE(writer.Add(ArchiveEntry::FromArchive(&source, "bin/app", "app")));
+  ASSERT_TRUE(
+      writer.Add(ArchiveEntry::FromArchive(&source, "data/text", "text")));
+  ArchiveReader reader(WriteArchive(&writer));
+  ASSERT_TRUE(reader.MapAndRead());
+  ASSERT_TRUE(reader.VerifyAll(1));
+
+  ftl::StringView contents;
+  ASSERT_TRUE(reader.GetFileView("meta/sandbox", &contents));
+  EXPECT_EQ("{}", contents);
+  ASSERT_TRUE(reader.GetFileView("data/range", &contents));
+  EXPECT_EQ("23456", contents);
+  ASSERT_TRUE(reader.GetFileView("app", &contents));
+  EXPECT_EQ(std::string(5000, 'x'), contents.ToString());
+  ASSERT_TRUE(reader.GetFileView("text", &contents));
+  EXPECT_EQ(std::string(100000, 't'), contents.ToString());
+}
+
+TEST_F(ArchiveReaderTest, LayoutOrder) {
+  ArchiveWriter writer;
+  AddFile(&writer, "meta/sandbox", "{}");
+  AddFile(&writer, "bin/app", std::string(5000, 'x'));
+  AddFile(&writer, "data/empty", "");
+  writer.set_layout_order({"meta/sandbox", "missing", "data/empty"});
+  ArchiveReader reader(WriteArchive(&writer));
+  ASSERT_TRUE(reader.MapAndRead());
+
+  std::vector<std::string> paths;
+  reader.ListPaths(
+      [&paths](ftl::StringView path) { paths.push_back(path.ToString()); });
+  EXPECT_EQ((std::vector<std::string>{"bin/app", "data/empty",
+                                      "meta/sandbox"}),
+            paths);
+
+  DirectoryTableEntry sandbox, empty, app;
+  ASSERT_TRUE(reader.GetDirectoryEntry("meta/sandbox", &sandbox));
+  ASSERT_TRUE(reader.GetDirectoryEntry("data/empty", &empty));
+  ASSERT_TRUE(reader.GetDirectoryEntry("bin/app", &app));
+  EXPECT_LT(sandbox.data_offset, empty.data_offset);
+  EXPECT_LE(empty.data_offset, app.data_offset);
+
+  ftl::StringView contents;
+  ASSERT_TRUE(reader.GetFileView("bin/app", &contents));
+  EXPECT_EQ(std::string(5000, 'x'), contents.ToString());
+}
+
+TEST_F(ArchiveReaderTest, PackedAlignment) {
+  ArchiveWriter writer;
+  ASSERT_FALSE(writer.set_default_alignment(12));
+  ASSERT_TRUE(writer.set_default_alignment(8));
+  AddFile(&writer, "a", "aaa");
+  AddFile(&writer, "b", "bbbbb");
+  ArchiveEntry mapped = ArchiveEntry::FromBuffer("mapped", "c");
+  mapped.alignment = kPageSize;
+  ASSERT_TRUE(writer.Add(std::move(mapped)));
+  ArchiveReader reader(WriteArchive(&writer));
+  ASSERT_TRUE(reader.MapAndRead());
+
+  DirectoryTableEntry a, b, c;
+  ASSERT_TRUE(reader.GetDirectoryEntry("a", &a));
+  ASSERT_TRUE(reader.GetDirectoryEntry("b", &b));
+  ASSERT_TRUE(reader.GetDirectoryEntry("c", &c));
+  EXPECT_EQ(0u, a.data_offset % 8);
+  EXPECT_EQ(a.data_offset + 8, b.data_offset);
+  EXPECT_EQ(0u, c.data_offset % kPageSize);
+
+  ftl::StringView contents;
+  ASSERT_TRUE(reader.GetFileView("b", &contents));
+  EXPECT_EQ("bbbbb", contents);
+  ASSERT_TRUE(reader.GetFileView("c", &contents));
+  EXPECT_EQ("mapped", contents);
+}
+
+TEST_F(ArchiveReaderTest, ListPrefixAndChildren) {
+  ArchiveWriter writer;
+  for (const char* path : {"assets/a", "assets/fonts/b", "assets/fonts/c",
+                           "assets/fonts2", "assets/z/d", "bin/app"})
+    ASSERT_TRUE(writer.Add(ArchiveEntry::FromBuffer("x", path)));
+  ArchiveReader reader(WriteArchive(&writer));
+  ASSERT_TRUE(reader.Read());
+
+  std::vector<std::string> paths;
+  reader.ListPrefix("assets/fonts", [&](const DirectoryTableEntry& entry) {
+    paths.push_back(reader.GetPathView(entry).ToString());
+  });
+  EXPECT_EQ((std::vector<std::string>{"assets/fonts/b", "assets/fonts/c",
+                                      "assets/fonts2"}),
+            paths);
+
+  std::vector<std::string> children;
+  auto add_child = [&](ftl::StringView name, bool is_directory) {
+    children.push_back(name.ToString() + (is_directory ? "/" : ""));
+  };
+  reader.ListChildren("assets", add_child);
+  EXPECT_EQ((std::vector<std::string>{"a", "fonts/", "fonts2", "z/"}),
+            children);
+
+  children.clear();
+  reader.ListChildren("", add_child);
+  EXPECT_EQ((std::vector<std::string>{"assets/", "bin/"}), children);
+
+  children.clear();
+  reader.ListChildren("missing/", add_child);
+  EXPECT_TRUE(children.empty());
+}
+
+TEST_F(ArchiveReaderTest, GetDirectoryEntries) {
+  ArchiveWriter writer;
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(writer.Add(
+        ArchiveEntry::FromBuffer(std::to_string(i), "f" + std::to_string(i))));
+  }
+  std::string archive = ReadContents(WriteArchive(&writer).get());
+  std::string unindexed = archive;
+  ASSERT_TRUE(RemoveDirectoryIndex(&unindexed));
+
+  std::vector<ftl::StringView> queries = {"f42", "missing", "f0",  "f99",
+                                          "f42", "f",       "f7a", "f7"};
+  for (const std::string* contents : {&archive, &unindexed}) {
+    std::string path;
+    ASSERT_TRUE(temp_dir_.NewTempFile(&path));
+    ASSERT_TRUE(files::WriteFile(path, contents->data(), contents->size()));
+    ArchiveReader reader(ftl::UniqueFD(open(path.c_str(), O_RDONLY)));
+    ASSERT_TRUE(reader.Read());
+
+    std::vector<const DirectoryTableEntry*> entries;
+    EXPECT_EQ(5u, reader.GetDirectoryEntries(queries, &entries));
+    ASSERT_EQ(queries.size(), entries.size());
+    for (size_t i = 0; i < queries.size(); ++i) {
+      DirectoryTableEntry expected;
+      bool found = reader.GetDirectoryEntry(queries[i], &expected);
+      ASSERT_EQ(found, entries[i] != nullptr) << queries[i].ToString();
+      if (found) {
+        EXPECT_EQ(queries[i], reader.GetPathView(*entries[i]));
+      }
+    }
+  }
+}
+
+TEST_F(ArchiveReaderTest, PrefixIndexLookups) {
+  // Enough files for the reader to build its prefix index, with many paths
+  // sharing their first eight bytes.
+  std::vector<std::string> paths;
+  for (int i = 0; i < 1000; ++i) {
+    paths.push_back((i % 3 ? "assets/fonts/" : "b/") + std::to_string(i));
+    if (i % 10 == 0)
+      paths.push_back(std::to_string(i));
+  }
+  ArchiveWriter writer;
+  for (const auto& path : paths)
+    ASSERT_TRUE(writer.Add(ArchiveEntry::FromBuffer("x", path)));
+  std::string archive = ReadContents(WriteArchive(&writer).get());
+  ASSERT_TRUE(RemoveDirectoryIndex(&archive));
+  std::string path;
+  ASSERT_TRUE(temp_dir_.NewTempFile(&path));
+  ASSERT_TRUE(files::WriteFile(path, archive.data(), archive.size()));
+  ArchiveReader reader(ftl::UniqueFD(open(path.c_str(), O_RDONLY)));
+  ASSERT_TRUE(reader.MapAndRead());
+
+  DirectoryTableEntry entry;
+  for (const auto& path : paths) {
+    ASSERT_TRUE(reader.GetDirectoryEntry(path, &entry)) << path;
+    EXPECT_EQ(path, reader.GetPathView(entry));
+    EXPECT_FALSE(reader.GetDirectoryEntry(path + "0x", &entry)) << path;
+  }
+  EXPECT_FALSE(reader.GetDirectoryEntry("", &entry));
+  EXPECT_FALSE(reader.GetDirectoryEntry("zzzzzzzzzz", &entry));
+
+  size_t count = 0;
+  reader.ListPrefix("assets/fonts/", [&count](const DirectoryTableEntry&) {
+    ++count;
+  });
+  EXPECT_EQ(666u, count);
+}
+
+TEST_F(ArchiveReaderTest, BuildsPrefixIndexLazily) {
+  ArchiveWriter writer;
+  for (int i = 0; i < 1000; ++i)
+    ASSERT_TRUE(writer.Add(ArchiveEntry::FromBuffer("x", std::to_string(i))));
+  ArchiveReader reader(WriteArchive(&writer));
+  ASSERT_TRUE(reader.Read());
+
+  // Exact lookups use the directory index.
+  uint64_t usage = reader.GetMemoryUsage();
+  DirectoryTableEntry entry;
+  EXPECT_TRUE(reader.GetDirectoryEntry("500", &entry));
+  EXPECT_EQ(usage, reader.GetMemoryUsage());
+
+  size_t count = 0;
+  reader.ListPrefix("50", [&count](const DirectoryTableEntry&) { ++count; });
+  EXPECT_EQ(11u, count);
+  EXPECT_LT(usage, reader.GetMemoryUsage());
+}
+
+TEST_F(ArchiveReaderTest, PathFilter) {
+  std::vector<uint64_t> words(GetFilterBlockCount(1000) * kFilterBlockWords);
+  uint64_t block_count = words.size() / kFilterBlockWords;
+  for (int i = 0; i < 1000; ++i)
+    AddToFilter(HashPath("lib/" + std::to_string(i)), words.data(),
+                block_count);
+  int false_positives = 0;
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(FilterMayContain(HashPath("lib/" + std::to_string(i)),
+                                 words.data(), block_count));
+    if (FilterMayContain(HashPath("lib/" + std::to_string(i) + ".so"),
+                         words.data(), block_count))
+      ++false_positives;
+  }
+  EXPECT_LT(false_positives, 20);
+
+  std::vector<std::string> paths;
+  for (int i = 0; i < 300; ++i)
+    paths.push_back("locale/" + std::to_string(i) + "/strings");
+  ArchiveWriter writer;
+  for (const auto& path : paths)
+    ASSERT_TRUE(writer.Add(ArchiveEntry::FromBuffer("x", path)));
+  std::string archive = ReadContents(WriteArchive(&writer).get());
+
+  // Archives with the filter chunk, without the directory index, and without
+  // either, in which case the reader builds the filter itself.
+  std::vector<std::string> archives(3, archive);
+  ASSERT_TRUE(RemoveDirectoryIndex(&archives[1]));
+  ASSERT_TRUE(RemoveDirectoryIndex(&archives[2]));
+  ASSERT_TRUE(RenameChunk(&archives[2], kDirFilterType,
+                          0x5959595959524944));  // DIRYYYYY
+  for (const auto& contents : archives) {
+    std::string archive_path;
+    ASSERT_TRUE(temp_dir_.NewTempFile(&archive_path));
+    ASSERT_TRUE(
+        files::WriteFile(archive_path, contents.data(), contents.size()));
+    for (bool map : {false, true}) {
+      ArchiveReader reader(
+          ftl::UniqueFD(open(archive_path.c_str(), O_RDONLY)));
+      ASSERT_TRUE(map ? reader.MapAndRead() : reader.Read());
+      DirectoryTableEntry entry;
+      for (const auto& path : paths) {
+        ASSERT_TRUE(reader.GetDirectoryEntry(path, &entry)) << path;
+        EXPECT_FALSE(reader.GetDirectoryEntry(path + ".fallback", &entry));
+      }
+      std::vector<ftl::StringView> queries = {"locale/7/strings", "missing",
+                                              "locale/299/strings"};
+      std::vector<const DirectoryTableEntry*> entries;
+      EXPECT_EQ(2u, reader.GetDirectoryEntries(queries, &entries));
+      EXPECT_EQ(nullptr, entries[1]);
+    }
+  }
+}
+
+TEST_F(ArchiveReaderTest, FrontCodedNames) {
+  std::vector<std::string> paths;
+  for (int i = 0; i < 500; ++i) {
+    paths.push_back("data/assets/images/icons/hires/" + std::to_string(i) +
+                    ".png");
+  }
+  paths.push_back("bin/app");
+  paths.push_back("meta/sandbox");
+  std::sort(paths.begin(), paths.end());
+
+  std::string plain;
+  std::string archive;
+  for (bool front_coded : {false, true}) {
+    ArchiveWriter writer;
+    writer.set_front_coded_names(front_coded);
+    for (const auto& path : paths)
+      ASSERT_TRUE(writer.Add(ArchiveEntry::FromBuffer(path, path)));
+    (front_coded ? archive : plain) = ReadContents(WriteArchive(&writer).get());
+  }
+  EXPECT_EQ(0u, GetChunkLength(archive, kDirnamesType));
+  EXPECT_LT(GetChunkLength(archive, kDirFrontCodedNamesType) * 3,
+            GetChunkLength(plain, kDirnamesType));
+
+  // Look paths up both through the directory index and by searching the
+  // front-coded names.
+  std::vector<std::string> archives(2, archive);
+  ASSERT_TRUE(RemoveDirectoryIndex(&archives[1]));
+  for (const auto& contents : archives) {
+    std::string archive_path;
+    ASSERT_TRUE(temp_dir_.NewTempFile(&archive_path));
+    ASSERT_TRUE(
+        files::WriteFile(archive_path, contents.data(), contents.size()));
+    for (bool map : {false, true}) {
+      ArchiveReader reader(
+          ftl::UniqueFD(open(archive_path.c_str(), O_RDONLY)));
+      ASSERT_TRUE(map ? reader.MapAndRead() : reader.Read());
+
+      std::vector<std::string> listed;
+      reader.ListPaths([&listed](ftl::StringView path) {
+        listed.push_back(path.ToString());
+      });
+      EXPECT_EQ(paths, listed);
+
+      DirectoryTableEntry entry;
+      for (const auto& path : paths) {
+        ASSERT_TRUE(reader.GetDirectoryEntry(path, &entry)) << path;
+        EXPECT_EQ(path, reader.GetPathView(entry));
+        EXPECT_FALSE(reader.GetDirectoryEntry(path + "~", &entry));
+      }
+      EXPECT_FALSE(reader.GetDirectoryEntry("", &entry));
+      EXPECT_FALSE(reader.GetDirectoryEntry("zzz", &entry));
+
+      std::string output_path;
+      std::string extracted;
+      ASSERT_TRUE(temp_dir_.NewTempFile(&output_path));
+      ASSERT_TRUE(reader.ExtractFile("meta/sandbox", output_path.c_str()));
+      ASSERT_TRUE(files::ReadFileToString(output_path, &extracted));
+      EXPECT_EQ("meta/sandbox", extracted);
+
+      size_t count = 0;
+      reader.ListPrefix("data/assets/images/icons/hires/4",
+                        [&count](const DirectoryTableEntry&) { ++count; });
+      EXPECT_EQ(111u, count);
+
+      std::vector<std::string> children;
+      reader.ListChildren("", [&children](ftl::StringView name, bool) {
+        children.push_back(name.ToString());
+      });
+      EXPECT_EQ((std::vector<std::string>{"bin", "data", "meta"}), children);
+      EXPECT_TRUE(reader.VerifyAll(1));
+    }
+  }
+}
+
+TEST_F(ArchiveReaderTest, NestedArchives) {
+  std::string inner = ReadContents(WriteTestArchive().get());
+
+  // Pack the inner archive so that it does not start on a page boundary.
+  ArchiveWriter writer;
+  ASSERT_TRUE(writer.set_default_alignment(kMinDataAlignment));
+  AddFile(&writer, "a", "padding");
+  AddFile(&writer, "inner.far", inner);
+  AddFile(&writer, "z", "padding");
+  std::string outer = ReadContents(WriteArchive(&writer).get());
+  std::string outer_path;
+  ASSERT_TRUE(temp_dir_.NewTempFile(&outer_path));
+  ASSERT_TRUE(files::WriteFile(outer_path, outer.data(), outer.size()));
+
+  auto check_inner = [this](ArchiveReader* reader) {
+    EXPECT_EQ(3u, reader->file_count());
+    uint64_t length = 0;
+    ASSERT_TRUE(reader->GetFileLength("bin/app", &length));
+    std::string contents(length, '\0');
+    ASSERT_TRUE(reader->ReadFileRange("bin/app", 0, length, &contents[0]));
+    EXPECT_EQ(std::string(5000, 'x'), contents);
+    std::string output_path;
+    ASSERT_TRUE(temp_dir_.NewTempFile(&output_path));
+    ASSERT_TRUE(reader->ExtractFile("meta/sandbox", output_path.c_str()));
+    ASSERT_TRUE(files::ReadFileToString(output_path, &contents));
+    EXPECT_EQ("{}", contents);
+    EXPECT_TRUE(reader->VerifyAll(1));
+  };
+
+  // From a range of the file of the outer archive.
+  ArchiveReader reader(ftl::UniqueFD(open(outer_path.c_str(), O_RDONLY)));
+  ASSERT_TRUE(reader.Read());
+  EXPECT_EQ(nullptr, reader.OpenArchive("missing"));
+  for (bool map : {false, true}) {
+    std::unique_ptr<ArchiveReader> nested = reader.OpenArchive("inner.far");
+    ASSERT_NE(nullptr, nested);
+    ASSERT_TRUE(map ? nested->MapAndRead() : nested->Read());
+    check_inner(nested.get());
+  }
+
+  // From the memory of the outer archive.
+  ArchiveReader mapped(ftl::UniqueFD(open(outer_path.c_str(), O_RDONLY)));
+  ASSERT_TRUE(mapped.MapAndRead());
+  mapped.TakeFileDescriptor();
+  std::unique_ptr<ArchiveReader> nested = mapped.OpenArchive("inner.far");
+  ASSERT_NE(nullptr, nested);
+  ASSERT_TRUE(nested->Read());
+  check_inner(nested.get());
+
+  // From a buffer.
+  ArchiveReader buffer_reader(inner.data(), inner.size());
+  ASSERT_TRUE(buffer_reader.Read());
+  check_inner(&buffer_reader);
+}
+
+TEST_F(ArchiveReaderTest, RejectsInvalidNameRanges) {
+  std::string archive = ReadContents(WriteTestArchive().get());
+  size_t type_offset = archive.find(
+      std::string(reinterpret_cast<const char*>(&kDirType), 8));
+  ASSERT_NE(std::string::npos, type_offset);
+  IndexEntry dir_entry;
+  memcpy(&dir_entry, &archive[type_offset], sizeof(dir_entry));
+  uint64_t dirnames_length = GetChunkLength(archive, kDirnamesType);
+  ASSERT_LT(0u, dirnames_length);
+
+  // Names starting past the end of the chunk, and names running past it.
+  const uint32_t name_offsets[] = {0xffffff00, 1};
+  const uint16_t name_lengths[] = {1, static_cast<uint16_t>(dirnames_length)};
+  for (size_t i = 0; i < 2; ++i) {
+    std::string invalid = archive;
+    DirectoryTableEntry entry;
+    memcpy(&entry, &invalid[dir_entry.offset], sizeof(entry));
+    entry.name_offset = name_offsets[i];
+    entry.name_length = name_lengths[i];
+    memcpy(&invalid[dir_entry.offset], &entry, sizeof(entry));
+
+    std::string path;
+    ASSERT_TRUE(temp_dir_.NewTempFile(&path));
+    ASSERT_TRUE(files::WriteFile(path, invalid.data(), invalid.size()));
+    ArchiveReader reader(ftl::UniqueFD(open(path.c_str(), O_RDONLY)));
+    EXPECT_FALSE(reader.Read());
+    ArchiveReader mapped_reader(ftl::UniqueFD(open(path.c_str(), O_RDONLY)));
+    EXPECT_FALSE(mapped_reader.MapAndRead());
+  }
+}
+
+TEST_F(ArchiveReaderTest, InvalidArchive) {
+  std::string path;
+  ASSERT_TRUE(temp_dir_.NewTempFile(&path));
+  std::string garbage(100, 'g');
+  ASSERT_TRUE(files::WriteFile(path, garbage.data(), garbage.size()));
+
+  ArchiveReader reader(ftl::UniqueFD(open(path.c_str(), O_RDONLY)));
+  EXPECT_FALSE(reader.Read());
+  ArchiveReader mapped_reader(ftl::UniqueFD(open(path.c_str(), O_RDONLY)));
+  EXPECT_FALSE(mapped_reader.MapAndRead());
+}
+
+}  // namespace
+}  // namespace archive
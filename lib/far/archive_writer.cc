@@ -4,6 +4,7 @@
 
 #include "application/lib/far/archive_writer.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -14,28 +15,295 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
 #include <limits>
+#include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "application/lib/far/alignment.h"
+#include "application/lib/far/archive_reader.h"
+#include "application/lib/far/compression.h"
+#include "application/lib/far/content_hash.h"
 #include "application/lib/far/file_operations.h"
 #include "application/lib/far/format.h"
+#include "application/lib/far/front_coded_names.h"
+#include "application/lib/far/parallel.h"
+#include "application/lib/far/path_filter.h"
+#include "application/lib/far/path_hash.h"
+#include "lib/ftl/files/file.h"
 #include "lib/ftl/files/file_descriptor.h"
 #include "lib/ftl/files/unique_fd.h"
 
 namespace archive {
+namespace {
 
-ArchiveWriter::ArchiveWriter() = default;
+// Keeps the load factor of the directory index at or below one half.
+constexpr uint64_t GetIndexSlotCount(uint64_t file_count) {
+  uint64_t slot_count = 1;
+  while (slot_count < 2 * file_count)
+    slot_count <<= 1;
+  return slot_count;
+}
+
+// The most files an archive can hold. Beyond it, the slot count of the
+// directory index would no longer fit in its chunk.
+constexpr uint64_t kMaxFileCount = 1ull << 30;
+static_assert(GetIndexSlotCount(kMaxFileCount) <=
+                  std::numeric_limits<
+                      decltype(DirectoryIndexChunk::slot_count)>::max(),
+              "The directory index slot count must fit in its chunk.");
+static_assert(GetIndexSlotCount(kMaxFileCount + 1) >
+                  std::numeric_limits<
+                      decltype(DirectoryIndexChunk::slot_count)>::max(),
+              "kMaxFileCount should be as large as the index allows.");
+
+std::vector<DirectoryIndexSlot> BuildDirectoryIndex(
+    const std::vector<ArchiveEntry>& entries,
+    uint64_t slot_count) {
+  std::vector<DirectoryIndexSlot> slots(slot_count);
+  uint64_t mask = slot_count - 1;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    uint64_t hash = HashPath(entries[i].dst_path);
+    uint64_t slot = hash & mask;
+    while (slots[slot].entry != 0)
+      slot = (slot + 1) & mask;
+    slots[slot].hash_tag = static_cast<uint32_t>(hash >> 32);
+    slots[slot].entry = static_cast<uint32_t>(i + 1);
+  }
+  return slots;
+}
+
+std::vector<uint64_t> BuildPathFilter(const std::vector<ArchiveEntry>& entries,
+                                      uint64_t block_count) {
+  std::vector<uint64_t> words(block_count * kFilterBlockWords);
+  for (const auto& entry : entries)
+    AddToFilter(HashPath(entry.dst_path), words.data(), block_count);
+  return words;
+}
+
+// The number of names in each block of a front-coded names chunk. Larger
+// blocks compress better but take longer to search.
+constexpr uint32_t kFrontCodedRestartInterval = 16;
+
+using Source = ArchiveEntry::Source;
+
+// Returns the name used for |entry| in error messages.
+const std::string& GetEntryName(const ArchiveEntry& entry) {
+  return entry.source == Source::kPath ? entry.src_path : entry.dst_path;
+}
+
+// Whether |entry| comes from a file stored uncompressed in another archive,
+// which can be copied from that archive as stored.
+bool IsStoredEntry(const ArchiveEntry& entry) {
+  return entry.source == Source::kArchive &&
+         !entry.src_archive->IsCompressed(entry.src_path);
+}
+
+// Reads the length of the contents of |entry| and whether it is an executable
+// file.
+bool StatEntry(const ArchiveEntry& entry, uint64_t* length, bool* executable) {
+  *executable = false;
+  switch (entry.source) {
+    case Source::kPath: {
+      struct stat info;
+      if (stat(entry.src_path.c_str(), &info) != 0)
+        return false;
+      *length = info.st_size;
+      *executable = (info.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0;
+      return true;
+    }
+    case Source::kBuffer:
+      *length = entry.data.size();
+      return true;
+    case Source::kFileDescriptor:
+      *length = entry.src_length;
+      return true;
+    case Source::kArchive:
+      return entry.src_archive->GetFileLength(entry.src_path, length);
+  }
+  return false;
+}
+
+// Reads the |length| bytes of contents of |entry| into |contents|.
+bool ReadEntry(const ArchiveEntry& entry,
+               uint64_t length,
+               std::string* contents) {
+  switch (entry.source) {
+    case Source::kPath:
+      return files::ReadFileToString(entry.src_path, contents) &&
+             contents->size() == length;
+    case Source::kBuffer:
+      *contents = entry.data;
+      return true;
+    case Source::kFileDescriptor:
+      contents->resize(length);
+      return ReadFileAt(entry.src_fd, entry.src_offset, &(*contents)[0],
+                        length);
+    case Source::kArchive:
+      contents->resize(length);
+      return entry.src_archive->ReadFileRange(entry.src_path, 0, length,
+                                              &(*contents)[0]);
+  }
+  return false;
+}
+
+bool HashEntry(const ArchiveEntry& entry,
+               uint64_t length,
+               ContentHash* hash) {
+  bool hashed = false;
+  switch (entry.source) {
+    case Source::kPath: {
+      ftl::UniqueFD fd(open(entry.src_path.c_str(), O_RDONLY));
+      hashed = fd.is_valid() && HashFileRange(fd.get(), 0, length, hash);
+      break;
+    }
+    case Source::kBuffer:
+      HashBuffer(entry.data.data(), length, hash);
+      hashed = true;
+      break;
+    case Source::kFileDescriptor:
+      hashed = HashFileRange(entry.src_fd, entry.src_offset, length, hash);
+      break;
+    case Source::kArchive: {
+      // The stored hash of an uncompressed file is the hash of its contents.
+      if (IsStoredEntry(entry) &&
+          entry.src_archive->GetContentHash(entry.src_path, hash)) {
+        hashed = true;
+        break;
+      }
+      std::string contents;
+      hashed = ReadEntry(entry, length, &contents);
+      if (hashed)
+        HashBuffer(contents.data(), length, hash);
+      break;
+    }
+  }
+  if (!hashed) {
+    fprintf(stderr, "error: Failed to hash file: %s\n",
+            GetEntryName(entry).c_str());
+    return false;
+  }
+  return true;
+}
+
+// Compresses the contents of |entry| into |compressed|, and the offsets of
+// its blocks into |block_offsets|. Leaves both empty if compression would not
+// make the file smaller. Compression is deterministic, so compressing the same
+// entry again produces the same bytes.
+bool CompressEntry(const ArchiveEntry& entry,
+                   uint64_t length,
+                   std::string* compressed,
+                   std::vector<uint64_t>* block_offsets) {
+  if (length == 0)
+    return true;
+  std::string contents;
+  const std::string* data = &entry.data;
+  if (entry.source != Source::kBuffer) {
+    if (!ReadEntry(entry, length, &contents)) {
+      fprintf(stderr, "error: Failed to read file: %s\n",
+              GetEntryName(entry).c_str());
+      return false;
+    }
+    data = &contents;
+  }
+  if (!CompressBlocks(data->data(), length, kCompressionBlockSize,
+                      compressed, block_offsets)) {
+    fprintf(stderr, "error: Failed to compress file: %s\n",
+            GetEntryName(entry).c_str());
+    return false;
+  }
+  if (compressed->size() >= length) {
+    compressed->clear();
+    block_offsets->clear();
+  }
+  return true;
+}
+
+// Copies the |length| bytes of contents of |entry| to |offset| in |fd|, or to
+// the file position of |fd| if |sequential| is true.
+bool WriteEntry(const ArchiveEntry& entry,
+                uint64_t length,
+                int fd,
+                bool sequential,
+                uint64_t offset) {
+  switch (entry.source) {
+    case Source::kPath:
+      return sequential
+                 ? CopyPathToFile(entry.src_path.c_str(), fd, length)
+                 : CopyPathToFileAt(entry.src_path.c_str(), fd, offset,
+                                    length);
+    case Source::kBuffer:
+      return sequential
+                 ? ftl::WriteFileDescriptor(fd, entry.data.data(), length)
+                 : WriteFileAt(fd, offset, entry.data.data(), length);
+    case Source::kFileDescriptor:
+      return sequential ? CopyFileRangeToFile(entry.src_fd, entry.src_offset,
+                                              fd, length)
+                        : CopyFileRangeToFileAt(entry.src_fd,
+                                                entry.src_offset, fd, offset,
+                                                length);
+    case Source::kArchive: {
+      if (sequential)
+        return entry.src_archive->CopyFile(entry.src_path, fd);
+      if (IsStoredEntry(entry))
+        return entry.src_archive->CopyStoredData(entry.src_path, fd, offset);
+      std::string contents;
+      return ReadEntry(entry, length, &contents) &&
+             WriteFileAt(fd, offset, contents.data(), length);
+    }
+  }
+  return false;
+}
+
+// Writes |length| zero bytes at the file position of |fd|.
+bool WritePadding(int fd, uint64_t length) {
+  static const char kZeros[4096] = {};
+  while (length > 0) {
+    uint64_t count = std::min<uint64_t>(length, sizeof(kZeros));
+    if (!ftl::WriteFileDescriptor(fd, kZeros, count)) {
+      fprintf(stderr, "error: Failed to write padding.\n");
+      return false;
+    }
+    length -= count;
+  }
+  return true;
+}
+
+// Measures the time between successive calls to |Lap|.
+class PhaseTimer {
+ public:
+  PhaseTimer() : start_(std::chrono::steady_clock::now()) {}
+
+  double Lap() {
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - start_;
+    start_ = now;
+    return elapsed.count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace
+
+ArchiveWriter::ArchiveWriter() : default_alignment_(kPageSize) {}
 
 ArchiveWriter::~ArchiveWriter() = default;
 
+bool ArchiveWriter::set_default_alignment(uint64_t alignment) {
+  if (!IsValidDataAlignment(alignment))
+    return false;
+  default_alignment_ = alignment;
+  return true;
+}
+
 bool ArchiveWriter::Add(ArchiveEntry entry) {
   size_t size = entry.dst_path.size();
   if (size > std::numeric_limits<uint16_t>::max())
     return false;
-  if (size > std::numeric_limits<uint32_t>::max() - total_path_length_)
-    return false;
   // TODO(abarth): Add more entry.dst_path validation.
   dirty_ = true;
   entries_.push_back(std::move(entry));
@@ -52,120 +320,437 @@ bool ArchiveWriter::Write(int fd) {
   if (HasDuplicateEntries())
     return false;
 
+  // Pipes and sockets cannot seek, in which case the archive is written
+  // strictly sequentially.
+  bool sequential = false;
   if (lseek(fd, 0, SEEK_SET) < 0) {
-    fprintf(stderr, "error: Failed to seek to beginning of archive.\n");
+    if (errno != ESPIPE) {
+      fprintf(stderr, "error: Failed to seek to beginning of archive.\n");
+      return false;
+    }
+    sequential = true;
+  }
+
+  if (entries_.size() > kMaxFileCount) {
+    fprintf(stderr, "error: Archive has too many files.\n");
+    return false;
+  }
+  if (!front_coded_names_ &&
+      total_path_length_ > std::numeric_limits<uint32_t>::max()) {
+    fprintf(stderr, "error: Paths too long for directory names chunk.\n");
     return false;
   }
 
-  uint64_t index_count = entries_.empty() ? 0 : 2;
-  uint64_t next_chunk = 0;
+  stats_ = WriteStats();
+  stats_.file_count = entries_.size();
+  PhaseTimer timer;
 
-  IndexChunk index;
-  index.length = index_count * sizeof(IndexEntry);
-  next_chunk += sizeof(IndexChunk) + index.length;
-  if (!WriteObject(fd, index)) {
-    fprintf(stderr, "error: Failed to write index chunk.\n");
+  // On large manifests stat dominates the time spent before any data is
+  // copied, so the lengths of the files are read in parallel.
+  std::vector<uint64_t> data_lengths(entries_.size());
+  std::vector<uint64_t> alignments(entries_.size());
+  bool measured = ParallelFor(entries_.size(), jobs_, [&](size_t i) {
+    const ArchiveEntry& entry = entries_[i];
+    bool executable = false;
+    if (!StatEntry(entry, &data_lengths[i], &executable)) {
+      fprintf(stderr, "error: Failed to read length of file: %s\n",
+              GetEntryName(entry).c_str());
+      return false;
+    }
+    if (entry.alignment) {
+      alignments[i] = entry.alignment;
+    } else {
+      alignments[i] = executable
+                          ? std::max(default_alignment_, kPageSize)
+                          : default_alignment_;
+    }
+    if (!IsValidDataAlignment(alignments[i])) {
+      fprintf(stderr, "error: Invalid alignment %llu for file: %s\n",
+              static_cast<unsigned long long>(alignments[i]),
+              entry.dst_path.c_str());
+      return false;
+    }
+    return true;
+  });
+  if (!measured)
+    return false;
+  stats_.stat_seconds = timer.Lap();
+
+  // Compressed files are stored, hashed and deduplicated by their compressed
+  // data. Only the length, hash and block offsets of the compressed data are
+  // kept, and files are compressed again as they are written, so that the
+  // writer holds at most one compressed file per job.
+  std::vector<ContentHash> hashes(entries_.size());
+  std::vector<std::vector<uint64_t>> block_offsets(entries_.size());
+  std::vector<uint64_t> uncompressed_lengths = data_lengths;
+  bool compressed = ParallelFor(entries_.size(), jobs_, [&](size_t i) {
+    if (!entries_[i].compress)
+      return true;
+    std::string data;
+    if (!CompressEntry(entries_[i], data_lengths[i], &data,
+                       &block_offsets[i]))
+      return false;
+    if (!data.empty()) {
+      data_lengths[i] = data.size();
+      HashBuffer(data.data(), data.size(), &hashes[i]);
+    }
+    return true;
+  });
+  if (!compressed)
+    return false;
+  stats_.compress_seconds = timer.Lap();
+
+  bool hashed = ParallelFor(entries_.size(), jobs_, [&](size_t i) {
+    if (!block_offsets[i].empty())
+      return true;  // Hashed when compressed.
+    return HashEntry(entries_[i], data_lengths[i], &hashes[i]);
+  });
+  if (!hashed)
     return false;
+  stats_.hash_seconds = timer.Lap();
+
+  std::vector<int> reused(entries_.size());
+  reused_count_ = 0;
+  if (base_ && !sequential && base_->has_content_hashes()) {
+    for (size_t i = 0; i < entries_.size(); ++i) {
+      ftl::StringView path = entries_[i].dst_path;
+      DirectoryTableEntry base_entry;
+      ContentHash base_hash;
+      if (!base_->GetDirectoryEntry(path, &base_entry) ||
+          base_entry.data_length != data_lengths[i] ||
+          base_->IsCompressed(path) == block_offsets[i].empty() ||
+          !base_->GetContentHash(path, &base_hash) || base_hash != hashes[i])
+        continue;
+      reused[i] = true;
+      ++reused_count_;
+    }
   }
 
-  if (entries_.empty())
+  CompressionChunk compression;
+  std::vector<CompressedEntry> compressed_entries;
+  std::vector<uint64_t> all_block_offsets;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    if (block_offsets[i].empty())
+      continue;
+    CompressedEntry compressed_entry;
+    compressed_entry.entry = static_cast<uint32_t>(i);
+    compressed_entry.block_count = block_offsets[i].size() - 1;
+    compressed_entry.uncompressed_length = uncompressed_lengths[i];
+    compressed_entry.first_block_offset = all_block_offsets.size();
+    compressed_entries.push_back(compressed_entry);
+    all_block_offsets.insert(all_block_offsets.end(),
+                             block_offsets[i].begin(),
+                             block_offsets[i].end());
+  }
+  compression.block_size = kCompressionBlockSize;
+  compression.entry_count = compressed_entries.size();
+
+  if (entries_.empty()) {
+    if (!WriteObject(fd, IndexChunk())) {
+      fprintf(stderr, "error: Failed to write index chunk.\n");
+      return false;
+    }
     return true;  // No files to store in the archive.
+  }
 
-  IndexEntry dir_entry;
-  dir_entry.type = kDirType;
-  dir_entry.offset = next_chunk;
-  dir_entry.length = entries_.size() * sizeof(DirectoryTableEntry);
-  next_chunk += dir_entry.length;
-  if (!WriteObject(fd, dir_entry)) {
-    fprintf(stderr, "error: Failed to write directory index chunk.\n");
-    return false;
+  FrontCodedNamesChunk names_chunk;
+  std::vector<uint64_t> restart_offsets;
+  std::string names_data;
+  if (front_coded_names_) {
+    std::vector<ftl::StringView> names;
+    names.reserve(entries_.size());
+    for (const auto& entry : entries_)
+      names.push_back(entry.dst_path);
+    EncodeFrontCodedNames(names, kFrontCodedRestartInterval, &restart_offsets,
+                          &names_data);
+    names_chunk.restart_interval = kFrontCodedRestartInterval;
+    names_chunk.name_count = entries_.size();
+    names_chunk.data_length = names_data.size();
+    names_data.resize(AlignTo8ByteBoundary(names_data.size()));
+  }
+
+  DirectoryIndexChunk dirindex;
+  dirindex.slot_count = GetIndexSlotCount(entries_.size());
+
+  PathFilterChunk filter;
+  filter.probe_count = kFilterProbeCount;
+  filter.block_count = GetFilterBlockCount(entries_.size());
+
+  // Readers expect the index to be sorted by type, and the chunks to follow
+  // it in the same order.
+  std::vector<IndexEntry> chunks;
+  auto add_chunk = [&chunks](uint64_t type, uint64_t length) {
+    IndexEntry chunk;
+    chunk.type = type;
+    chunk.length = length;
+    chunks.push_back(chunk);
+  };
+  add_chunk(kDirType, entries_.size() * sizeof(DirectoryTableEntry));
+  if (front_coded_names_) {
+    add_chunk(kDirFrontCodedNamesType,
+              sizeof(FrontCodedNamesChunk) +
+                  restart_offsets.size() * sizeof(uint64_t) +
+                  names_data.size());
+  } else {
+    add_chunk(kDirnamesType, AlignTo8ByteBoundary(total_path_length_));
+  }
+  add_chunk(kDirIndexType,
+            sizeof(DirectoryIndexChunk) +
+                dirindex.slot_count * sizeof(DirectoryIndexSlot));
+  add_chunk(kDirHashType,
+            sizeof(DirectoryHashChunk) + entries_.size() * sizeof(ContentHash));
+  add_chunk(kDirFilterType,
+            sizeof(PathFilterChunk) +
+                filter.block_count * kFilterBlockWords * sizeof(uint64_t));
+  if (!compressed_entries.empty()) {
+    add_chunk(kDirCompressionType,
+              sizeof(CompressionChunk) +
+                  compressed_entries.size() * sizeof(CompressedEntry) +
+                  all_block_offsets.size() * sizeof(uint64_t));
   }
+  std::sort(chunks.begin(), chunks.end(),
+            [](const IndexEntry& lhs, const IndexEntry& rhs) {
+              return lhs.type < rhs.type;
+            });
 
-  IndexEntry dirnames_entry;
-  dirnames_entry.type = kDirnamesType;
-  dirnames_entry.offset = next_chunk;
-  dirnames_entry.length = AlignTo8ByteBoundary(total_path_length_);
-  next_chunk += dirnames_entry.length;
-  if (!WriteObject(fd, dirnames_entry)) {
-    fprintf(stderr, "error: Failed to write directory names index chunk\n");
+  IndexChunk index;
+  index.length = chunks.size() * sizeof(IndexEntry);
+  uint64_t next_chunk = sizeof(IndexChunk) + index.length;
+  for (auto& chunk : chunks) {
+    chunk.offset = next_chunk;
+    next_chunk += chunk.length;
+  }
+  if (!WriteObject(fd, index) || !WriteVector(fd, chunks)) {
+    fprintf(stderr, "error: Failed to write index chunk.\n");
     return false;
   }
 
   uint32_t name_offset = 0;
-  uint64_t data_offset = AlignToPage(next_chunk);
   std::vector<DirectoryTableEntry> directory_table(entries_.size());
   for (size_t i = 0; i < entries_.size(); ++i) {
-    const ArchiveEntry& entry = entries_[i];
     DirectoryTableEntry& directory_entry = directory_table[i];
+    // Entries are identified by their index in front-coded archives.
+    directory_entry.name_offset =
+        front_coded_names_ ? static_cast<uint32_t>(i) : name_offset;
+    directory_entry.name_length = entries_[i].dst_path.size();
+    directory_entry.data_length = data_lengths[i];
+    name_offset += directory_entry.name_length;
+  }
 
-    struct stat info;
-    if (stat(entry.src_path.c_str(), &info) != 0) {
-      fprintf(stderr, "error: Failed to read length of file: %s\n",
-              entry.src_path.c_str());
-      return false;
+  // File data is laid out in |data_order|, which differs from directory
+  // order when a layout order is set.
+  std::vector<size_t> data_order = GetDataOrder();
+  uint64_t data_end = next_chunk;
+  std::vector<int> owns_data(entries_.size());
+  std::map<std::pair<ContentHash, uint64_t>, uint64_t> shared_data_offsets;
+  for (size_t i : data_order) {
+    DirectoryTableEntry& directory_entry = directory_table[i];
+    uint64_t data_length = data_lengths[i];
+    uint64_t alignment = alignments[i];
+
+    // Entries only share data that satisfies their own alignment.
+    auto key = std::make_pair(hashes[i], data_length);
+    if (deduplicate_) {
+      auto it = shared_data_offsets.find(key);
+      if (it != shared_data_offsets.end() && it->second % alignment == 0) {
+        directory_entry.data_offset = it->second;
+        continue;
+      }
     }
-    uint64_t data_length = info.st_size;
 
-    if (data_length > std::numeric_limits<uint64_t>::max() - data_offset) {
+    uint64_t data_offset = AlignTo(data_end, alignment);
+    // The end of the archive is aligned to a page, so the data must end at
+    // least a page before the end of the address space.
+    constexpr uint64_t kMaxDataEnd =
+        std::numeric_limits<uint64_t>::max() - kPageSize;
+    if (data_offset < data_end || data_offset > kMaxDataEnd ||
+        data_length > kMaxDataEnd - data_offset) {
       fprintf(stderr, "error: File overflowed total archive size: %s\n",
-              entry.src_path.c_str());
+              GetEntryName(entries_[i]).c_str());
       return false;
     }
 
-    directory_entry.name_offset = name_offset;
-    directory_entry.name_length = entry.dst_path.size();
+    if (deduplicate_)
+      shared_data_offsets[key] = data_offset;
     directory_entry.data_offset = data_offset;
-    directory_entry.data_length = data_length;
-
-    name_offset += directory_entry.name_length;
-    data_offset = AlignToPage(data_offset + data_length);
+    owns_data[i] = true;
+    data_end = data_offset + data_length;
   }
+  // The archive itself always ends on a page boundary.
+  uint64_t data_offset = AlignToPage(data_end);
 
-  if (!WriteVector(fd, directory_table)) {
-    fprintf(stderr, "error: Failed to write directory table.\n");
+  // Writes the body of |chunk|.
+  auto write_chunk = [&](const IndexEntry& chunk) {
+    switch (chunk.type) {
+      case kDirType:
+        if (!WriteVector(fd, directory_table)) {
+          fprintf(stderr, "error: Failed to write directory table.\n");
+          return false;
+        }
+        return true;
+      case kDirFrontCodedNamesType:
+        if (!WriteObject(fd, names_chunk) ||
+            !WriteVector(fd, restart_offsets) ||
+            !ftl::WriteFileDescriptor(fd, names_data.data(),
+                                      names_data.size())) {
+          fprintf(stderr, "error: Failed to write front-coded names.\n");
+          return false;
+        }
+        return true;
+      case kDirnamesType: {
+        std::vector<char> path_data(chunk.length);
+        char* pos = path_data.data();
+        for (const auto& entry : entries_) {
+          memcpy(pos, entry.dst_path.data(), entry.dst_path.size());
+          pos += entry.dst_path.size();
+        }
+        if (!WriteVector(fd, path_data)) {
+          fprintf(stderr, "error: Failed to write path data.\n");
+          return false;
+        }
+        return true;
+      }
+      case kDirIndexType:
+        if (!WriteObject(fd, dirindex) ||
+            !WriteVector(fd,
+                         BuildDirectoryIndex(entries_, dirindex.slot_count))) {
+          fprintf(stderr, "error: Failed to write directory index.\n");
+          return false;
+        }
+        return true;
+      case kDirHashType:
+        if (!WriteObject(fd, DirectoryHashChunk()) ||
+            !WriteVector(fd, hashes)) {
+          fprintf(stderr, "error: Failed to write directory hashes.\n");
+          return false;
+        }
+        return true;
+      case kDirFilterType:
+        if (!WriteObject(fd, filter) ||
+            !WriteVector(fd, BuildPathFilter(entries_, filter.block_count))) {
+          fprintf(stderr, "error: Failed to write path filter.\n");
+          return false;
+        }
+        return true;
+      case kDirCompressionType:
+        if (!WriteObject(fd, compression) ||
+            !WriteVector(fd, compressed_entries) ||
+            !WriteVector(fd, all_block_offsets)) {
+          fprintf(stderr, "error: Failed to write compression chunk.\n");
+          return false;
+        }
+        return true;
+    }
     return false;
+  };
+  for (const auto& chunk : chunks) {
+    if (!write_chunk(chunk))
+      return false;
   }
 
-  std::vector<char> path_data(total_path_length_);
-  char* pos = path_data.data();
-  for (const auto& entry : entries_) {
-    memcpy(pos, entry.dst_path.data(), entry.dst_path.size());
-    pos += entry.dst_path.size();
-  }
+  stats_.layout_seconds = timer.Lap();
 
-  if (!WriteVector(fd, path_data)) {
-    fprintf(stderr, "error: Failed to write path data.\n");
-    return false;
-  }
-
-  for (size_t i = 0; i < entries_.size(); ++i) {
+  // Writes the data of the |i|th entry at its offset, or at the file position
+  // of |fd| when writing sequentially.
+  auto write_data = [&](size_t i) {
     const ArchiveEntry& entry = entries_[i];
     const DirectoryTableEntry& directory_entry = directory_table[i];
-
-    if (lseek(fd, directory_entry.data_offset, SEEK_SET) < 0) {
-      fprintf(stderr, "error: Failed to seek to data offset.\n");
-      return false;
+    if (reused[i]) {
+      if (!base_->CopyStoredData(entry.dst_path, fd,
+                                 directory_entry.data_offset)) {
+        fprintf(stderr, "error: Failed to copy file data from base archive: "
+                "%s\n", entry.dst_path.c_str());
+        return false;
+      }
+      return true;
+    }
+    bool written = false;
+    if (!block_offsets[i].empty()) {
+      std::string data;
+      std::vector<uint64_t> offsets;
+      if (!CompressEntry(entry, uncompressed_lengths[i], &data, &offsets))
+        return false;
+      if (offsets != block_offsets[i]) {
+        fprintf(stderr, "error: File changed while writing archive: %s\n",
+                GetEntryName(entry).c_str());
+        return false;
+      }
+      written = sequential
+                    ? ftl::WriteFileDescriptor(fd, data.data(), data.size())
+                    : WriteFileAt(fd, directory_entry.data_offset,
+                                  data.data(), data.size());
+    } else {
+      written = WriteEntry(entry, directory_entry.data_length, fd, sequential,
+                           directory_entry.data_offset);
     }
-    if (!CopyPathToFile(entry.src_path.c_str(), fd,
-                        directory_entry.data_length)) {
+    if (!written) {
       fprintf(stderr, "error: Failed to write file data: %s\n",
-              entry.src_path.c_str());
+              GetEntryName(entry).c_str());
       return false;
     }
-  }
+    return true;
+  };
+
+  if (sequential) {
+    // Writing the entries that own their data in data order with explicit
+    // padding produces the same bytes as the parallel path below.
+    uint64_t position = next_chunk;
+    for (size_t i : data_order) {
+      if (!owns_data[i])
+        continue;
+      const DirectoryTableEntry& directory_entry = directory_table[i];
+      if (!WritePadding(fd, directory_entry.data_offset - position) ||
+          !write_data(i))
+        return false;
+      position = directory_entry.data_offset + directory_entry.data_length;
+    }
+    if (!WritePadding(fd, data_offset - position))
+      return false;
+  } else {
+    bool copied = ParallelFor(entries_.size(), jobs_, [&](size_t i) {
+      if (!owns_data[i])
+        return true;  // Shares the data of an identical entry.
+      return write_data(i);
+    });
+    if (!copied)
+      return false;
 
-  if (!entries_.empty()) {
-    const DirectoryTableEntry& directory_entry = directory_table.back();
-    uint64_t end = directory_entry.data_offset + directory_entry.data_length;
-    if (ftruncate(fd, AlignToPage(end)) < 0) {
+    if (ftruncate(fd, data_offset) < 0) {
       fprintf(stderr, "error: Failed to truncate archive to proper length.\n");
       return false;
     }
   }
+  stats_.copy_seconds = timer.Lap();
+  stats_.archive_length = data_offset;
 
   return true;
 }
 
+std::vector<size_t> ArchiveWriter::GetDataOrder() const {
+  std::vector<size_t> order;
+  order.reserve(entries_.size());
+  std::vector<int> placed(entries_.size());
+  for (const auto& path : layout_order_) {
+    auto it = std::lower_bound(
+        entries_.begin(), entries_.end(), path,
+        [](const ArchiveEntry& lhs, const std::string& rhs) {
+          return lhs.dst_path < rhs;
+        });
+    if (it == entries_.end() || it->dst_path != path)
+      continue;  // Profiles may name files that are no longer packaged.
+    size_t i = it - entries_.begin();
+    if (placed[i])
+      continue;
+    placed[i] = true;
+    order.push_back(i);
+  }
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    if (!placed[i])
+      order.push_back(i);
+  }
+  return order;
+}
+
 bool ArchiveWriter::HasDuplicateEntries() {
   for (size_t i = 0; i + 1 < entries_.size(); ++i) {
     if (entries_[i].dst_path == entries_[i + 1].dst_path) {
@@ -5,13 +5,28 @@
 #ifndef APPLICATION_LIB_FAR_ARCHIVE_WRITER_H_
 #define APPLICATION_LIB_FAR_ARCHIVE_WRITER_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "application/lib/far/archive_entry.h"
 
 namespace archive {
+class ArchiveReader;
+
+// The time spent in each phase of |ArchiveWriter::Write|, in seconds.
+struct WriteStats {
+  double stat_seconds = 0;
+  double compress_seconds = 0;
+  double hash_seconds = 0;
+  double layout_seconds = 0;
+  double copy_seconds = 0;
+  uint64_t file_count = 0;
+  uint64_t archive_length = 0;
+};
 
 class ArchiveWriter {
  public:
@@ -19,13 +34,84 @@ class ArchiveWriter {
   ~ArchiveWriter();
   ArchiveWriter(const ArchiveWriter& other) = delete;
 
+  // Sets the number of threads used to hash and copy file data. Zero means
+  // one thread per core. Defaults to one.
+  void set_jobs(size_t jobs) { jobs_ = jobs; }
+
+  // When enabled, entries whose contents are identical share a single copy
+  // of their data in the archive. Disabled by default.
+  void set_deduplicate(bool deduplicate) { deduplicate_ = deduplicate; }
+
+  // Sets an existing archive from which unchanged files are carried over.
+  //
+  // Every source file is still read to compute its content hash, but a file
+  // whose stored data has the same length and content hash as the file with
+  // the same path in |base| is copied from |base| rather than from its
+  // source, which lets the kernel share or copy the data without it passing
+  // through this process. |base| must outlive any call to |Write| and must not
+  // be the archive being written.
+  void set_base_archive(const ArchiveReader* base) { base_ = base; }
+
+  // The number of files carried over from the base archive by the last call
+  // to |Write|.
+  uint64_t reused_count() const { return reused_count_; }
+
+  // Sets the alignment of the data of entries that do not specify their own.
+  // Executable files are always at least page aligned so that they can be
+  // mapped. Defaults to the page size; a small alignment such as 8 bytes
+  // packs small files tightly.
+  bool set_default_alignment(uint64_t alignment);
+
+  // When enabled, paths are stored front coded, which shrinks the names of
+  // archives with deep directory trees severalfold and lifts the 4 GiB limit
+  // on their total length. Readers that predate the front-coded names chunk
+  // cannot read such archives. Disabled by default.
+  void set_front_coded_names(bool front_coded_names) {
+    front_coded_names_ = front_coded_names;
+  }
+
+  // Sets the order in which file data is laid out in the archive, for example
+  // the order in which an application reads its files at startup. Files not
+  // listed follow in directory order, and unknown paths are ignored. The
+  // directory table is always sorted by path.
+  void set_layout_order(std::vector<std::string> paths) {
+    layout_order_ = std::move(paths);
+  }
+
+  // The phase timings of the last call to |Write|.
+  const WriteStats& stats() const { return stats_; }
+
+  // Reserves space for |count| entries ahead of a series of calls to |Add|.
+  void Reserve(size_t count) { entries_.reserve(count); }
+
   bool Add(ArchiveEntry entry);
+
+  // Writes the archive to |fd|.
+  //
+  // The layout of the archive, including the offset of every file, is
+  // computed before any file data is copied. If |fd| is seekable, every file
+  // is copied to its own offset independently, using up to |jobs| threads.
+  // Otherwise, for example when |fd| is a pipe or a socket, the archive is
+  // written strictly sequentially with explicit padding, which produces the
+  // same bytes. Files are not carried over from the base archive in that
+  // case.
   bool Write(int fd);
 
  private:
   bool HasDuplicateEntries();
 
+  // Returns the indices of |entries_| in the order their data is laid out.
+  std::vector<size_t> GetDataOrder() const;
+
   std::vector<ArchiveEntry> entries_;
+  size_t jobs_ = 1;
+  bool deduplicate_ = false;
+  uint64_t default_alignment_;
+  bool front_coded_names_ = false;
+  std::vector<std::string> layout_order_;
+  const ArchiveReader* base_ = nullptr;
+  uint64_t reused_count_ = 0;
+  WriteStats stats_;
   bool dirty_ = true;
   uint64_t total_path_length_ = 0;
 };
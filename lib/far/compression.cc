@@ -0,0 +1,73 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "application/lib/far/compression.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace archive {
+
+bool CompressBlocks(const char* data,
+                    uint64_t length,
+                    uint32_t block_size,
+                    std::string* compressed,
+                    std::vector<uint64_t>* block_offsets) {
+  uint64_t offset = 0;
+  do {
+    uLong block_length = std::min<uint64_t>(block_size, length - offset);
+    uLongf bound = compressBound(block_length);
+    size_t begin = compressed->size();
+    block_offsets->push_back(begin);
+    compressed->resize(begin + bound);
+    if (compress2(reinterpret_cast<Bytef*>(&(*compressed)[begin]), &bound,
+                  reinterpret_cast<const Bytef*>(data + offset), block_length,
+                  Z_BEST_COMPRESSION) != Z_OK)
+      return false;
+    compressed->resize(begin + bound);
+    offset += block_length;
+  } while (offset < length);
+  block_offsets->push_back(compressed->size());
+  return true;
+}
+
+bool DecompressBlock(const char* data, uint64_t length, std::string* output) {
+  uLongf actual = output->size();
+  if (uncompress(reinterpret_cast<Bytef*>(&(*output)[0]), &actual,
+                 reinterpret_cast<const Bytef*>(data), length) != Z_OK)
+    return false;
+  return actual == output->size();
+}
+
+BlockCache::BlockCache(size_t capacity) : capacity_(capacity) {}
+
+BlockCache::~BlockCache() = default;
+
+std::shared_ptr<const std::string> BlockCache::Get(uint64_t key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(key);
+  if (it == index_.end())
+    return nullptr;
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return it->second->second;
+}
+
+void BlockCache::Put(uint64_t key, std::shared_ptr<const std::string> block) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return;
+  }
+  entries_.emplace_front(key, std::move(block));
+  index_[key] = entries_.begin();
+  while (entries_.size() > capacity_) {
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+}
+
+}  // namespace archive
@@ -0,0 +1,61 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef APPLICATION_LIB_FAR_COMPRESSION_H_
+#define APPLICATION_LIB_FAR_COMPRESSION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace archive {
+
+// The uncompressed length of every block of a compressed file but the last.
+constexpr uint32_t kCompressionBlockSize = 64 * 1024;
+
+// Compresses |data| as a series of independently decodable blocks of
+// |block_size| uncompressed bytes each, appending the compressed blocks to
+// |compressed| and the offset of every block followed by the total compressed
+// length to |block_offsets|.
+bool CompressBlocks(const char* data,
+                    uint64_t length,
+                    uint32_t block_size,
+                    std::string* compressed,
+                    std::vector<uint64_t>* block_offsets);
+
+// Decompresses a single block into |output|, which must already have the
+// expected uncompressed length of the block.
+bool DecompressBlock(const char* data, uint64_t length, std::string* output);
+
+// A bounded, thread-safe, least recently used cache of decompressed blocks.
+class BlockCache {
+ public:
+  explicit BlockCache(size_t capacity);
+  ~BlockCache();
+  BlockCache(const BlockCache& other) = delete;
+  BlockCache& operator=(const BlockCache& other) = delete;
+
+  // Returns the block cached for |key|, or null if there is none.
+  std::shared_ptr<const std::string> Get(uint64_t key);
+
+  void Put(uint64_t key, std::shared_ptr<const std::string> block);
+
+ private:
+  using Entry = std::pair<uint64_t, std::shared_ptr<const std::string>>;
+
+  const size_t capacity_;
+  std::mutex mutex_;
+  std::list<Entry> entries_;  // Most recently used first.
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+};
+
+}  // namespace archive
+
+#endif  // APPLICATION_LIB_FAR_COMPRESSION_H_
@@ -0,0 +1,49 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "application/lib/far/content_hash.h"
+
+#include <errno.h>
+#include <openssl/sha.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace archive {
+
+static_assert(SHA256_DIGEST_LENGTH == kHashLength,
+              "Content hashes must be SHA-256 digests.");
+
+// BoringSSL selects the SHA extensions of the CPU at runtime when they are
+// available, which is what makes hashing large archives fast.
+void HashBuffer(const char* data, uint64_t length, ContentHash* hash) {
+  SHA256_CTX context;
+  SHA256_Init(&context);
+  SHA256_Update(&context, data, length);
+  SHA256_Final(hash->data(), &context);
+}
+
+bool HashFileRange(int fd,
+                   uint64_t offset,
+                   uint64_t length,
+                   ContentHash* hash) {
+  constexpr uint64_t kBufferSize = 64 * 1024;
+  char buffer[kBufferSize];
+  SHA256_CTX context;
+  SHA256_Init(&context);
+  while (length > 0) {
+    ssize_t actual = pread(fd, buffer, std::min(kBufferSize, length), offset);
+    if (actual < 0 && errno == EINTR)
+      continue;
+    if (actual <= 0)
+      return false;
+    SHA256_Update(&context, buffer, actual);
+    offset += actual;
+    length -= actual;
+  }
+  SHA256_Final(hash->data(), &context);
+  return true;
+}
+
+}  // namespace archive
@@ -0,0 +1,26 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef APPLICATION_LIB_FAR_CONTENT_HASH_H_
+#define APPLICATION_LIB_FAR_CONTENT_HASH_H_
+
+#include <stdint.h>
+
+#include <array>
+
+#include "application/lib/far/format.h"
+
+namespace archive {
+
+// A SHA-256 digest of the contents of a file, which is |kHashAlgorithm|.
+using ContentHash = std::array<uint8_t, kHashLength>;
+
+void HashBuffer(const char* data, uint64_t length, ContentHash* hash);
+
+// Hashes |length| bytes starting at |offset| in |fd| using positional reads.
+bool HashFileRange(int fd, uint64_t offset, uint64_t length, ContentHash* hash);
+
+}  // namespace archive
+
+#endif  // APPLICATION_LIB_FAR_CONTENT_HASH_H_
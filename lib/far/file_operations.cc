@@ -4,44 +4,258 @@
 
 #include "application/lib/far/file_operations.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
 
 #include "application/lib/far/alignment.h"
 #include "lib/ftl/files/unique_fd.h"
 
 namespace archive {
+namespace {
 
-bool CopyPathToFile(const char* src_path, int dst_fd, uint64_t length) {
-  ftl::UniqueFD src_fd(open(src_path, O_RDONLY));
-  if (!src_fd.is_valid()) {
-    FTL_LOG(INFO) << "Failed to open " << src_path;
-    return false;
-  }
-  return CopyFileToFile(src_fd.get(), dst_fd, length);
+// Passed in place of an offset to use and advance the file position of the
+// corresponding file descriptor instead.
+constexpr int64_t kFilePosition = -1;
+
+int64_t Advance(int64_t offset, uint64_t count) {
+  return offset == kFilePosition ? offset : offset + count;
 }
 
-bool CopyFileToPath(int src_fd, const char* dst_path, uint64_t length) {
-  ftl::UniqueFD dst_fd(open(dst_path, O_WRONLY | O_CREAT | O_TRUNC,
-                            S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
-  if (!dst_fd.is_valid())
-    return false;
-  return CopyFileToFile(src_fd, dst_fd.get(), length);
+#if defined(__linux__)
+
+// Shares the page aligned prefix of the range between the files when the
+// underlying file system supports reflinks, which copies no data at all.
+// Returns the number of bytes cloned.
+uint64_t CloneRange(int src_fd,
+                    int64_t src_offset,
+                    int dst_fd,
+                    int64_t dst_offset,
+                    uint64_t length) {
+#if defined(FICLONERANGE)
+  if (src_offset == kFilePosition || dst_offset == kFilePosition)
+    return 0;
+  if (AlignToPage(src_offset) != static_cast<uint64_t>(src_offset) ||
+      AlignToPage(dst_offset) != static_cast<uint64_t>(dst_offset))
+    return 0;
+  uint64_t aligned_length = length & ~4095ull;
+  if (aligned_length == 0)
+    return 0;
+  struct file_clone_range range;
+  range.src_fd = src_fd;
+  range.src_offset = src_offset;
+  range.src_length = aligned_length;
+  range.dest_offset = dst_offset;
+  if (ioctl(dst_fd, FICLONERANGE, &range) < 0)
+    return 0;
+  return aligned_length;
+#else
+  return 0;
+#endif
 }
 
-bool CopyFileToFile(int src_fd, int dst_fd, uint64_t length) {
+// Copies the range inside the kernel with copy_file_range, falling back to
+// sendfile, which can only write at the file position of |dst_fd|. Returns
+// the number of bytes copied, which is less than |length| if the kernel or
+// the file systems involved do not support these calls.
+uint64_t KernelCopyRange(int src_fd,
+                         int64_t src_offset,
+                         int dst_fd,
+                         int64_t dst_offset,
+                         uint64_t length) {
+  uint64_t copied = 0;
+#if defined(__NR_copy_file_range)
+  while (copied < length) {
+    loff_t src_pos = Advance(src_offset, copied);
+    loff_t dst_pos = Advance(dst_offset, copied);
+    ssize_t actual = syscall(
+        __NR_copy_file_range, src_fd,
+        src_offset == kFilePosition ? nullptr : &src_pos, dst_fd,
+        dst_offset == kFilePosition ? nullptr : &dst_pos,
+        static_cast<size_t>(std::min<uint64_t>(length - copied, 1u << 30)), 0);
+    if (actual < 0 && errno == EINTR)
+      continue;
+    if (actual <= 0)
+      break;
+    copied += actual;
+  }
+#endif
+  if (dst_offset != kFilePosition)
+    return copied;
+  while (copied < length) {
+    off_t src_pos = Advance(src_offset, copied);
+    ssize_t actual = sendfile(
+        dst_fd, src_fd, src_offset == kFilePosition ? nullptr : &src_pos,
+        static_cast<size_t>(std::min<uint64_t>(length - copied, 1u << 30)));
+    if (actual < 0 && errno == EINTR)
+      continue;
+    if (actual <= 0)
+      break;
+    copied += actual;
+  }
+  return copied;
+}
+
+#endif  // defined(__linux__)
+
+bool BufferedCopyRange(int src_fd,
+                       int64_t src_offset,
+                       int dst_fd,
+                       int64_t dst_offset,
+                       uint64_t length) {
   constexpr uint64_t kBufferSize = 64 * 1024;
   char buffer[kBufferSize];
   ssize_t actual = 0;
   for (uint64_t copied = 0; copied < length; copied += actual) {
     uint64_t requested =
         std::min(kBufferSize, static_cast<uint64_t>(length - copied));
-    actual = read(src_fd, buffer, requested);
+    if (src_offset == kFilePosition)
+      actual = read(src_fd, buffer, requested);
+    else
+      actual = pread(src_fd, buffer, requested, src_offset + copied);
+    if (actual < 0 && errno == EINTR) {
+      actual = 0;
+      continue;
+    }
     if (actual <= 0)
       return false;
-    if (!ftl::WriteFileDescriptor(dst_fd, buffer, actual))
+    bool written =
+        dst_offset == kFilePosition
+            ? ftl::WriteFileDescriptor(dst_fd, buffer, actual)
+            : WriteFileAt(dst_fd, dst_offset + copied, buffer, actual);
+    if (!written)
       return false;
   }
   return true;
 }
 
+// Copies |length| bytes between the files using the cheapest mechanism the
+// platform supports: reflinks, then in-kernel copies, then a userspace
+// buffer for whatever remains.
+bool CopyRange(int src_fd,
+               int64_t src_offset,
+               int dst_fd,
+               int64_t dst_offset,
+               uint64_t length) {
+  uint64_t copied = 0;
+#if defined(__linux__)
+  copied = CloneRange(src_fd, src_offset, dst_fd, dst_offset, length);
+  copied += KernelCopyRange(src_fd, Advance(src_offset, copied), dst_fd,
+                            Advance(dst_offset, copied), length - copied);
+#endif
+  return BufferedCopyRange(src_fd, Advance(src_offset, copied), dst_fd,
+                           Advance(dst_offset, copied), length - copied);
+}
+
+}  // namespace
+
+ftl::UniqueFD CreateOutputFile(const char* dst_path) {
+  return ftl::UniqueFD(open(dst_path, O_WRONLY | O_CREAT | O_TRUNC,
+                            S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+}
+
+bool ReadFileAt(int fd, uint64_t offset, void* buffer, uint64_t length) {
+  char* pos = static_cast<char*>(buffer);
+  while (length > 0) {
+    ssize_t actual = pread(fd, pos, length, offset);
+    if (actual < 0 && errno == EINTR)
+      continue;
+    if (actual <= 0)
+      return false;
+    pos += actual;
+    offset += actual;
+    length -= actual;
+  }
+  return true;
+}
+
+bool WriteFileAt(int fd, uint64_t offset, const void* buffer, uint64_t length) {
+  const char* pos = static_cast<const char*>(buffer);
+  while (length > 0) {
+    ssize_t actual = pwrite(fd, pos, length, offset);
+    if (actual < 0 && errno == EINTR)
+      continue;
+    if (actual <= 0)
+      return false;
+    pos += actual;
+    offset += actual;
+    length -= actual;
+  }
+  return true;
+}
+
+bool CopyPathToFile(const char* src_path, int dst_fd, uint64_t length) {
+  ftl::UniqueFD src_fd(open(src_path, O_RDONLY));
+  if (!src_fd.is_valid()) {
+    FTL_LOG(INFO) << "Failed to open " << src_path;
+    return false;
+  }
+  return CopyRange(src_fd.get(), 0, dst_fd, kFilePosition, length);
+}
+
+bool CopyPathToFileAt(const char* src_path,
+                      int dst_fd,
+                      uint64_t dst_offset,
+                      uint64_t length) {
+  ftl::UniqueFD src_fd(open(src_path, O_RDONLY));
+  if (!src_fd.is_valid()) {
+    FTL_LOG(INFO) << "Failed to open " << src_path;
+    return false;
+  }
+  return CopyRange(src_fd.get(), 0, dst_fd, dst_offset, length);
+}
+
+bool CopyFileToPath(int src_fd, const char* dst_path, uint64_t length) {
+  ftl::UniqueFD dst_fd = CreateOutputFile(dst_path);
+  if (!dst_fd.is_valid())
+    return false;
+  return CopyRange(src_fd, kFilePosition, dst_fd.get(), 0, length);
+}
+
+bool CopyFileRangeToPath(int src_fd,
+                         uint64_t src_offset,
+                         const char* dst_path,
+                         uint64_t length) {
+  ftl::UniqueFD dst_fd = CreateOutputFile(dst_path);
+  if (!dst_fd.is_valid())
+    return false;
+  return CopyRange(src_fd, src_offset, dst_fd.get(), 0, length);
+}
+
+bool CopyFileRangeToFile(int src_fd,
+                         uint64_t src_offset,
+                         int dst_fd,
+                         uint64_t length) {
+  return CopyRange(src_fd, src_offset, dst_fd, kFilePosition, length);
+}
+
+bool CopyFileRangeToFileAt(int src_fd,
+                           uint64_t src_offset,
+                           int dst_fd,
+                           uint64_t dst_offset,
+                           uint64_t length) {
+  return CopyRange(src_fd, src_offset, dst_fd, dst_offset, length);
+}
+
+bool CopyBufferToPath(const char* data, const char* dst_path, uint64_t length) {
+  ftl::UniqueFD dst_fd = CreateOutputFile(dst_path);
+  if (!dst_fd.is_valid())
+    return false;
+  return ftl::WriteFileDescriptor(dst_fd.get(), data, length);
+}
+
+bool CopyFileToFile(int src_fd, int dst_fd, uint64_t length) {
+  return CopyRange(src_fd, kFilePosition, dst_fd, kFilePosition, length);
+}
+
 }  // namespace archive
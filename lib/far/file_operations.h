@@ -8,6 +8,7 @@
 #include <vector>
 
 #include "lib/ftl/files/file_descriptor.h"
+#include "lib/ftl/files/unique_fd.h"
 
 namespace archive {
 
@@ -43,10 +44,53 @@ bool WriteVector(int fd, const std::vector<T>& vector) {
   return ftl::WriteFileDescriptor(fd, buffer, requested);
 }
 
+// Creates or truncates the file at |dst_path| for writing.
+ftl::UniqueFD CreateOutputFile(const char* dst_path);
+
+// Reads exactly |length| bytes starting at |offset| without using or
+// modifying the file position of |fd|.
+bool ReadFileAt(int fd, uint64_t offset, void* buffer, uint64_t length);
+
+// Writes all of |buffer| starting at |offset| without using or modifying the
+// file position of |fd|.
+bool WriteFileAt(int fd, uint64_t offset, const void* buffer, uint64_t length);
+
 bool CopyPathToFile(const char* src_path, int dst_fd, uint64_t length);
 bool CopyFileToPath(int src_fd, const char* dst_path, uint64_t length);
 bool CopyFileToFile(int src_fd, int dst_fd, uint64_t length);
 
+// Copies |length| bytes from the beginning of |src_path| to |dst_offset| in
+// |dst_fd| without using or modifying the file position of |dst_fd|, which
+// means several threads can copy into disjoint ranges of |dst_fd|
+// concurrently.
+bool CopyPathToFileAt(const char* src_path,
+                      int dst_fd,
+                      uint64_t dst_offset,
+                      uint64_t length);
+
+// Copies |length| bytes starting at |src_offset| in |src_fd| without using or
+// modifying the file position of |src_fd|, which means several threads can
+// copy from the same |src_fd| concurrently.
+bool CopyFileRangeToPath(int src_fd,
+                         uint64_t src_offset,
+                         const char* dst_path,
+                         uint64_t length);
+bool CopyFileRangeToFile(int src_fd,
+                         uint64_t src_offset,
+                         int dst_fd,
+                         uint64_t length);
+
+// Copies |length| bytes between the given offsets without using or modifying
+// the file position of either file descriptor. Page aligned ranges are
+// shared rather than copied when the file system supports it.
+bool CopyFileRangeToFileAt(int src_fd,
+                           uint64_t src_offset,
+                           int dst_fd,
+                           uint64_t dst_offset,
+                           uint64_t length);
+
+bool CopyBufferToPath(const char* data, const char* dst_path, uint64_t length);
+
 }  // namespace archive
 
 #endif  // APPLICATION_LIB_FAR_FILE_OPERATIONS_H_
@@ -0,0 +1,121 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "application/lib/far/file_operations.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "lib/ftl/files/file.h"
+#include "lib/ftl/files/file_descriptor.h"
+#include "lib/ftl/files/scoped_temp_dir.h"
+#include "lib/ftl/files/unique_fd.h"
+
+namespace archive {
+namespace {
+
+class FileOperationsTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    data_.resize(3 * 4096 + 123);
+    for (size_t i = 0; i < data_.size(); ++i)
+      data_[i] = static_cast<char>(i * 7 + i / 251);
+  }
+
+  ftl::UniqueFD NewFile(const std::string& contents) {
+    std::string path;
+    EXPECT_TRUE(temp_dir_.NewTempFile(&path));
+    EXPECT_TRUE(files::WriteFile(path, contents.data(), contents.size()));
+    return ftl::UniqueFD(open(path.c_str(), O_RDWR));
+  }
+
+  std::string ReadContents(int fd) {
+    std::string contents(lseek(fd, 0, SEEK_END), '\0');
+    EXPECT_TRUE(ReadFileAt(fd, 0, &contents[0], contents.size()));
+    return contents;
+  }
+
+  std::string data_;
+  files::ScopedTempDir temp_dir_;
+};
+
+TEST_F(FileOperationsTest, ReadAndWriteAt) {
+  ftl::UniqueFD fd = NewFile(data_);
+  std::string buffer(100, '\0');
+  ASSERT_TRUE(ReadFileAt(fd.get(), 4000, &buffer[0], buffer.size()));
+  EXPECT_EQ(data_.substr(4000, 100), buffer);
+  EXPECT_FALSE(ReadFileAt(fd.get(), data_.size() - 10, &buffer[0], 20));
+
+  ASSERT_TRUE(WriteFileAt(fd.get(), 10, "abc", 3));
+  EXPECT_EQ(0, lseek(fd.get(), 0, SEEK_CUR));
+  EXPECT_EQ("abc", ReadContents(fd.get()).substr(10, 3));
+}
+
+TEST_F(FileOperationsTest, CopyPageAlignedRange) {
+  ftl::UniqueFD src_fd = NewFile(data_);
+  ftl::UniqueFD dst_fd = NewFile(std::string(4096, 'y'));
+  ASSERT_TRUE(
+      CopyFileRangeToFileAt(src_fd.get(), 4096, dst_fd.get(), 4096, 8192));
+  EXPECT_EQ(std::string(4096, 'y') + data_.substr(4096, 8192),
+            ReadContents(dst_fd.get()));
+}
+
+TEST_F(FileOperationsTest, CopyUnalignedRange) {
+  ftl::UniqueFD src_fd = NewFile(data_);
+  ftl::UniqueFD dst_fd = NewFile(std::string(10, 'y'));
+  // Long enough that a page aligned prefix could be cloned if the offsets
+  // were aligned.
+  ASSERT_TRUE(
+      CopyFileRangeToFileAt(src_fd.get(), 5, dst_fd.get(), 10, 2 * 4096 + 7));
+  EXPECT_EQ(std::string(10, 'y') + data_.substr(5, 2 * 4096 + 7),
+            ReadContents(dst_fd.get()));
+}
+
+TEST_F(FileOperationsTest, CopyLeavesFilePositionsAlone) {
+  ftl::UniqueFD src_fd = NewFile(data_);
+  ftl::UniqueFD dst_fd = NewFile(std::string());
+  ASSERT_EQ(17, lseek(src_fd.get(), 17, SEEK_SET));
+  ASSERT_EQ(3, lseek(dst_fd.get(), 3, SEEK_SET));
+  ASSERT_TRUE(
+      CopyFileRangeToFileAt(src_fd.get(), 100, dst_fd.get(), 200, 5000));
+  EXPECT_EQ(17, lseek(src_fd.get(), 0, SEEK_CUR));
+  EXPECT_EQ(3, lseek(dst_fd.get(), 0, SEEK_CUR));
+  EXPECT_EQ(data_.substr(100, 5000), ReadContents(dst_fd.get()).substr(200));
+}
+
+TEST_F(FileOperationsTest, CopyToFilePosition) {
+  ftl::UniqueFD src_fd = NewFile(data_);
+  ftl::UniqueFD dst_fd = NewFile(std::string());
+  ASSERT_EQ(0, lseek(src_fd.get(), 0, SEEK_SET));
+  ASSERT_TRUE(CopyFileRangeToFile(src_fd.get(), 4096, dst_fd.get(), 1000));
+  ASSERT_TRUE(CopyFileToFile(src_fd.get(), dst_fd.get(), 2000));
+  EXPECT_EQ(3000, lseek(dst_fd.get(), 0, SEEK_CUR));
+  EXPECT_EQ(2000, lseek(src_fd.get(), 0, SEEK_CUR));
+  EXPECT_EQ(data_.substr(4096, 1000) + data_.substr(0, 2000),
+            ReadContents(dst_fd.get()));
+}
+
+TEST_F(FileOperationsTest, CopyToPipe) {
+  // Pipes cannot be written at an offset, so copies into them fall back from
+  // copy_file_range to sendfile or a buffered copy.
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  ftl::UniqueFD read_fd(fds[0]);
+  ftl::UniqueFD write_fd(fds[1]);
+  ftl::UniqueFD src_fd = NewFile(data_);
+  ASSERT_TRUE(CopyFileRangeToFile(src_fd.get(), 3, write_fd.get(), 10000));
+  write_fd.reset();
+
+  std::string contents(10000, '\0');
+  ASSERT_EQ(static_cast<ssize_t>(contents.size()),
+            ftl::ReadFileDescriptor(read_fd.get(), &contents[0],
+                                    contents.size()));
+  EXPECT_EQ(data_.substr(3, 10000), contents);
+}
+
+}  // namespace
+}  // namespace archive
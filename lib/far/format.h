@@ -12,10 +12,21 @@ namespace archive {
 constexpr uint64_t kMagic = 0x11c5abad480bbfc8;
 constexpr uint64_t kDirType = 0x2d2d2d2d2d524944;
 constexpr uint64_t kDirnamesType = 0x53454d414e524944;
+constexpr uint64_t kDirIndexType = 0x5845444e49524944;
+constexpr uint64_t kDirHashType = 0x2d48534148524944;
+constexpr uint64_t kDirCompressionType = 0x52504d4f43524944;
+constexpr uint64_t kDirFilterType = 0x4d4f4f4c42524944;
+constexpr uint64_t kDirFrontCodedNamesType = 0x4d414e4346524944;
 
 constexpr uint32_t kHashAlgorithm = 1;
 constexpr uint32_t kHashLength = 32;
 
+constexpr uint32_t kPathHashFunction = 1;  // 64-bit FNV-1a.
+
+constexpr uint32_t kCompressionZlib = 1;
+
+constexpr uint32_t kFrontCodedNamesVersion = 1;
+
 struct IndexChunk {
   uint64_t magic = kMagic;
   uint64_t length = 0;
@@ -43,12 +54,87 @@ struct DirectoryTableEntry {
   uint64_t reserved1 = 0;
 };
 
+// Alternative to the directory names chunk for archives with many long paths.
+//
+// Every path is stored as the length of the prefix it shares with the
+// previous path, the length of the rest of the path, both as LEB128 varints,
+// and the rest of the path. The first path of every block of
+// |restart_interval| paths shares nothing with its predecessor, and the chunk
+// records the offset of each such path within the names so that readers can
+// binary search the blocks without decoding them. The names are padded to a
+// multiple of 8 bytes.
+//
+// In archives with this chunk, the |name_offset| of a directory table entry
+// is the index of the entry rather than an offset, which lifts the 4 GiB
+// limit on the total length of the paths.
+struct FrontCodedNamesChunk {
+  uint32_t version = kFrontCodedNamesVersion;
+  uint32_t restart_interval = 0;
+  uint64_t name_count = 0;
+  uint64_t data_length = 0;  // The length of the names without padding.
+  // Restart offsets
+  // Names
+};
+
+// Optional open-addressed hash table for looking up directory table entries
+// by path. The slot for a path is the path hash modulo |slot_count|, which is
+// a power of two, with linear probing on collision.
+struct DirectoryIndexChunk {
+  uint32_t hash_function = kPathHashFunction;
+  uint32_t slot_count = 0;
+  // Slots
+};
+
+struct DirectoryIndexSlot {
+  uint32_t hash_tag = 0;  // High 32 bits of the path hash.
+  uint32_t entry = 0;     // One plus the directory table index, or zero.
+};
+
+// Optional Bloom filter over the paths of every file, which lets readers reject
+// most paths that are not in the archive without searching the directory. The
+// chunk is followed by |block_count| blocks of eight 64-bit words. See
+// path_filter.h for how paths map to bits.
+struct PathFilterChunk {
+  uint32_t hash_function = kPathHashFunction;
+  uint32_t probe_count = 0;
+  uint64_t block_count = 0;
+  // Blocks
+};
+
+// Optional content hashes of every file, in directory table order.
 struct DirectoryHashChunk {
   uint32_t algorithm = kHashAlgorithm;
   uint32_t hash_length = kHashLength;
   // Hashes
 };
 
+// Optional chunk describing files whose data is stored compressed as a series
+// of independently decodable blocks. The directory table entry of such a file
+// describes its compressed data. The chunk is followed by |entry_count|
+// CompressedEntry records, sorted by directory table index, and then by the
+// block offsets of those files.
+//
+// Readers that predate this chunk ignore it. They return the raw zlib blocks
+// of a compressed file as its contents, so archives with compressed files
+// must only be given to readers that support the chunk.
+struct CompressionChunk {
+  uint32_t algorithm = kCompressionZlib;
+  uint32_t block_size = 0;  // Uncompressed length of every block but the last.
+  uint64_t entry_count = 0;
+  // Compressed entries
+  // Block offsets
+};
+
+struct CompressedEntry {
+  uint32_t entry = 0;  // Directory table index.
+  uint32_t block_count = 0;
+  uint64_t uncompressed_length = 0;
+  // Index of the first of the |block_count| + 1 block offsets of this file.
+  // Block offsets are relative to the data offset of the file, and the last
+  // one is the length of its compressed data.
+  uint64_t first_block_offset = 0;
+};
+
 }  // namespace archive
 
 #endif  // APPLICATION_LIB_FAR_FORMAT_H_
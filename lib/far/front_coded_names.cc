@@ -0,0 +1,168 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "application/lib/far/front_coded_names.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace archive {
+namespace {
+
+void WriteVarint(uint64_t value, std::string* data) {
+  while (value >= 0x80) {
+    data->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  data->push_back(static_cast<char>(value));
+}
+
+// Reads a varint that is known to be well formed.
+uint64_t ReadVarint(const char** pos) {
+  uint64_t value = 0;
+  for (int shift = 0;; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(*(*pos)++);
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return value;
+  }
+}
+
+// Reads a varint that ends before |end|. Returns false if it does not.
+bool ReadVarint(const char** pos, const char* end, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && *pos < end; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(*(*pos)++);
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+}  // namespace
+
+void EncodeFrontCodedNames(const std::vector<ftl::StringView>& names,
+                           uint32_t restart_interval,
+                           std::vector<uint64_t>* restart_offsets,
+                           std::string* data) {
+  for (size_t i = 0; i < names.size(); ++i) {
+    ftl::StringView name = names[i];
+    size_t shared = 0;
+    if (i % restart_interval == 0) {
+      restart_offsets->push_back(data->size());
+    } else {
+      ftl::StringView previous = names[i - 1];
+      size_t limit = std::min(name.size(), previous.size());
+      while (shared < limit && name[shared] == previous[shared])
+        ++shared;
+    }
+    WriteVarint(shared, data);
+    WriteVarint(name.size() - shared, data);
+    data->append(name.data() + shared, name.size() - shared);
+  }
+}
+
+FrontCodedNames::FrontCodedNames() = default;
+
+FrontCodedNames::~FrontCodedNames() = default;
+
+bool FrontCodedNames::Init(const FrontCodedNamesChunk& chunk,
+                           const uint64_t* restart_offsets,
+                           const char* data,
+                           const DirectoryTableEntry* directory_table,
+                           uint64_t file_count) {
+  data_ = nullptr;
+  if (chunk.restart_interval == 0 || chunk.name_count != file_count ||
+      file_count > std::numeric_limits<uint32_t>::max())
+    return false;
+
+  // Decode every name once so that lookups can trust the encoding.
+  const char* pos = data;
+  const char* end = data + chunk.data_length;
+  uint64_t previous_length = 0;
+  for (uint64_t i = 0; i < file_count; ++i) {
+    bool restart = i % chunk.restart_interval == 0;
+    if (restart &&
+        restart_offsets[i / chunk.restart_interval] !=
+            static_cast<uint64_t>(pos - data))
+      return false;
+    uint64_t shared = 0;
+    uint64_t suffix = 0;
+    if (!ReadVarint(&pos, end, &shared) || !ReadVarint(&pos, end, &suffix) ||
+        (restart && shared != 0) || shared > previous_length ||
+        suffix > static_cast<uint64_t>(end - pos))
+      return false;
+    const DirectoryTableEntry& entry = directory_table[i];
+    if (entry.name_offset != i || shared + suffix != entry.name_length)
+      return false;
+    pos += suffix;
+    previous_length = shared + suffix;
+  }
+
+  restart_offsets_ = restart_offsets;
+  data_ = data;
+  count_ = file_count;
+  block_count_ =
+      (file_count + chunk.restart_interval - 1) / chunk.restart_interval;
+  restart_interval_ = chunk.restart_interval;
+  return true;
+}
+
+ftl::StringView FrontCodedNames::Get(uint64_t index,
+                                     std::string* buffer) const {
+  uint64_t block = index / restart_interval_;
+  uint64_t position = index % restart_interval_;
+  if (position == 0)
+    return GetRestartName(block);
+  const char* pos = data_ + restart_offsets_[block];
+  for (uint64_t i = 0; i < position; ++i)
+    DecodeNext(&pos, buffer);
+  return DecodeNext(&pos, buffer);
+}
+
+uint64_t FrontCodedNames::LowerBound(ftl::StringView name,
+                                     std::string* buffer) const {
+  // Find the first block that starts after |name|. The lower bound is either
+  // in the block before it or the first name of that block.
+  uint64_t begin = 0;
+  uint64_t end = block_count_;
+  while (begin < end) {
+    uint64_t middle = begin + (end - begin) / 2;
+    if (GetRestartName(middle) <= name)
+      begin = middle + 1;
+    else
+      end = middle;
+  }
+  if (begin == 0)
+    return 0;
+
+  uint64_t first = (begin - 1) * restart_interval_;
+  uint64_t last = std::min(first + restart_interval_, count_);
+  const char* pos = data_ + restart_offsets_[begin - 1];
+  for (uint64_t i = first; i < last; ++i) {
+    if (DecodeNext(&pos, buffer) >= name)
+      return i;
+  }
+  return last;
+}
+
+ftl::StringView FrontCodedNames::DecodeNext(const char** pos,
+                                            std::string* buffer) {
+  uint64_t shared = ReadVarint(pos);
+  uint64_t suffix = ReadVarint(pos);
+  buffer->resize(shared);
+  buffer->append(*pos, suffix);
+  *pos += suffix;
+  return ftl::StringView(*buffer);
+}
+
+ftl::StringView FrontCodedNames::GetRestartName(uint64_t block) const {
+  const char* pos = data_ + restart_offsets_[block];
+  ReadVarint(&pos);  // Restart names share nothing with the previous name.
+  uint64_t length = ReadVarint(&pos);
+  return ftl::StringView(pos, length);
+}
+
+}  // namespace archive
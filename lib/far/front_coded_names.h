@@ -0,0 +1,80 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef APPLICATION_LIB_FAR_FRONT_CODED_NAMES_H_
+#define APPLICATION_LIB_FAR_FRONT_CODED_NAMES_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "application/lib/far/format.h"
+#include "lib/ftl/strings/string_view.h"
+
+namespace archive {
+
+// Encodes the sorted |names| in the format of the body of the front-coded
+// names chunk, appending the offset of the first name of every block of
+// |restart_interval| names to |restart_offsets| and the encoded names to
+// |data|.
+void EncodeFrontCodedNames(const std::vector<ftl::StringView>& names,
+                           uint32_t restart_interval,
+                           std::vector<uint64_t>* restart_offsets,
+                           std::string* data);
+
+// Searches and decodes the names of a front-coded names chunk in place.
+class FrontCodedNames {
+ public:
+  FrontCodedNames();
+  ~FrontCodedNames();
+  FrontCodedNames(const FrontCodedNames& other) = delete;
+  FrontCodedNames& operator=(const FrontCodedNames& other) = delete;
+
+  // Points at the body of a chunk described by |chunk|, which must outlive
+  // this object. Returns false if the names are malformed or do not match
+  // the |file_count| entries of |directory_table|.
+  bool Init(const FrontCodedNamesChunk& chunk,
+            const uint64_t* restart_offsets,
+            const char* data,
+            const DirectoryTableEntry* directory_table,
+            uint64_t file_count);
+
+  bool empty() const { return data_ == nullptr; }
+
+  // Returns the |index|th name, which is decoded into |buffer| unless it is
+  // the first of its block.
+  ftl::StringView Get(uint64_t index, std::string* buffer) const;
+
+  // Returns the index of the first name that is not less than |name|.
+  uint64_t LowerBound(ftl::StringView name, std::string* buffer) const;
+
+  // Calls |callback| with every name in order. Each name is only valid for
+  // the duration of the call.
+  template <typename Callback>
+  void ForEach(Callback callback) const {
+    std::string buffer;
+    const char* pos = data_;
+    for (uint64_t i = 0; i < count_; ++i)
+      callback(DecodeNext(&pos, &buffer));
+  }
+
+ private:
+  // Decodes the name at |*pos|, which follows the name held in |buffer|, and
+  // advances |*pos| past it.
+  static ftl::StringView DecodeNext(const char** pos, std::string* buffer);
+
+  // Returns the first name of |block|, which is stored in full.
+  ftl::StringView GetRestartName(uint64_t block) const;
+
+  const uint64_t* restart_offsets_ = nullptr;
+  const char* data_ = nullptr;
+  uint64_t count_ = 0;
+  uint64_t block_count_ = 0;
+  uint32_t restart_interval_ = 0;
+};
+
+}  // namespace archive
+
+#endif  // APPLICATION_LIB_FAR_FRONT_CODED_NAMES_H_
@@ -4,34 +4,154 @@
 
 #include "application/lib/far/manifest.h"
 
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "application/lib/far/alignment.h"
 #include "application/lib/far/archive_entry.h"
 #include "application/lib/far/archive_writer.h"
 #include "lib/ftl/files/file.h"
+#include "lib/ftl/files/file_descriptor.h"
+#include "lib/ftl/files/unique_fd.h"
 #include "lib/ftl/strings/split_string.h"
+#include "lib/ftl/strings/string_number_conversions.h"
 
 namespace archive {
 
+namespace {
+
+constexpr ftl::StringView kAlignPrefix = "align=";
+
+// Parses one line of a manifest. Returns false on malformed attributes. Lines
+// without a mapping are ignored.
+bool ParseLine(ftl::StringView line, ArchiveWriter* writer) {
+  size_t end = line.find('\t');
+  ftl::StringView mapping = line.substr(0, end);
+  size_t offset = mapping.find('=');
+  if (offset == ftl::StringView::npos)
+    return true;
+  ArchiveEntry entry(mapping.substr(offset + 1).ToString(),
+                     mapping.substr(0, offset).ToString());
+  while (end != ftl::StringView::npos) {
+    size_t begin = end + 1;
+    end = line.find('\t', begin);
+    ftl::StringView attribute = line.substr(
+        begin, end == ftl::StringView::npos ? end : end - begin);
+    if (attribute.empty())
+      continue;
+    if (attribute == "compress") {
+      entry.compress = true;
+    } else if (attribute.substr(0, kAlignPrefix.size()) == kAlignPrefix) {
+      uint64_t alignment = 0;
+      if (!ftl::StringToNumberWithError(
+              attribute.substr(kAlignPrefix.size()), &alignment) ||
+          !IsValidDataAlignment(alignment)) {
+        fprintf(stderr, "error: Invalid alignment '%s' for '%s'\n",
+                attribute.ToString().c_str(), entry.dst_path.c_str());
+        return false;
+      }
+      entry.alignment = alignment;
+    } else {
+      fprintf(stderr, "error: Unknown attribute '%s' for '%s'\n",
+              attribute.ToString().c_str(), entry.dst_path.c_str());
+      return false;
+    }
+  }
+  writer->Add(std::move(entry));
+  return true;
+}
+
+// Parses the manifest in the |size| bytes at |data| line by line in place.
+bool ParseManifest(const char* data, size_t size, ArchiveWriter* writer) {
+  const char* data_end = data + size;
+  writer->Reserve(std::count(data, data_end, '\n') + 1);
+
+  for (const char* pos = data; pos < data_end;) {
+    const char* line_end =
+        static_cast<const char*>(memchr(pos, '\n', data_end - pos));
+    if (!line_end)
+      line_end = data_end;
+    if (line_end != pos &&
+        !ParseLine(ftl::StringView(pos, line_end - pos), writer))
+      return false;
+    pos = line_end + 1;
+  }
+  return true;
+}
+
+// Reads all of |fd| from its file position, which works for pipes.
+bool ReadStream(int fd, std::string* data) {
+  constexpr size_t kChunkSize = 64 * 1024;
+  while (true) {
+    size_t size = data->size();
+    data->resize(size + kChunkSize);
+    ssize_t actual = ftl::ReadFileDescriptor(fd, &(*data)[size], kChunkSize);
+    if (actual < 0)
+      return false;
+    data->resize(size + actual);
+    if (static_cast<size_t>(actual) < kChunkSize)
+      return true;
+  }
+}
+
+}  // namespace
+
 bool ReadManifest(ftl::StringView path, ArchiveWriter* writer) {
-  std::string manifest;
-  if (!files::ReadFileToString(path.ToString(), &manifest)) {
-    fprintf(stderr, "error: Faile to read '%s'\n", path.ToString().c_str());
+  std::string path_string = path.ToString();
+  ftl::UniqueFD fd(open(path_string.c_str(), O_RDONLY));
+  struct stat info;
+  if (!fd.is_valid() || fstat(fd.get(), &info) < 0) {
+    fprintf(stderr, "error: Faile to read '%s'\n", path_string.c_str());
     return false;
   }
 
-  std::vector<ftl::StringView> lines =
-      ftl::SplitString(manifest, "\n", ftl::WhiteSpaceHandling::kKeepWhitespace,
-                       ftl::SplitResult::kSplitWantNonEmpty);
+  // Large manifests are mapped and parsed in place rather than read into a
+  // string. Pipes, and files such as those in /proc that report no size, are
+  // read as a stream instead.
+  if (!S_ISREG(info.st_mode) || info.st_size == 0) {
+    std::string data;
+    if (!ReadStream(fd.get(), &data)) {
+      fprintf(stderr, "error: Faile to read '%s'\n", path_string.c_str());
+      return false;
+    }
+    return ParseManifest(data.data(), data.size(), writer);
+  }
+
+  size_t size = info.st_size;
+  void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "error: Faile to read '%s'\n", path_string.c_str());
+    return false;
+  }
+  bool result =
+      ParseManifest(static_cast<const char*>(mapping), size, writer);
+  munmap(mapping, size);
+  return result;
+}
 
-  for (const auto& line : lines) {
-    size_t offset = line.find('=');
-    if (offset == std::string::npos)
-      continue;
-    writer->Add(ArchiveEntry(line.substr(offset + 1).ToString(),
-                             line.substr(0, offset).ToString()));
+bool ReadLayoutProfile(ftl::StringView path, ArchiveWriter* writer) {
+  std::string profile;
+  if (!files::ReadFileToString(path.ToString(), &profile)) {
+    fprintf(stderr, "error: Failed to read '%s'\n", path.ToString().c_str());
+    return false;
   }
 
+  std::vector<ftl::StringView> lines = ftl::SplitString(
+      profile, "\n", ftl::WhiteSpaceHandling::kTrimWhitespace,
+      ftl::SplitResult::kSplitWantNonEmpty);
+  std::vector<std::string> paths;
+  paths.reserve(lines.size());
+  for (const auto& line : lines)
+    paths.push_back(line.ToString());
+  writer->set_layout_order(std::move(paths));
   return true;
 }
 
@@ -10,8 +10,20 @@
 namespace archive {
 class ArchiveWriter;
 
+// Adds the files listed in the manifest at |path| to |writer|.
+//
+// Each line of the manifest has the form |dst=src|, optionally followed by
+// tab-separated attributes:
+//
+//  * |compress| stores the file compressed.
+//  * |align=N| aligns the data of the file to N bytes, a power of two
+//    between 8 and 2097152.
 bool ReadManifest(ftl::StringView path, ArchiveWriter* writer);
 
+// Sets the layout order of |writer| from the layout profile at |path|, which
+// lists archive paths one per line in the order they are first accessed.
+bool ReadLayoutProfile(ftl::StringView path, ArchiveWriter* writer);
+
 }  // namespace archive
 
 #endif  // APPLICATION_LIB_FAR_MANIFEST_H_
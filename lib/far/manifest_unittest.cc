@@ -0,0 +1,95 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "application/lib/far/manifest.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+
+#include "application/lib/far/archive_reader.h"
+#include "application/lib/far/archive_writer.h"
+#include "gtest/gtest.h"
+#include "lib/ftl/files/file.h"
+#include "lib/ftl/files/file_descriptor.h"
+#include "lib/ftl/files/scoped_temp_dir.h"
+#include "lib/ftl/files/unique_fd.h"
+
+namespace archive {
+namespace {
+
+class ManifestTest : public ::testing::Test {
+ protected:
+  std::string NewFile(const std::string& contents) {
+    std::string path;
+    EXPECT_TRUE(temp_dir_.NewTempFile(&path));
+    EXPECT_TRUE(files::WriteFile(path, contents.data(), contents.size()));
+    return path;
+  }
+
+  // Returns a manifest mapping "a", "b/c" and "d" to files, with attributes.
+  std::string MakeManifest() {
+    return "a=" + NewFile(std::string(1000, 'a')) + "\tcompress\n" +
+           "b/c=" + NewFile("c") + "\talign=4096\n" +
+           "\n"
+           "d=" +
+           NewFile("d") + "\n";
+  }
+
+  // Writes |writer| to an archive and checks the entries of |MakeManifest|.
+  void CheckArchive(ArchiveWriter* writer) {
+    std::string archive_path;
+    ASSERT_TRUE(temp_dir_.NewTempFile(&archive_path));
+    ftl::UniqueFD fd(open(archive_path.c_str(), O_RDWR | O_TRUNC));
+    ASSERT_TRUE(writer->Write(fd.get()));
+    ArchiveReader reader(std::move(fd));
+    ASSERT_TRUE(reader.Read());
+    EXPECT_EQ(3u, reader.file_count());
+    EXPECT_TRUE(reader.IsCompressed("a"));
+    EXPECT_FALSE(reader.IsCompressed("d"));
+    DirectoryTableEntry entry;
+    ASSERT_TRUE(reader.GetDirectoryEntry("b/c", &entry));
+    EXPECT_EQ(0u, entry.data_offset % 4096);
+    EXPECT_EQ(1u, entry.data_length);
+  }
+
+  files::ScopedTempDir temp_dir_;
+};
+
+TEST_F(ManifestTest, ReadsAttributes) {
+  ArchiveWriter writer;
+  ASSERT_TRUE(ReadManifest(NewFile(MakeManifest()), &writer));
+  CheckArchive(&writer);
+}
+
+TEST_F(ManifestTest, ReadsPipes) {
+  std::string manifest = MakeManifest();
+  std::string fifo_path = temp_dir_.path() + "/manifest";
+  ASSERT_EQ(0, mkfifo(fifo_path.c_str(), S_IRUSR | S_IWUSR));
+  std::thread thread([&manifest, &fifo_path]() {
+    ftl::UniqueFD fd(open(fifo_path.c_str(), O_WRONLY));
+    EXPECT_TRUE(
+        ftl::WriteFileDescriptor(fd.get(), manifest.data(), manifest.size()));
+  });
+  ArchiveWriter writer;
+  bool result = ReadManifest(fifo_path, &writer);
+  thread.join();
+  ASSERT_TRUE(result);
+  CheckArchive(&writer);
+}
+
+TEST_F(ManifestTest, RejectsInvalidAttributes) {
+  std::string src_path = NewFile("x");
+  ArchiveWriter writer;
+  EXPECT_FALSE(ReadManifest(NewFile("a=" + src_path + "\talign=3\n"), &writer));
+  EXPECT_FALSE(ReadManifest(NewFile("a=" + src_path + "\tzip\n"), &writer));
+  ArchiveWriter empty_writer;
+  EXPECT_TRUE(ReadManifest(NewFile(""), &empty_writer));
+}
+
+}  // namespace
+}  // namespace archive
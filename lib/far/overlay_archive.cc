@@ -0,0 +1,199 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "application/lib/far/overlay_archive.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+
+namespace archive {
+namespace {
+
+constexpr size_t kWhiteoutPrefixLength = sizeof(kWhiteoutPrefix) - 1;
+
+// Maps paths to the highest layer that hides them.
+using HiddenPaths = std::map<std::string, size_t>;
+
+bool IsHiddenBy(const HiddenPaths& hidden, ftl::StringView path, size_t layer) {
+  auto it = hidden.find(path.ToString());
+  return it != hidden.end() && it->second > layer;
+}
+
+// Whether |path| in |layer| is hidden by a whiteout of itself or of one of
+// its directories, by an opaque directory, or by a directory with its name,
+// in a higher layer. Files hide what lies below their path in lower layers,
+// so they are whiteouts too. The keys of |opaque_dirs| end with a slash,
+// except for the root, which is empty.
+bool IsHidden(const HiddenPaths& whiteouts,
+              const HiddenPaths& opaque_dirs,
+              const HiddenPaths& directories,
+              ftl::StringView path,
+              size_t layer) {
+  if (IsHiddenBy(whiteouts, path, layer) ||
+      IsHiddenBy(directories, path, layer) ||
+      IsHiddenBy(opaque_dirs, ftl::StringView(), layer))
+    return true;
+  for (size_t slash = path.find('/'); slash != ftl::StringView::npos;
+       slash = path.find('/', slash + 1)) {
+    if (IsHiddenBy(whiteouts, path.substr(0, slash), layer) ||
+        IsHiddenBy(opaque_dirs, path.substr(0, slash + 1), layer))
+      return true;
+  }
+  return false;
+}
+
+}  // namespace
+
+OverlayArchive::OverlayArchive(
+    std::vector<std::shared_ptr<const ArchiveReader>> layers)
+    : layers_(std::move(layers)) {
+  if (layers_.size() == 1) {
+    // Files of a single archive are not whiteouts, since there is nothing
+    // below them to hide, so every file is visible and no path is read.
+    entries_.reserve(layers_[0]->file_count());
+    layers_[0]->ListDirectory([this](const DirectoryTableEntry& entry) {
+      OverlayEntry overlay_entry;
+      overlay_entry.entry = &entry;
+      entries_.push_back(overlay_entry);
+    });
+    return;
+  }
+
+  // The paths are copied while the layers are merged, and dropped once the
+  // visible files are known.
+  struct Candidate {
+    std::string path;
+    OverlayEntry entry;
+  };
+  HiddenPaths whiteouts;
+  HiddenPaths opaque_dirs;
+  HiddenPaths directories;
+  std::vector<Candidate> candidates;
+  for (size_t layer = 0; layer < layers_.size(); ++layer) {
+    const ArchiveReader& reader = *layers_[layer];
+    std::vector<const DirectoryTableEntry*> table;
+    table.reserve(reader.file_count());
+    reader.ListDirectory([&table](const DirectoryTableEntry& entry) {
+      table.push_back(&entry);
+    });
+    // Paths are listed in the order of the directory table, which decodes
+    // front-coded names sequentially.
+    size_t index = 0;
+    reader.ListPaths([&](ftl::StringView path) {
+      const DirectoryTableEntry& entry = *table[index++];
+      size_t slash = path.rfind('/');
+      size_t name_begin = slash == ftl::StringView::npos ? 0 : slash + 1;
+      ftl::StringView dir = path.substr(0, name_begin);
+      ftl::StringView name = path.substr(name_begin);
+      // Layers are visited from the bottom up, so the last layer to hide a
+      // path is the highest. Nothing is below the bottom layer.
+      if (layer > 0) {
+        for (size_t end = path.find('/'); end != ftl::StringView::npos;
+             end = path.find('/', end + 1))
+          directories[path.substr(0, end).ToString()] = layer;
+      }
+      if (name == kOpaqueWhiteout) {
+        opaque_dirs[dir.ToString()] = layer;
+      } else if (name.substr(0, kWhiteoutPrefixLength) == kWhiteoutPrefix) {
+        whiteouts[dir.ToString() +
+                  name.substr(kWhiteoutPrefixLength).ToString()] = layer;
+      } else {
+        Candidate candidate;
+        candidate.path = path.ToString();
+        candidate.entry.layer = layer;
+        candidate.entry.entry = &entry;
+        candidates.push_back(std::move(candidate));
+        if (layer > 0)
+          whiteouts[path.ToString()] = layer;
+      }
+    });
+  }
+
+  // Each layer is sorted already. Among files with the same path, the stable
+  // sort keeps the lower layers first.
+  std::stable_sort(candidates.begin(), candidates.end(),
+                   [](const Candidate& lhs, const Candidate& rhs) {
+                     return lhs.path < rhs.path;
+                   });
+
+  bool has_whiteouts =
+      !whiteouts.empty() || !opaque_dirs.empty() || !directories.empty();
+  entries_.reserve(candidates.size());
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    const Candidate& candidate = candidates[i];
+    if (i + 1 < candidates.size() && candidates[i + 1].path == candidate.path)
+      continue;  // Shadowed by a higher layer.
+    if (has_whiteouts &&
+        IsHidden(whiteouts, opaque_dirs, directories, candidate.path,
+                 candidate.entry.layer))
+      continue;
+    entries_.push_back(candidate.entry);
+  }
+}
+
+OverlayArchive::~OverlayArchive() = default;
+
+const OverlayEntry* OverlayArchive::Find(ftl::StringView path) const {
+  std::string buffer;
+  auto it = LowerBound(path, &buffer);
+  if (it == entries_.end() || GetPath(*it, &buffer) != path)
+    return nullptr;
+  return &*it;
+}
+
+ftl::StringView OverlayArchive::GetPath(const OverlayEntry& entry,
+                                        std::string* buffer) const {
+  return layers_[entry.layer]->GetPath(*entry.entry, buffer);
+}
+
+bool OverlayArchive::ExtractFile(ftl::StringView path,
+                                 const char* output_path) const {
+  const OverlayEntry* entry = Find(path);
+  return entry && layers_[entry->layer]->ExtractFile(path, output_path);
+}
+
+bool OverlayArchive::CopyFile(ftl::StringView path, int dst_fd) const {
+  const OverlayEntry* entry = Find(path);
+  return entry && layers_[entry->layer]->CopyFile(path, dst_fd);
+}
+
+bool OverlayArchive::GetFileLength(ftl::StringView path,
+                                   uint64_t* length) const {
+  const OverlayEntry* entry = Find(path);
+  return entry && layers_[entry->layer]->GetFileLength(path, length);
+}
+
+bool OverlayArchive::ReadFileRange(ftl::StringView path,
+                                   uint64_t offset,
+                                   uint64_t length,
+                                   char* buffer) const {
+  const OverlayEntry* entry = Find(path);
+  return entry &&
+         layers_[entry->layer]->ReadFileRange(path, offset, length, buffer);
+}
+
+bool OverlayArchive::IsCompressed(ftl::StringView path) const {
+  const OverlayEntry* entry = Find(path);
+  return entry && layers_[entry->layer]->IsCompressed(path);
+}
+
+bool OverlayArchive::GetFileView(ftl::StringView path,
+                                 ftl::StringView* contents) const {
+  const OverlayEntry* entry = Find(path);
+  return entry && layers_[entry->layer]->GetFileView(path, contents);
+}
+
+std::vector<OverlayEntry>::const_iterator OverlayArchive::LowerBound(
+    ftl::StringView path,
+    std::string* buffer) const {
+  return std::lower_bound(
+      entries_.begin(), entries_.end(), path,
+      [this, buffer](const OverlayEntry& entry, ftl::StringView path) {
+        return GetPath(entry, buffer) < path;
+      });
+}
+
+}  // namespace archive
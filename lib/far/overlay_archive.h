@@ -0,0 +1,142 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef APPLICATION_LIB_FAR_OVERLAY_ARCHIVE_H_
+#define APPLICATION_LIB_FAR_OVERLAY_ARCHIVE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "application/lib/far/archive_reader.h"
+#include "application/lib/far/format.h"
+#include "lib/ftl/strings/string_view.h"
+
+namespace archive {
+
+// Marks a path in a layer of an overlay as deleted: "dir/.wh.name" hides
+// "dir/name", and everything below it, in lower layers.
+constexpr char kWhiteoutPrefix[] = ".wh.";
+
+// Marks a directory in a layer of an overlay as opaque: "dir/.wh..wh..opq"
+// hides everything below "dir/" in lower layers.
+constexpr char kOpaqueWhiteout[] = ".wh..wh..opq";
+
+// A file in an overlay and the layer it comes from. Its path is read from
+// the layer on demand with |OverlayArchive::GetPath|.
+struct OverlayEntry {
+  size_t layer = 0;
+  const DirectoryTableEntry* entry = nullptr;
+};
+
+// A read-only view of a stack of archives, such as a base package and the
+// patches applied to it, as a single archive.
+//
+// Files in later layers shadow files with the same path in earlier layers,
+// as well as directories with that name, and directories in later layers
+// shadow files with their name. Whiteout files, which are never visible
+// themselves, hide files in earlier layers. An overlay of a single archive
+// has no whiteouts, so it shows every file of the archive, including those
+// named like whiteouts. The merged directory is built once on construction,
+// after which lookups are a single binary search and the const methods are
+// safe to call concurrently.
+//
+// Paths are not copied out of the layers. Paths of archives with front-coded
+// names are decoded whenever they are used, so prefer |ListEntries| over
+// repeated calls to |Find| when visiting many files.
+class OverlayArchive {
+ public:
+  // |layers| are ordered from the bottom of the stack to the top and must
+  // have read their archives.
+  explicit OverlayArchive(
+      std::vector<std::shared_ptr<const ArchiveReader>> layers);
+  ~OverlayArchive();
+  OverlayArchive(const OverlayArchive& other) = delete;
+  OverlayArchive& operator=(const OverlayArchive& other) = delete;
+
+  size_t layer_count() const { return layers_.size(); }
+  const ArchiveReader& layer(size_t index) const { return *layers_[index]; }
+  const std::shared_ptr<const ArchiveReader>& shared_layer(size_t index) const {
+    return layers_[index];
+  }
+
+  uint64_t file_count() const { return entries_.size(); }
+
+  // Calls |callback| with the path of every visible file, in path order.
+  // The path is only valid during the call.
+  template <typename Callback>
+  void ListPaths(Callback callback) const {
+    ListEntries([&callback](const OverlayEntry& entry, ftl::StringView path) {
+      callback(path);
+    });
+  }
+
+  // Calls |callback| with every visible file and its path, in path order.
+  // The path is only valid during the call.
+  template <typename Callback>
+  void ListEntries(Callback callback) const {
+    if (layers_.size() == 1) {
+      // Every file of a single layer is visible, so its names can be decoded
+      // sequentially.
+      size_t index = 0;
+      layers_[0]->ListPaths([this, &callback, &index](ftl::StringView path) {
+        callback(entries_[index++], path);
+      });
+      return;
+    }
+    std::string buffer;
+    for (const auto& entry : entries_)
+      callback(entry, GetPath(entry, &buffer));
+  }
+
+  // Calls |callback| with every visible file whose path starts with |prefix|,
+  // and its path, in path order. The path is only valid during the call.
+  template <typename Callback>
+  void ListPrefix(ftl::StringView prefix, Callback callback) const {
+    std::string buffer;
+    for (auto it = LowerBound(prefix, &buffer); it != entries_.end(); ++it) {
+      ftl::StringView path = GetPath(*it, &buffer);
+      if (path.substr(0, prefix.size()) != prefix)
+        break;
+      callback(*it, path);
+    }
+  }
+
+  // Returns the visible file at |path|, or null if there is none.
+  const OverlayEntry* Find(ftl::StringView path) const;
+
+  // Returns the path of |entry|, decoding it into |buffer| if its layer has
+  // front-coded names. The path is valid until |buffer| is next modified.
+  ftl::StringView GetPath(const OverlayEntry& entry,
+                          std::string* buffer) const;
+
+  bool ExtractFile(ftl::StringView path, const char* output_path) const;
+  bool CopyFile(ftl::StringView path, int dst_fd) const;
+  bool GetFileLength(ftl::StringView path, uint64_t* length) const;
+  bool ReadFileRange(ftl::StringView path,
+                     uint64_t offset,
+                     uint64_t length,
+                     char* buffer) const;
+  bool IsCompressed(ftl::StringView path) const;
+  bool GetFileView(ftl::StringView path, ftl::StringView* contents) const;
+
+ private:
+  // Returns the first visible file whose path is not less than |path|,
+  // decoding paths into |buffer|.
+  std::vector<OverlayEntry>::const_iterator LowerBound(
+      ftl::StringView path,
+      std::string* buffer) const;
+
+  std::vector<std::shared_ptr<const ArchiveReader>> layers_;
+
+  // The visible files, sorted by path.
+  std::vector<OverlayEntry> entries_;
+};
+
+}  // namespace archive
+
+#endif  // APPLICATION_LIB_FAR_OVERLAY_ARCHIVE_H_
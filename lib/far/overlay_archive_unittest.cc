@@ -0,0 +1,164 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "application/lib/far/overlay_archive.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "application/lib/far/archive_writer.h"
+#include "gtest/gtest.h"
+#include "lib/ftl/files/scoped_temp_dir.h"
+#include "lib/ftl/files/unique_fd.h"
+
+namespace archive {
+namespace {
+
+class OverlayArchiveTest : public ::testing::Test {
+ protected:
+  // Returns a reader of a new archive mapping each path to its contents.
+  std::shared_ptr<const ArchiveReader> MakeLayer(
+      const std::vector<std::pair<std::string, std::string>>& files,
+      bool front_coded_names = false) {
+    ArchiveWriter writer;
+    writer.set_front_coded_names(front_coded_names);
+    for (const auto& file : files)
+      EXPECT_TRUE(
+          writer.Add(ArchiveEntry::FromBuffer(file.second, file.first)));
+    std::string archive_path;
+    EXPECT_TRUE(temp_dir_.NewTempFile(&archive_path));
+    ftl::UniqueFD fd(open(archive_path.c_str(), O_RDWR | O_TRUNC));
+    EXPECT_TRUE(writer.Write(fd.get()));
+    auto reader = std::make_shared<ArchiveReader>(std::move(fd));
+    EXPECT_TRUE(reader->Read());
+    return reader;
+  }
+
+  std::string ReadFile(const OverlayArchive& overlay, ftl::StringView path) {
+    uint64_t length = 0;
+    if (!overlay.GetFileLength(path, &length))
+      return "<missing>";
+    std::string contents(length, '\0');
+    EXPECT_TRUE(overlay.ReadFileRange(path, 0, length, &contents[0]));
+    return contents;
+  }
+
+  files::ScopedTempDir temp_dir_;
+};
+
+TEST_F(OverlayArchiveTest, ShadowsAndWhitesOut) {
+  OverlayArchive overlay({
+      MakeLayer({{"bin/app", "base"},
+                 {"data/a", "base"},
+                 {"data/b", "base"},
+                 {"lib/x/1", "base"},
+                 {"lib/x/2", "base"},
+                 {"meta/sandbox", "base"}}),
+      MakeLayer({{"bin/app", "patch1"},
+                 {"data/.wh.a", ""},
+                 {"lib/.wh.x", ""},
+                 {"new/file", "patch1"}}),
+      MakeLayer({{"data/.wh..wh..opq", ""},
+                 {"data/c", "patch2"},
+                 {"lib/x/1", "patch2"}}),
+  });
+
+  std::vector<std::string> paths;
+  overlay.ListPaths([&paths](ftl::StringView path) {
+    paths.push_back(path.ToString());
+  });
+  EXPECT_EQ((std::vector<std::string>{"bin/app", "data/c", "lib/x/1",
+                                      "meta/sandbox", "new/file"}),
+            paths);
+  EXPECT_EQ(5u, overlay.file_count());
+
+  EXPECT_EQ("patch1", ReadFile(overlay, "bin/app"));
+  EXPECT_EQ("patch2", ReadFile(overlay, "data/c"));
+  EXPECT_EQ("patch2", ReadFile(overlay, "lib/x/1"));
+  EXPECT_EQ("base", ReadFile(overlay, "meta/sandbox"));
+  EXPECT_EQ("<missing>", ReadFile(overlay, "data/a"));
+  EXPECT_EQ("<missing>", ReadFile(overlay, "data/b"));
+  EXPECT_EQ("<missing>", ReadFile(overlay, "lib/x/2"));
+  EXPECT_EQ("<missing>", ReadFile(overlay, "data/.wh.a"));
+
+  const OverlayEntry* entry = overlay.Find("new/file");
+  ASSERT_NE(nullptr, entry);
+  EXPECT_EQ(1u, entry->layer);
+  EXPECT_EQ("new/file", overlay.layer(1).GetPathView(*entry->entry));
+
+  std::vector<std::string> lib;
+  overlay.ListPrefix("lib/", [&lib](const OverlayEntry& entry,
+                                    ftl::StringView path) {
+    lib.push_back(path.ToString() + "@" + std::to_string(entry.layer));
+  });
+  EXPECT_EQ((std::vector<std::string>{"lib/x/1@2"}), lib);
+}
+
+TEST_F(OverlayArchiveTest, FilesAndDirectoriesShadowEachOther) {
+  OverlayArchive overlay({
+      MakeLayer({{"a/b", "base"}, {"a/c", "base"}, {"d", "base"}}),
+      MakeLayer({{"a", "patch"}, {"d/e", "patch"}}),
+  });
+
+  std::vector<std::string> paths;
+  overlay.ListPaths([&paths](ftl::StringView path) {
+    paths.push_back(path.ToString());
+  });
+  EXPECT_EQ((std::vector<std::string>{"a", "d/e"}), paths);
+  EXPECT_EQ("patch", ReadFile(overlay, "a"));
+  EXPECT_EQ("<missing>", ReadFile(overlay, "a/b"));
+  EXPECT_EQ("<missing>", ReadFile(overlay, "d"));
+}
+
+TEST_F(OverlayArchiveTest, SingleLayer) {
+  OverlayArchive overlay({MakeLayer({{"a", "1"}, {"b/c", "2"}})});
+  EXPECT_EQ(2u, overlay.file_count());
+  EXPECT_EQ("2", ReadFile(overlay, "b/c"));
+  EXPECT_EQ(nullptr, overlay.Find("b"));
+}
+
+TEST_F(OverlayArchiveTest, SingleLayerHasNoWhiteouts) {
+  OverlayArchive overlay({MakeLayer({{".wh..wh..opq", "opaque"},
+                                     {"a", "1"},
+                                     {"b/.wh.a", "whiteout"}})});
+  EXPECT_EQ(3u, overlay.file_count());
+  EXPECT_EQ("1", ReadFile(overlay, "a"));
+  EXPECT_EQ("opaque", ReadFile(overlay, ".wh..wh..opq"));
+  EXPECT_EQ("whiteout", ReadFile(overlay, "b/.wh.a"));
+}
+
+TEST_F(OverlayArchiveTest, DoesNotExpandFrontCodedNames) {
+  std::vector<std::pair<std::string, std::string>> files;
+  for (int i = 0; i < 100; ++i)
+    files.emplace_back("data/file" + std::to_string(1000 + i), "x");
+  std::vector<std::shared_ptr<const ArchiveReader>> layers = {
+      MakeLayer(files, true), MakeLayer({{"data/file1050", "y"}}, true)};
+  std::vector<uint64_t> usage;
+  for (const auto& layer : layers)
+    usage.push_back(layer->GetMemoryUsage());
+
+  for (size_t layer_count = 1; layer_count <= layers.size(); ++layer_count) {
+    OverlayArchive overlay(std::vector<std::shared_ptr<const ArchiveReader>>(
+        layers.begin(), layers.begin() + layer_count));
+    std::vector<std::string> paths;
+    overlay.ListPaths([&paths](ftl::StringView path) {
+      paths.push_back(path.ToString());
+    });
+    ASSERT_EQ(100u, paths.size());
+    EXPECT_EQ("data/file1099", paths.back());
+    EXPECT_EQ(layer_count == 1 ? "x" : "y", ReadFile(overlay, "data/file1050"));
+    EXPECT_EQ(nullptr, overlay.Find("data/file"));
+  }
+
+  // The layers did not keep copies of the paths they decoded.
+  for (size_t i = 0; i < layers.size(); ++i)
+    EXPECT_EQ(usage[i], layers[i]->GetMemoryUsage());
+}
+
+}  // namespace
+}  // namespace archive
@@ -0,0 +1,48 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "application/lib/far/parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace archive {
+
+size_t GetDefaultJobCount() {
+  size_t count = std::thread::hardware_concurrency();
+  return count ? count : 1;
+}
+
+bool ParallelFor(size_t count,
+                 size_t jobs,
+                 const std::function<bool(size_t)>& function) {
+  if (jobs == 0)
+    jobs = GetDefaultJobCount();
+  jobs = std::min(jobs, count);
+
+  std::atomic<size_t> next_index(0);
+  std::atomic<bool> failed(false);
+  auto worker = [&]() {
+    while (!failed.load(std::memory_order_relaxed)) {
+      size_t index = next_index.fetch_add(1, std::memory_order_relaxed);
+      if (index >= count)
+        return;
+      if (!function(index))
+        failed.store(true, std::memory_order_relaxed);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < jobs; ++i)
+    threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads)
+    thread.join();
+
+  return !failed.load();
+}
+
+}  // namespace archive
@@ -0,0 +1,29 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef APPLICATION_LIB_FAR_PARALLEL_H_
+#define APPLICATION_LIB_FAR_PARALLEL_H_
+
+#include <stddef.h>
+
+#include <functional>
+
+namespace archive {
+
+// Returns the number of hardware threads, or one if that is unknown.
+size_t GetDefaultJobCount();
+
+// Calls |function| once for every index in [0, |count|) using up to |jobs|
+// threads, including the calling thread. Indices are handed out in increasing
+// order. If |jobs| is zero, uses |GetDefaultJobCount|.
+//
+// Stops handing out indices once any call returns false, in which case this
+// function returns false.
+bool ParallelFor(size_t count,
+                 size_t jobs,
+                 const std::function<bool(size_t)>& function);
+
+}  // namespace archive
+
+#endif  // APPLICATION_LIB_FAR_PARALLEL_H_
@@ -0,0 +1,67 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef APPLICATION_LIB_FAR_PATH_FILTER_H_
+#define APPLICATION_LIB_FAR_PATH_FILTER_H_
+
+#include <stdint.h>
+
+namespace archive {
+
+// A split block Bloom filter over path hashes, as stored in the path filter
+// chunk. Each path sets one bit in every word of a single block, so a lookup
+// touches one cache line.
+constexpr uint64_t kFilterBlockWords = 8;
+constexpr uint32_t kFilterProbeCount = kFilterBlockWords;
+
+// About half a percent of absent paths pass the filter at this density.
+constexpr uint64_t kFilterBitsPerPath = 12;
+
+inline uint64_t GetFilterBlockCount(uint64_t path_count) {
+  uint64_t bits_per_block = kFilterBlockWords * 64;
+  uint64_t block_count =
+      (path_count * kFilterBitsPerPath + bits_per_block - 1) / bits_per_block;
+  return block_count ? block_count : 1;
+}
+
+// Mixes the bits of a path hash so that the bits chosen within a block are
+// independent of the block, which is chosen by the unmixed hash.
+inline uint64_t MixFilterHash(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// Adds the path with the given |kPathHashFunction| hash to the filter made of
+// |block_count| blocks starting at |words|.
+inline void AddToFilter(uint64_t hash, uint64_t* words, uint64_t block_count) {
+  uint64_t* block = words + (hash % block_count) * kFilterBlockWords;
+  uint64_t bits = MixFilterHash(hash);
+  for (uint64_t i = 0; i < kFilterBlockWords; ++i) {
+    block[i] |= uint64_t(1) << (bits & 63);
+    bits >>= 6;
+  }
+}
+
+// Returns false if the path with the given hash was definitely not added to
+// the filter.
+inline bool FilterMayContain(uint64_t hash,
+                             const uint64_t* words,
+                             uint64_t block_count) {
+  const uint64_t* block = words + (hash % block_count) * kFilterBlockWords;
+  uint64_t bits = MixFilterHash(hash);
+  for (uint64_t i = 0; i < kFilterBlockWords; ++i) {
+    if (!(block[i] & (uint64_t(1) << (bits & 63))))
+      return false;
+    bits >>= 6;
+  }
+  return true;
+}
+
+}  // namespace archive
+
+#endif  // APPLICATION_LIB_FAR_PATH_FILTER_H_
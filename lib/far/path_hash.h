@@ -0,0 +1,26 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef APPLICATION_LIB_FAR_PATH_HASH_H_
+#define APPLICATION_LIB_FAR_PATH_HASH_H_
+
+#include <stdint.h>
+
+#include "lib/ftl/strings/string_view.h"
+
+namespace archive {
+
+// Hashes |path| with 64-bit FNV-1a, which is |kPathHashFunction|.
+inline uint64_t HashPath(ftl::StringView path) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (char c : path) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+}  // namespace archive
+
+#endif  // APPLICATION_LIB_FAR_PATH_HASH_H_
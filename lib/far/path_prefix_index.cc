@@ -0,0 +1,77 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "application/lib/far/path_prefix_index.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace archive {
+namespace {
+
+uint64_t MakeKey(ftl::StringView path) {
+  uint64_t key = 0;
+  for (size_t i = 0; i < 8; ++i) {
+    key <<= 8;
+    if (i < path.size())
+      key |= static_cast<uint8_t>(path[i]);
+  }
+  return key;
+}
+
+}  // namespace
+
+PathPrefixIndex::PathPrefixIndex() = default;
+
+PathPrefixIndex::~PathPrefixIndex() = default;
+
+void PathPrefixIndex::Build(
+    uint64_t count,
+    const std::function<ftl::StringView(uint64_t)>& get_path) {
+  keys_.assign(count + 1, 0);
+  ranks_.assign(count + 1, 0);
+
+  // Visits the implicit tree in order, which assigns the sorted paths to the
+  // nodes in Eytzinger order.
+  uint64_t rank = 0;
+  uint64_t node = 1;
+  std::vector<uint64_t> stack;
+  while (node <= count || !stack.empty()) {
+    while (node <= count) {
+      stack.push_back(node);
+      node *= 2;
+    }
+    node = stack.back();
+    stack.pop_back();
+    keys_[node] = MakeKey(get_path(rank));
+    ranks_[node] = static_cast<uint32_t>(rank);
+    ++rank;
+    node = 2 * node + 1;
+  }
+}
+
+uint64_t PathPrefixIndex::LowerBound(uint64_t key) const {
+  const uint64_t count = keys_.size() - 1;
+  uint64_t node = 1;
+  while (node <= count) {
+    // The great-grandchildren of |node| share a cache line.
+    __builtin_prefetch(keys_.data() + std::min(16 * node, count));
+    node = 2 * node + (keys_[node] < key);
+  }
+  // Undo the right turns taken after the last left turn, which leads back to
+  // the node holding the lower bound.
+  node >>= __builtin_ffsll(~node);
+  return node == 0 ? count : ranks_[node];
+}
+
+void PathPrefixIndex::FindCandidates(ftl::StringView path,
+                                     uint64_t* begin,
+                                     uint64_t* end) const {
+  uint64_t key = MakeKey(path);
+  *begin = LowerBound(key);
+  *end = key == std::numeric_limits<uint64_t>::max() ? keys_.size() - 1
+                                                      : LowerBound(key + 1);
+}
+
+}  // namespace archive
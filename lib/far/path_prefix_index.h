@@ -0,0 +1,65 @@
+// Copyright 2017 The Fuchsia Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef APPLICATION_LIB_FAR_PATH_PREFIX_INDEX_H_
+#define APPLICATION_LIB_FAR_PATH_PREFIX_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+#include "lib/ftl/strings/string_view.h"
+
+namespace archive {
+
+// An in-memory search tree over the first eight bytes of every path in a
+// sorted directory table.
+//
+// The prefixes are stored as big-endian integers, which compare like the
+// bytes they hold, in Eytzinger order: the implicit binary tree is laid out
+// breadth first, so the first levels of every search share a few cache lines
+// and the next levels can be prefetched. A search touches neither the
+// directory table nor the path names, and narrows a lookup down to the
+// entries that share the prefix of the query.
+class PathPrefixIndex {
+ public:
+  PathPrefixIndex();
+  ~PathPrefixIndex();
+  PathPrefixIndex(const PathPrefixIndex& other) = delete;
+  PathPrefixIndex& operator=(const PathPrefixIndex& other) = delete;
+
+  // Builds the index over |count| paths, which |get_path| returns in sorted
+  // order.
+  void Build(uint64_t count,
+             const std::function<ftl::StringView(uint64_t)>& get_path);
+
+  bool empty() const { return keys_.size() <= 1; }
+
+  // The memory used by the index, in bytes.
+  size_t memory_usage() const {
+    return keys_.capacity() * sizeof(uint64_t) +
+           ranks_.capacity() * sizeof(uint32_t);
+  }
+
+  // Sets [|begin|, |end|) to the range of indices of the paths whose first
+  // eight bytes match those of |path|. The lower bound of |path| among all
+  // paths lies within [|begin|, |end|].
+  void FindCandidates(ftl::StringView path,
+                      uint64_t* begin,
+                      uint64_t* end) const;
+
+ private:
+  // Returns the index of the first path whose key is not less than |key|.
+  uint64_t LowerBound(uint64_t key) const;
+
+  // One-based, in Eytzinger order, with a sentinel in the first slot.
+  std::vector<uint64_t> keys_;
+  std::vector<uint32_t> ranks_;
+};
+
+}  // namespace archive
+
+#endif  // APPLICATION_LIB_FAR_PATH_PREFIX_INDEX_H_
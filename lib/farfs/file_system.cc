@@ -4,8 +4,12 @@
 
 #include "application/lib/farfs/file_system.h"
 
-#include <fcntl.h>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <string>
 
+#include "application/lib/far/alignment.h"
 #include "lib/mtl/vfs/vfs_serve.h"
 
 namespace archive {
@@ -13,11 +17,15 @@ namespace {
 
 struct DirRecord {
   DirRecord() = default;
+  explicit DirRecord(mxtl::StringPiece name) : name(name) {}
   DirRecord(DirRecord&& other)
-      : names(std::move(other.names)), children(std::move(other.children)) {}
+      : name(other.name),
+        names(std::move(other.names)),
+        children(std::move(other.children)) {}
   DirRecord(const DirRecord& other) = delete;
 
   void swap(DirRecord& other) {
+    std::swap(name, other.name);
     names.swap(other.names);
     children.swap(other.children);
   }
@@ -38,30 +46,30 @@ struct DirRecord {
   }
 
   mtl::VFSDispatcher dispatcher_;
+  // The name of this directory in its parent.
+  mxtl::StringPiece name;
   std::vector<mxtl::StringPiece> names;
   std::vector<mxtl::RefPtr<vmofs::Vnode>> children;
 };
 
-ftl::StringView PopLastDirectory(ftl::StringView* path) {
+void PopLastDirectory(std::string* path) {
   FTL_DCHECK(path->size() >= 2);  // Shortest path: "x/".
   size_t end = path->size() - 1;
   FTL_DCHECK(path->at(end) == '/');  // Must end with '/'.
   size_t begin = path->rfind('/', end - 1);
-  if (begin == ftl::StringView::npos) {
-    ftl::StringView result = path->substr(0, end);
-    *path = ftl::StringView();
-    return result;
+  if (begin == std::string::npos) {
+    path->clear();
+    return;
   }
-  ftl::StringView result = path->substr(begin + 1, end - begin - 1);
-  FTL_DCHECK(!result.empty());  // "//" is disallowed.
-  *path = path->substr(0, begin + 1);
-  return result;
+  FTL_DCHECK(begin + 1 < end);  // "//" is disallowed.
+  path->resize(begin + 1);
 }
 
-bool PopFirstDirectory(ftl::StringView* path) {
+bool PopFirstDirectory(ftl::StringView* path, ftl::StringView* name) {
   size_t end = path->find('/');
   if (end == ftl::StringView::npos)
     return false;
+  *name = path->substr(0, end);
   *path = path->substr(end + 1);
   return true;
 }
@@ -77,27 +85,169 @@ mxtl::RefPtr<vmofs::VnodeFile> CreateFile(fs::Dispatcher* dispatcher,
                                              entry.data_length));
 }
 
+// Returns a new VMO holding a copy of the contents of the file at |path| in
+// |reader|, or an invalid VMO if the copy fails.
+mx::vmo CopyToVMO(const ArchiveReader& reader, ftl::StringView path) {
+  uint64_t length = 0;
+  if (!reader.GetFileLength(path, &length))
+    return mx::vmo();
+  mx::vmo vmo;
+  if (mx::vmo::create(length, 0, &vmo) != MX_OK)
+    return mx::vmo();
+  std::vector<char> buffer(std::min<uint64_t>(length, kCompressionBlockSize));
+  for (uint64_t offset = 0; offset < length; offset += buffer.size()) {
+    size_t count = std::min<uint64_t>(buffer.size(), length - offset);
+    size_t actual = 0;
+    if (!reader.ReadFileRange(path, offset, count, buffer.data()) ||
+        vmo.write(buffer.data(), offset, count, &actual) != MX_OK ||
+        actual != count)
+      return mx::vmo();
+  }
+  return vmo;
+}
+
+// A file stored compressed, which is decompressed into a VMO the first time
+// it is used rather than when the file system is created. The vnode keeps the
+// reader of its layer alive, so it outlives the file system if it must.
+class CompressedFile : public vmofs::Vnode {
+ public:
+  CompressedFile(fs::Dispatcher* dispatcher,
+                 std::shared_ptr<const ArchiveReader> reader,
+                 ftl::StringView path)
+      : vmofs::Vnode(dispatcher),
+        reader_(std::move(reader)),
+        path_(path.ToString()) {}
+
+  mx_status_t Open(uint32_t flags) override {
+    vmofs::VnodeFile* file = GetFile();
+    return file ? file->Open(flags) : MX_ERR_IO;
+  }
+
+  ssize_t Read(void* data, size_t length, size_t offset) override {
+    vmofs::VnodeFile* file = GetFile();
+    return file ? file->Read(data, length, offset) : MX_ERR_IO;
+  }
+
+  mx_status_t Getattr(vnattr_t* attr) override {
+    vmofs::VnodeFile* file = GetFile();
+    return file ? file->Getattr(attr) : MX_ERR_IO;
+  }
+
+  mx_status_t GetHandles(uint32_t flags,
+                         mx_handle_t* handles,
+                         uint32_t* type,
+                         void* extra,
+                         uint32_t* extra_size) override {
+    vmofs::VnodeFile* file = GetFile();
+    return file ? file->GetHandles(flags, handles, type, extra, extra_size)
+                : MX_ERR_IO;
+  }
+
+ private:
+  // Returns the decompressed file, or null if it cannot be decompressed. The
+  // dispatcher calls vnodes from a single thread.
+  vmofs::VnodeFile* GetFile() {
+    if (!file_) {
+      uint64_t length = 0;
+      mx::vmo vmo = CopyToVMO(*reader_, path_);
+      if (!vmo || !reader_->GetFileLength(path_, &length))
+        return nullptr;
+      file_ = mxtl::AdoptRef(
+          new vmofs::VnodeFile(dispatcher_, vmo.get(), 0, length));
+      vmo_ = std::move(vmo);
+    }
+    return file_.get();
+  }
+
+  const std::shared_ptr<const ArchiveReader> reader_;
+  const std::string path_;
+  mx::vmo vmo_;
+  mxtl::RefPtr<vmofs::VnodeFile> file_;
+};
+
 void LeaveDirectory(fs::Dispatcher* dispatcher,
-                    ftl::StringView name,
                     std::vector<DirRecord>* stack) {
+  mxtl::StringPiece name = stack->back().name;
   auto child = stack->back().CreateDirectory(dispatcher);
   stack->pop_back();
   DirRecord& parent = stack->back();
-  parent.names.push_back(ToStringPiece(name));
+  parent.names.push_back(name);
   parent.children.push_back(std::move(child));
 }
 
-}  // namespace
+// VMOs are identified in an ArchiveCache by their kernel object id, which is
+// never reused, on a device that no file is on.
+constexpr uint64_t kVmoDevice = std::numeric_limits<uint64_t>::max();
+
+// Reads the archive in |vmo| in place from a read-only mapping, which lives as
+// long as the returned reader.
+std::shared_ptr<const ArchiveReader> ReadVMO(const mx::vmo& vmo,
+                                             uint64_t size) {
+  uintptr_t address = 0;
+  if (mx::vmar::root_self().map(0, vmo, 0, size, MX_VM_FLAG_PERM_READ,
+                                &address) != MX_OK)
+    return nullptr;
+  std::shared_ptr<ArchiveReader> reader(
+      new ArchiveReader(reinterpret_cast<const char*>(address), size),
+      [address, size](ArchiveReader* reader) {
+        delete reader;
+        mx::vmar::root_self().unmap(address, size);
+      });
+  if (!reader->Read())
+    return nullptr;
+  return reader;
+}
 
-FileSystem::FileSystem(mx::vmo vmo) : vmo_(vmo.get()) {
+// Returns a reader of the archive in |vmo|, shared through |cache| if it is
+// not null.
+std::shared_ptr<const ArchiveReader> OpenVMO(const mx::vmo& vmo,
+                                             ArchiveCache* cache) {
   uint64_t num_bytes = 0;
   mx_status_t status = vmo.get_size(&num_bytes);
-  if (status != MX_OK)
-    return;
-  ftl::UniqueFD fd(mxio_vmo_fd(vmo.release(), 0, num_bytes));
-  if (!fd.is_valid())
-    return;
-  reader_ = std::make_unique<ArchiveReader>(std::move(fd));
+  if (status != MX_OK || num_bytes == 0)
+    return nullptr;
+
+  ArchiveIdentity identity;
+  mx_info_handle_basic_t info;
+  if (!cache || vmo.get_info(MX_INFO_HANDLE_BASIC, &info, sizeof(info),
+                             nullptr, nullptr) != MX_OK)
+    return ReadVMO(vmo, num_bytes);
+
+  identity.device = kVmoDevice;
+  identity.inode = info.koid;
+  identity.size = num_bytes;
+  std::shared_ptr<const ArchiveReader> reader = cache->Lookup(identity);
+  if (reader)
+    return reader;
+  reader = ReadVMO(vmo, num_bytes);
+  if (!reader)
+    return nullptr;
+  return cache->Insert(identity, std::move(reader));
+}
+
+std::vector<mx::vmo> ToVector(mx::vmo vmo) {
+  std::vector<mx::vmo> vmos;
+  vmos.push_back(std::move(vmo));
+  return vmos;
+}
+
+}  // namespace
+
+FileSystem::FileSystem(mx::vmo vmo) : FileSystem(std::move(vmo), nullptr) {}
+
+FileSystem::FileSystem(mx::vmo vmo, ArchiveCache* cache)
+    : FileSystem(ToVector(std::move(vmo)), cache) {}
+
+FileSystem::FileSystem(std::vector<mx::vmo> layers, ArchiveCache* cache)
+    : layers_(std::move(layers)) {
+  std::vector<std::shared_ptr<const ArchiveReader>> readers;
+  for (const auto& vmo : layers_) {
+    std::shared_ptr<const ArchiveReader> reader = OpenVMO(vmo, cache);
+    if (!reader)
+      return;
+    readers.push_back(std::move(reader));
+  }
+  archive_ = std::make_unique<OverlayArchive>(std::move(readers));
   CreateDirectory();
 }
 
@@ -117,61 +267,98 @@ mx::channel FileSystem::OpenAsDirectory() {
 }
 
 mx::vmo FileSystem::GetFileAsVMO(ftl::StringView path) {
-  if (!reader_)
+  if (!archive_)
     return mx::vmo();
-  DirectoryTableEntry entry;
-  if (!reader_->GetDirectoryEntry(path, &entry))
+  const OverlayEntry* entry = archive_->Find(path);
+  if (!entry)
     return mx::vmo();
+  if (!IsClonable(*entry, path))
+    return CopyToVMO(archive_->layer(entry->layer), path);
   mx_handle_t result = MX_HANDLE_INVALID;
-  mx_vmo_clone(vmo_, MX_VMO_CLONE_COPY_ON_WRITE, entry.data_offset,
-               entry.data_length, &result);
+  mx_vmo_clone(layers_[entry->layer].get(), MX_VMO_CLONE_COPY_ON_WRITE,
+               entry->entry->data_offset, entry->entry->data_length, &result);
   return mx::vmo(result);
 }
 
 bool FileSystem::GetFileAsString(ftl::StringView path, std::string* result) {
-  if (!reader_)
+  if (!archive_)
     return false;
-  DirectoryTableEntry entry;
-  if (!reader_->GetDirectoryEntry(path, &entry))
-    return false;
-  std::string data;
-  data.resize(entry.data_length);
-  size_t actual;
-  mx_status_t status = mx_vmo_read(vmo_, &data[0], entry.data_offset,
-                                   entry.data_length, &actual);
-  if (status != MX_OK || actual != entry.data_length)
+  if (archive_->IsCompressed(path)) {
+    uint64_t length = 0;
+    if (!archive_->GetFileLength(path, &length))
+      return false;
+    std::string data;
+    data.resize(length);
+    if (!archive_->ReadFileRange(path, 0, length, &data[0]))
+      return false;
+    result->swap(data);
+    return true;
+  }
+  ftl::StringView contents;
+  if (!archive_->GetFileView(path, &contents))
     return false;
-  result->swap(data);
+  *result = contents.ToString();
   return true;
 }
 
-void FileSystem::CreateDirectory() {
-  if (!reader_ || !reader_->Read())
-    return;
+bool FileSystem::IsClonable(const OverlayEntry& entry,
+                            ftl::StringView path) const {
+  if (entry.entry->data_offset % kPageSize != 0)
+    return false;
+  const ArchiveReader& layer = archive_->layer(entry.layer);
+  return !layer.has_compressed_files() || !layer.IsCompressed(path);
+}
 
+mxtl::StringPiece FileSystem::CopyName(ftl::StringView name) {
+  names_.push_back(name.ToString());
+  return mxtl::StringPiece(names_.back().data(), names_.back().size());
+}
+
+void FileSystem::CreateDirectory() {
   std::vector<DirRecord> stack;
   stack.push_back(DirRecord());
-  ftl::StringView current_dir;
-
-  reader_->ListDirectory([&](const DirectoryTableEntry& entry) {
-    ftl::StringView path = reader_->GetPathView(entry);
-
-    while (path.substr(0, current_dir.size()) != current_dir)
-      LeaveDirectory(&dispatcher_, PopLastDirectory(&current_dir), &stack);
+  std::string current_dir;
+
+  archive_->ListEntries([&](const OverlayEntry& entry, ftl::StringView path) {
+    // The directories refer to the names of their children. Paths of layers
+    // with front-coded names are decoded into a reused buffer, so their
+    // names are copied.
+    const ArchiveReader& layer = archive_->layer(entry.layer);
+    auto to_name = [this, &layer](ftl::StringView name) {
+      return layer.has_front_coded_names() ? CopyName(name)
+                                           : ToStringPiece(name);
+    };
+
+    while (path.substr(0, current_dir.size()) !=
+           ftl::StringView(current_dir)) {
+      LeaveDirectory(&dispatcher_, &stack);
+      PopLastDirectory(&current_dir);
+    }
 
     ftl::StringView remaining = path.substr(current_dir.size());
-    while (PopFirstDirectory(&remaining))
-      stack.push_back(DirRecord());  // Enter directory.
+    ftl::StringView dir_name;
+    while (PopFirstDirectory(&remaining, &dir_name))
+      stack.push_back(DirRecord(to_name(dir_name)));  // Enter directory.
 
-    current_dir = path.substr(0, path.size() - remaining.size());
+    current_dir.assign(path.data(), path.size() - remaining.size());
 
     DirRecord& parent = stack.back();
-    parent.names.push_back(ToStringPiece(remaining));
-    parent.children.push_back(CreateFile(&dispatcher_, vmo_, entry));
+    parent.names.push_back(to_name(remaining));
+    // Uncompressed files are served in place from the VMO of their layer,
+    // at any alignment.
+    if (layer.has_compressed_files() && layer.IsCompressed(path)) {
+      parent.children.push_back(mxtl::AdoptRef(new CompressedFile(
+          &dispatcher_, archive_->shared_layer(entry.layer), path)));
+    } else {
+      parent.children.push_back(CreateFile(
+          &dispatcher_, layers_[entry.layer].get(), *entry.entry));
+    }
   });
 
-  while (!current_dir.empty())
-    LeaveDirectory(&dispatcher_, PopLastDirectory(&current_dir), &stack);
+  while (!current_dir.empty()) {
+    LeaveDirectory(&dispatcher_, &stack);
+    PopLastDirectory(&current_dir);
+  }
 
   FTL_DCHECK(stack.size() == 1);
 
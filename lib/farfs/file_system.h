@@ -6,13 +6,18 @@
 #define APPLICATION_LIB_FARFS_FARFS_H_
 
 #include <mx/channel.h>
+#include <mx/vmar.h>
 #include <mx/vmo.h>
 #include <vmofs/vmofs.h>
 
+#include <deque>
 #include <memory>
+#include <string>
+#include <vector>
 
+#include "application/lib/far/archive_cache.h"
 #include "application/lib/far/archive_reader.h"
-#include "lib/ftl/files/unique_fd.h"
+#include "application/lib/far/overlay_archive.h"
 #include "lib/mtl/vfs/vfs_dispatcher.h"
 
 namespace archive {
@@ -20,6 +25,17 @@ namespace archive {
 class FileSystem {
  public:
   explicit FileSystem(mx::vmo vmo);
+
+  // Shares the parsed archive with other file systems created from the same
+  // VMO through |cache|. Only callers that serve the same VMO repeatedly
+  // benefit, and each cached reader keeps its whole VMO mapped and is charged
+  // for it.
+  FileSystem(mx::vmo vmo, ArchiveCache* cache);
+
+  // Serves the archives in |layers|, ordered from the bottom of the stack to
+  // the top, as a single directory in which files in later archives shadow
+  // or white out files in earlier ones. See OverlayArchive.
+  FileSystem(std::vector<mx::vmo> layers, ArchiveCache* cache);
   ~FileSystem();
 
   // Serves a directory containing the contents of the archive on the given
@@ -35,7 +51,9 @@ class FileSystem {
   // Returns the contents of the the given path as a VMO.
   //
   // The VMO is a copy-on-write clone of the contents of the file, which means
-  // writes to the VMO do not mutate the data in the underlying archive.
+  // writes to the VMO do not mutate the data in the underlying archive. Files
+  // that are stored compressed or are not page aligned in the archive cannot
+  // be cloned and are copied into a new VMO instead.
   mx::vmo GetFileAsVMO(ftl::StringView path);
 
   // Returns the contents of the the given path as a string.
@@ -44,11 +62,25 @@ class FileSystem {
  private:
   void CreateDirectory();
 
-  // The owning reference to the vmo is stored inside |reader_| as a file
-  /// descriptor.
-  mx_handle_t vmo_;
+  // Returns whether the data of |entry|, at |path|, can be cloned from the VMO
+  // of its layer, which requires it to be stored uncompressed and page
+  // aligned.
+  bool IsClonable(const OverlayEntry& entry, ftl::StringView path) const;
+
+  // Returns a copy of |name| that lives as long as the file system.
+  mxtl::StringPiece CopyName(ftl::StringView name);
+
+  std::vector<mx::vmo> layers_;
   mtl::VFSDispatcher dispatcher_;
-  std::unique_ptr<ArchiveReader> reader_;
+
+  // Reads every layer from a read-only mapping of its VMO, which is unmapped
+  // when the reader of the layer is destroyed.
+  std::unique_ptr<OverlayArchive> archive_;
+
+  // Names of files and directories in layers with front-coded names, which
+  // the directories refer to. A deque never moves its elements.
+  std::deque<std::string> names_;
+
   mxtl::RefPtr<vmofs::VnodeDir> directory_;
 };
 
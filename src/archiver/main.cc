@@ -9,34 +9,71 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <chrono>
+
+#include "application/lib/far/archive_patch.h"
 #include "application/lib/far/archive_reader.h"
 #include "application/lib/far/archive_writer.h"
 #include "application/lib/far/manifest.h"
 #include "lib/ftl/command_line.h"
 #include "lib/ftl/files/unique_fd.h"
+#include "lib/ftl/strings/string_number_conversions.h"
 
 namespace archive {
 
 // Commands
 constexpr ftl::StringView kCat = "cat";
 constexpr ftl::StringView kCreate = "create";
+constexpr ftl::StringView kDiff = "diff";
 constexpr ftl::StringView kList = "list";
+constexpr ftl::StringView kExtract = "extract";
 constexpr ftl::StringView kExtractFile = "extract-file";
+constexpr ftl::StringView kPatch = "patch";
+constexpr ftl::StringView kUpdate = "update";
+constexpr ftl::StringView kVerify = "verify";
 
-constexpr ftl::StringView kKnownCommands = "create, list, cat, or extract-file";
+constexpr ftl::StringView kKnownCommands =
+    "create, update, list, cat, extract, extract-file, verify, diff, or "
+    "patch";
 
 // Options
 constexpr ftl::StringView kArchive = "archive";
 constexpr ftl::StringView kManifest = "manifest";
 constexpr ftl::StringView kFile = "file";
 constexpr ftl::StringView kOuput = "output";
+constexpr ftl::StringView kOutputDir = "output-dir";
+constexpr ftl::StringView kJobs = "jobs";
+constexpr ftl::StringView kDeduplicate = "deduplicate";
+constexpr ftl::StringView kStats = "stats";
+constexpr ftl::StringView kLayoutProfile = "layout-profile";
+constexpr ftl::StringView kAlign = "align";
+constexpr ftl::StringView kFrontCodeNames = "front-code-names";
+constexpr ftl::StringView kOld = "old";
+constexpr ftl::StringView kNew = "new";
+constexpr ftl::StringView kPatchPath = "patch";
+
+constexpr ftl::StringView kStdout = "-";
 
 constexpr ftl::StringView kCatUsage = "cat --archive=<archive> --file=<path> ";
 constexpr ftl::StringView kCreateUsage =
-    "create --archive=<archive> --manifest=<manifest>";
+    "create --archive=<archive|-> --manifest=<manifest> [--jobs=<count>] "
+    "[--deduplicate] [--align=<bytes>] [--front-code-names] "
+    "[--layout-profile=<profile>] [--stats]";
+constexpr ftl::StringView kUpdateUsage =
+    "update --archive=<archive> --manifest=<manifest> [--jobs=<count>] "
+    "[--deduplicate] [--align=<bytes>] [--front-code-names] "
+    "[--layout-profile=<profile>] [--stats]";
 constexpr ftl::StringView kListUsage = "list --archive=<archive>";
+constexpr ftl::StringView kExtractUsage =
+    "extract --archive=<archive> --output-dir=<path> [--jobs=<count>]";
 constexpr ftl::StringView kExtractFileUsage =
     "extract-file --archive=<archive> --file=<path> --output=<path>";
+constexpr ftl::StringView kVerifyUsage =
+    "verify --archive=<archive> [--jobs=<count>]";
+constexpr ftl::StringView kDiffUsage =
+    "diff --old=<archive> --new=<archive> --output=<patch> [--stats]";
+constexpr ftl::StringView kPatchUsage =
+    "patch --old=<archive> --patch=<patch> --output=<archive>";
 
 bool GetOptionValue(const ftl::CommandLine& command_line,
                     ftl::StringView option,
@@ -52,6 +89,65 @@ bool GetOptionValue(const ftl::CommandLine& command_line,
   return true;
 }
 
+// Reads the optional --jobs argument. Zero means one job per core.
+bool GetJobCount(const ftl::CommandLine& command_line,
+                 ftl::StringView usage,
+                 size_t* jobs) {
+  *jobs = 0;
+  std::string value;
+  if (!command_line.GetOptionValue(kJobs, &value))
+    return true;
+  if (!ftl::StringToNumberWithError(value, jobs)) {
+    fprintf(stderr,
+            "error: Invalid --%s argument: '%s'.\n"
+            "Usuage: far %s\n",
+            kJobs.data(), value.c_str(), usage.data());
+    return false;
+  }
+  return true;
+}
+
+// Reads the optional --align argument into the default alignment of
+// |writer|.
+bool SetAlignment(const ftl::CommandLine& command_line,
+                  ftl::StringView usage,
+                  archive::ArchiveWriter* writer) {
+  std::string value;
+  if (!command_line.GetOptionValue(kAlign, &value))
+    return true;
+  uint64_t alignment = 0;
+  if (!ftl::StringToNumberWithError(value, &alignment) ||
+      !writer->set_default_alignment(alignment)) {
+    fprintf(stderr,
+            "error: Invalid --%s argument: '%s'.\n"
+            "Usuage: far %s\n",
+            kAlign.data(), value.c_str(), usage.data());
+    return false;
+  }
+  return true;
+}
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Stats go to stderr so that they do not mix with an archive streamed to
+// stdout.
+void PrintStats(double manifest_seconds, const archive::WriteStats& stats) {
+  fprintf(stderr, "files:    %llu\n",
+          static_cast<unsigned long long>(stats.file_count));
+  fprintf(stderr, "bytes:    %llu\n",
+          static_cast<unsigned long long>(stats.archive_length));
+  fprintf(stderr, "manifest: %.3fs\n", manifest_seconds);
+  fprintf(stderr, "stat:     %.3fs\n", stats.stat_seconds);
+  fprintf(stderr, "compress: %.3fs\n", stats.compress_seconds);
+  fprintf(stderr, "hash:     %.3fs\n", stats.hash_seconds);
+  fprintf(stderr, "layout:   %.3fs\n", stats.layout_seconds);
+  fprintf(stderr, "copy:     %.3fs\n", stats.copy_seconds);
+}
+
 int Create(const ftl::CommandLine& command_line) {
   std::string archive_path;
   if (!GetOptionValue(command_line, kArchive, kCreateUsage, &archive_path))
@@ -62,16 +158,98 @@ int Create(const ftl::CommandLine& command_line) {
   if (manifest_paths.empty())
     return -1;
 
+  size_t jobs = 0;
+  if (!GetJobCount(command_line, kCreateUsage, &jobs))
+    return -1;
+
+  archive::ArchiveWriter writer;
+  writer.set_jobs(jobs);
+  writer.set_deduplicate(command_line.HasOption(kDeduplicate));
+  writer.set_front_coded_names(command_line.HasOption(kFrontCodeNames));
+  if (!SetAlignment(command_line, kCreateUsage, &writer))
+    return -1;
+  auto start = std::chrono::steady_clock::now();
+  for (const auto& manifest_path : manifest_paths) {
+    if (!archive::ReadManifest(manifest_path, &writer))
+      return -1;
+  }
+  double manifest_seconds = SecondsSince(start);
+  std::string layout_profile;
+  if (command_line.GetOptionValue(kLayoutProfile, &layout_profile) &&
+      !archive::ReadLayoutProfile(layout_profile, &writer))
+    return -1;
+  // An archive path of "-" streams the archive to stdout.
+  ftl::UniqueFD fd;
+  if (archive_path != kStdout) {
+    fd.reset(open(archive_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+    if (!fd.is_valid())
+      return -1;
+  }
+  if (!writer.Write(fd.is_valid() ? fd.get() : STDOUT_FILENO))
+    return -1;
+  if (command_line.HasOption(kStats))
+    PrintStats(manifest_seconds, writer.stats());
+  return 0;
+}
+
+// Rebuilds an existing archive from the given manifests, carrying the data of
+// unchanged files over from the old archive. The new archive is written next
+// to the old one and then renamed over it.
+int Update(const ftl::CommandLine& command_line) {
+  std::string archive_path;
+  if (!GetOptionValue(command_line, kArchive, kUpdateUsage, &archive_path))
+    return -1;
+
+  std::vector<ftl::StringView> manifest_paths =
+      command_line.GetOptionValues(kManifest);
+  if (manifest_paths.empty())
+    return -1;
+
+  size_t jobs = 0;
+  if (!GetJobCount(command_line, kUpdateUsage, &jobs))
+    return -1;
+
+  ftl::UniqueFD base_fd(open(archive_path.c_str(), O_RDONLY));
+  if (!base_fd.is_valid()) {
+    fprintf(stderr, "error: Failed to open '%s'.\n", archive_path.c_str());
+    return -1;
+  }
+  archive::ArchiveReader base(std::move(base_fd));
+  if (!base.Read())
+    return -1;
+
   archive::ArchiveWriter writer;
+  writer.set_jobs(jobs);
+  writer.set_deduplicate(command_line.HasOption(kDeduplicate));
+  writer.set_front_coded_names(command_line.HasOption(kFrontCodeNames));
+  writer.set_base_archive(&base);
+  if (!SetAlignment(command_line, kUpdateUsage, &writer))
+    return -1;
+  auto start = std::chrono::steady_clock::now();
   for (const auto& manifest_path : manifest_paths) {
     if (!archive::ReadManifest(manifest_path, &writer))
       return -1;
   }
-  ftl::UniqueFD fd(open(archive_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+  double manifest_seconds = SecondsSince(start);
+  std::string layout_profile;
+  if (command_line.GetOptionValue(kLayoutProfile, &layout_profile) &&
+      !archive::ReadLayoutProfile(layout_profile, &writer))
+    return -1;
+
+  std::string temp_path = archive_path + ".tmp";
+  ftl::UniqueFD fd(open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC,
                         S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
   if (!fd.is_valid())
     return -1;
-  return writer.Write(fd.get()) ? 0 : -1;
+  if (!writer.Write(fd.get()) ||
+      rename(temp_path.c_str(), archive_path.c_str()) != 0) {
+    unlink(temp_path.c_str());
+    return -1;
+  }
+  if (command_line.HasOption(kStats))
+    PrintStats(manifest_seconds, writer.stats());
+  return 0;
 }
 
 int List(const ftl::CommandLine& command_line) {
@@ -83,7 +261,7 @@ int List(const ftl::CommandLine& command_line) {
   if (!fd.is_valid())
     return -1;
   archive::ArchiveReader reader(std::move(fd));
-  if (!reader.Read())
+  if (!reader.MapAndRead())
     return -1;
   reader.ListPaths([](ftl::StringView string) {
     printf("%.*s\n", static_cast<int>(string.size()), string.data());
@@ -91,6 +269,30 @@ int List(const ftl::CommandLine& command_line) {
   return 0;
 }
 
+int Extract(const ftl::CommandLine& command_line) {
+  std::string archive_path;
+  if (!GetOptionValue(command_line, kArchive, kExtractUsage, &archive_path))
+    return -1;
+
+  std::string output_dir;
+  if (!GetOptionValue(command_line, kOutputDir, kExtractUsage, &output_dir))
+    return -1;
+
+  archive::ExtractOptions options;
+  if (!GetJobCount(command_line, kExtractUsage, &options.jobs))
+    return -1;
+
+  ftl::UniqueFD fd(open(archive_path.c_str(), O_RDONLY));
+  if (!fd.is_valid())
+    return -1;
+  archive::ArchiveReader reader(std::move(fd));
+  if (!reader.MapAndRead())
+    return -1;
+  if (!reader.ExtractAll(output_dir, options))
+    return -1;
+  return 0;
+}
+
 int ExtractFile(const ftl::CommandLine& command_line) {
   std::string archive_path;
   if (!GetOptionValue(command_line, kArchive, kExtractFileUsage, &archive_path))
@@ -108,7 +310,7 @@ int ExtractFile(const ftl::CommandLine& command_line) {
   if (!fd.is_valid())
     return -1;
   archive::ArchiveReader reader(std::move(fd));
-  if (!reader.Read())
+  if (!reader.MapAndRead())
     return -1;
   if (!reader.ExtractFile(file_path, output_path.c_str()))
     return -1;
@@ -128,22 +330,126 @@ int Cat(const ftl::CommandLine& command_line) {
   if (!fd.is_valid())
     return -1;
   archive::ArchiveReader reader(std::move(fd));
-  if (!reader.Read())
+  if (!reader.MapAndRead())
     return -1;
   if (!reader.CopyFile(file_path, STDOUT_FILENO))
     return -1;
   return 0;
 }
 
+int Verify(const ftl::CommandLine& command_line) {
+  std::string archive_path;
+  if (!GetOptionValue(command_line, kArchive, kVerifyUsage, &archive_path))
+    return -1;
+
+  size_t jobs = 0;
+  if (!GetJobCount(command_line, kVerifyUsage, &jobs))
+    return -1;
+
+  ftl::UniqueFD fd(open(archive_path.c_str(), O_RDONLY));
+  if (!fd.is_valid())
+    return -1;
+  archive::ArchiveReader reader(std::move(fd));
+  if (!reader.MapAndRead())
+    return -1;
+  if (!reader.VerifyAll(jobs))
+    return -1;
+  return 0;
+}
+
+// Writes a patch that rebuilds the new archive from the old one.
+int Diff(const ftl::CommandLine& command_line) {
+  std::string old_path;
+  if (!GetOptionValue(command_line, kOld, kDiffUsage, &old_path))
+    return -1;
+
+  std::string new_path;
+  if (!GetOptionValue(command_line, kNew, kDiffUsage, &new_path))
+    return -1;
+
+  std::string output_path;
+  if (!GetOptionValue(command_line, kOuput, kDiffUsage, &output_path))
+    return -1;
+
+  ftl::UniqueFD old_fd(open(old_path.c_str(), O_RDONLY));
+  ftl::UniqueFD new_fd(open(new_path.c_str(), O_RDONLY));
+  if (!old_fd.is_valid() || !new_fd.is_valid())
+    return -1;
+  ftl::UniqueFD patch_fd(open(output_path.c_str(),
+                              O_WRONLY | O_CREAT | O_TRUNC,
+                              S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+  if (!patch_fd.is_valid())
+    return -1;
+  archive::PatchStats stats;
+  if (!archive::DiffArchives(old_fd.get(), new_fd.get(), patch_fd.get(),
+                             &stats))
+    return -1;
+  if (command_line.HasOption(kStats)) {
+    fprintf(stderr, "copy:   %llu\n",
+            static_cast<unsigned long long>(stats.copy_length));
+    fprintf(stderr, "insert: %llu\n",
+            static_cast<unsigned long long>(stats.insert_length));
+    fprintf(stderr, "zero:   %llu\n",
+            static_cast<unsigned long long>(stats.zero_length));
+    fprintf(stderr, "patch:  %llu\n",
+            static_cast<unsigned long long>(stats.patch_length));
+  }
+  return 0;
+}
+
+// Rebuilds a new archive from an old one and a patch made by |Diff|. The new
+// archive is written next to the output path and renamed over it once it has
+// been verified.
+int Patch(const ftl::CommandLine& command_line) {
+  std::string old_path;
+  if (!GetOptionValue(command_line, kOld, kPatchUsage, &old_path))
+    return -1;
+
+  std::string patch_path;
+  if (!GetOptionValue(command_line, kPatchPath, kPatchUsage, &patch_path))
+    return -1;
+
+  std::string output_path;
+  if (!GetOptionValue(command_line, kOuput, kPatchUsage, &output_path))
+    return -1;
+
+  ftl::UniqueFD old_fd(open(old_path.c_str(), O_RDONLY));
+  ftl::UniqueFD patch_fd(open(patch_path.c_str(), O_RDONLY));
+  if (!old_fd.is_valid() || !patch_fd.is_valid())
+    return -1;
+
+  std::string temp_path = output_path + ".tmp";
+  ftl::UniqueFD fd(open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+  if (!fd.is_valid())
+    return -1;
+  if (!archive::ApplyPatch(old_fd.get(), patch_fd.get(), fd.get()) ||
+      rename(temp_path.c_str(), output_path.c_str()) != 0) {
+    unlink(temp_path.c_str());
+    return -1;
+  }
+  return 0;
+}
+
 int RunCommand(std::string command, const ftl::CommandLine& command_line) {
   if (command == kCreate) {
     return archive::Create(command_line);
+  } else if (command == kUpdate) {
+    return archive::Update(command_line);
   } else if (command == kList) {
     return archive::List(command_line);
+  } else if (command == kExtract) {
+    return archive::Extract(command_line);
   } else if (command == kExtractFile) {
     return archive::ExtractFile(command_line);
   } else if (command == kCat) {
     return archive::Cat(command_line);
+  } else if (command == kVerify) {
+    return archive::Verify(command_line);
+  } else if (command == kDiff) {
+    return archive::Diff(command_line);
+  } else if (command == kPatch) {
+    return archive::Patch(command_line);
   } else {
     fprintf(stderr,
             "error: Unknown command: %s\n"
@@ -464,6 +464,8 @@ void ApplicationEnvironmentImpl::CreateApplicationFromArchive(
     ApplicationPackagePtr package,
     ApplicationLaunchInfoPtr launch_info,
     fidl::InterfaceRequest<ApplicationController> controller) {
+  // Packages are not cached, since the loader reads each launch into a new
+  // VMO and cached readers would pin those VMOs without ever being reused.
   auto file_system =
       std::make_unique<archive::FileSystem>(std::move(package->data));
   mx::channel pkg = file_system->OpenAsDirectory();